@@ -0,0 +1,307 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "alloc.h"
+#include "cobalt.h"
+#include "parse/parse.h"
+
+#include "common/str.h"
+#include "common/util.h"
+#include "common/vec.h"
+
+// front end throughput benchmark.
+// every input gets run through phases 3 to 7 (1 and 2 are folded into 3), once per repeat, and we print one line per
+// phase per file as tab separated values, so two runs can be diffed or loaded into anything that reads tsv.
+//
+// each run happens in a forked child. that way every file starts with an empty atom table and source table like it
+// would in a real compile, a crash() in the middle of a file doesnt take the whole benchmark down, and the peak rss
+// we read back belongs to that file alone.
+//
+// columns:
+//   file          the input, or synthetic-<n>k for generated ones
+//   phase         3 to 7, or "all" for the sum
+//   status        ok, error (the phase returned an error) or crash (the child died)
+//   bytes         size of the input file. headers pulled in by phase 4 arent counted
+//   tokens        tokens in the stream once the phase is done
+//   ns            fastest time for the phase across all repeats
+//   mb_per_s      bytes / ns, in MB (10^6) per second
+//   tokens_per_s  tokens / ns
+//   peak_rss_kb   the childs peak resident set once the phase is done. this only ever goes up, so the
+//                 difference between two phases is what that phase added to the peak
+
+#define BENCH_FIRST_PHASE 3
+#define BENCH_LAST_PHASE 7
+#define BENCH_PHASES (BENCH_LAST_PHASE - BENCH_FIRST_PHASE + 1)
+
+typedef enum {
+    BENCH_OK,
+    BENCH_ERROR,
+    BENCH_CRASH,
+    BENCH_NOT_RUN,
+} bench_status;
+
+char* bench_status_str[] = {"ok", "error", "crash", "not_run"};
+
+// what a child sends back up the pipe, once per phase it finishes
+typedef struct {
+    u32 phase;
+    u32 status;
+    u64 ns;
+    u64 tokens;
+    u64 peak_rss_kb;
+} bench_row;
+
+typedef struct {
+    Vec(string) files;
+    Vec(string) include_paths;
+    Vec(u32) synthetic_kb;
+    u32 repeat;
+} bench_opts;
+
+u64 bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+u64 bench_peak_rss_kb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+void bench_usage() {
+    printf("Usage: ./cobalt-bench [options] files...\n");
+    printf("Runs translation phases 3 to 7 over each file and prints per phase timings as tsv.\n");
+    printf("\t -I <path>:          Add an include path, searched before the system defaults\n");
+    printf("\t -repeat <n>:        Run each file n times and keep the fastest time (default 5)\n");
+    printf("\t -synthetic <kb>:    Also bench a generated file of roughly kb kilobytes. can be given more than once\n");
+    printf("\t -h:                 Prints this help info\n");
+}
+
+// the synthetic input is a deterministic mix of what real code spends its time on:
+// comments, declarations, object and function-like macros, string and number literals.
+// its generated the same way every time, so numbers from different commits stay comparable.
+string bench_synthetic_path(u32 kb) {
+    string path = strprintf("/tmp/cobalt-bench-%d-%uk.c", getpid(), kb);
+    FILE* out = fopen(path.raw, "w");
+    if (out == NULL) {
+        fprintf(stderr, "unable to create synthetic input "str_fmt": %s\n", str_arg(path), strerror(errno));
+        exit(-1);
+    }
+
+    fprintf(out, "// synthetic benchmark input, %uk\n", kb);
+    fprintf(out, "#define BENCH_WIDTH 64\n");
+    fprintf(out, "#define BENCH_MAX(a, b) ((a) > (b) ? (a) : (b))\n");
+    fprintf(out, "#define BENCH_STR(x) #x\n");
+    fprintf(out, "#define BENCH_CAT(a, b) a ## b\n\n");
+
+    u32 seed = 0x12345678;
+    for (u32 i = 0; ftell(out) < (long)kb * 1024; i++) {
+        //a plain lcg is plenty for picking which line comes next
+        seed = seed * 1103515245 + 12345;
+        switch ((seed >> 16) % 6) {
+            case 0:
+                fprintf(out, "/* block comment %u, with some text in it so the comment scanner has a run to do */\n", i);
+                break;
+            case 1:
+                fprintf(out, "static unsigned long bench_var_%u = %uul + 0x%x; // line comment\n", i, seed, seed >> 8);
+                break;
+            case 2:
+                fprintf(out, "int bench_fn_%u(int a, int b) { return BENCH_MAX(a, b) * BENCH_WIDTH + %u; }\n", i, i);
+                break;
+            case 3:
+                fprintf(out, "const char* bench_str_%u = \"string literal number %u\" \"joined\";\n", i, i);
+                break;
+            case 4:
+                fprintf(out, "const char* BENCH_CAT(bench_name_, %u) = BENCH_STR(token list %u + 1.5e3);\n", i, i);
+                break;
+            case 5:
+                fprintf(out, "double bench_float_%u = %u.%ue-3 * (BENCH_WIDTH >> 2) - 'c';\n", i, seed % 1000, i);
+                break;
+        }
+    }
+    fclose(out);
+    return path;
+}
+
+void bench_send(int fd, u32 phase, bench_status status, u64 ns, parser_ctx* pctx) {
+    bench_row row = {.phase = phase,
+                     .status = status,
+                     .ns = ns,
+                     .tokens = vec_len(pctx->tokens),
+                     .peak_rss_kb = bench_peak_rss_kb()};
+    write(fd, &row, sizeof(row));
+}
+
+void bench_child(bench_opts* opts, string path, int fd) {
+    //the compiler talks a lot on stdout, and none of it is useful here
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull != -1) dup2(devnull, STDOUT_FILENO);
+
+    cobalt_ctx ctx = {.output_path = strlit(""),
+                      .curr_file = path,
+                      .implicit_output = false,
+                      .no_colour = true,
+                      .include_paths = vec_new(string, 1)};
+    for_vec(string* inc, &opts->include_paths) vec_append(&ctx.include_paths, *inc);
+    vec_append(&ctx.include_paths, strlit("/usr/include/"));
+    vec_append(&ctx.include_paths, strlit("/usr/include/linux/"));
+
+    source_file* src = source_open(path);
+    if (src == NULL) exit(-1);
+
+    parser_ctx* pctx = cmalloc(sizeof(*pctx));
+    *pctx = (parser_ctx){.tokens = vec_new(token, 1),
+                         .src = src,
+                         .curr_offset = 0,
+                         .ctx = &ctx,
+                         .defines = macro_table_new()};
+    ctx.pctx = pctx;
+
+    int (*phases[BENCH_PHASES])(parser_ctx*) = {parser_phase3, parser_phase4, parser_phase5, parser_phase6, parser_phase7};
+    for_n(i, 0, BENCH_PHASES) {
+        u64 start = bench_now_ns();
+        int retval = phases[i](pctx);
+        u64 ns = bench_now_ns() - start;
+        bool failed = retval != 0;
+        bench_send(fd, BENCH_FIRST_PHASE + i, failed ? BENCH_ERROR : BENCH_OK, ns, pctx);
+        if (failed) break;
+    }
+    exit(0);
+}
+
+typedef struct {
+    bench_status status;
+    u64 ns;
+    u64 tokens;
+    u64 peak_rss_kb;
+} bench_result;
+
+void bench_file(bench_opts* opts, string path, string name) {
+    struct stat st;
+    if (stat(clone_to_cstring(path), &st) != 0) {
+        fprintf(stderr, "unable to open file "str_fmt": %s\n", str_arg(path), strerror(errno));
+        return;
+    }
+
+    bench_result results[BENCH_PHASES];
+    for_n(i, 0, BENCH_PHASES) results[i] = (bench_result){.status = BENCH_NOT_RUN, .ns = UINT64_MAX};
+
+    for_n(run, 0, opts->repeat) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            fprintf(stderr, "pipe failed: %s\n", strerror(errno));
+            exit(-1);
+        }
+        //anything still sitting in our buffer would get printed twice otherwise
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            bench_child(opts, path, fds[1]);
+        }
+        close(fds[1]);
+
+        bench_row row;
+        u32 next_phase = BENCH_FIRST_PHASE;
+        bool stopped = false;
+        while (read(fds[0], &row, sizeof(row)) == sizeof(row)) {
+            bench_result* res = &results[row.phase - BENCH_FIRST_PHASE];
+            if (row.ns < res->ns) res->ns = row.ns;
+            if (row.peak_rss_kb > res->peak_rss_kb) res->peak_rss_kb = row.peak_rss_kb;
+            res->tokens = row.tokens;
+            if (res->status == BENCH_NOT_RUN || row.status > res->status) res->status = row.status;
+            next_phase = row.phase + 1;
+            if (row.status != BENCH_OK) stopped = true;
+        }
+        close(fds[0]);
+
+        int wstatus;
+        waitpid(pid, &wstatus, 0);
+        bool clean_exit = WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0;
+        //the child died partway through a phase, so that phase gets the blame
+        if (!clean_exit && !stopped && next_phase <= BENCH_LAST_PHASE) {
+            results[next_phase - BENCH_FIRST_PHASE].status = BENCH_CRASH;
+        }
+    }
+
+    u64 total_ns = 0;
+    u64 total_tokens = 0;
+    u64 total_rss = 0;
+    bench_status total_status = BENCH_OK;
+    for_n(i, 0, BENCH_PHASES) {
+        bench_result* res = &results[i];
+        if (res->status == BENCH_NOT_RUN || res->ns == UINT64_MAX) {
+            if (res->status != BENCH_NOT_RUN && total_status == BENCH_OK) total_status = res->status;
+            printf(str_fmt"\t%d\t%s\t%ld\t-\t-\t-\t-\t-\n", str_arg(name), BENCH_FIRST_PHASE + (int)i,
+                   bench_status_str[res->status], (long)st.st_size);
+            continue;
+        }
+        if (res->status != BENCH_OK && total_status == BENCH_OK) total_status = res->status;
+        total_ns += res->ns;
+        total_tokens = res->tokens;
+        total_rss = res->peak_rss_kb;
+        //a phase that does nothing can finish inside the clock's resolution
+        double secs = res->ns ? res->ns / 1e9 : 1e-9;
+        printf(str_fmt"\t%d\t%s\t%ld\t%lu\t%lu\t%.2f\t%.0f\t%lu\n", str_arg(name), BENCH_FIRST_PHASE + (int)i,
+               bench_status_str[res->status], (long)st.st_size, res->tokens, res->ns,
+               st.st_size / secs / 1e6, res->tokens / secs, res->peak_rss_kb);
+    }
+    double secs = total_ns ? total_ns / 1e9 : 1e-9;
+    printf(str_fmt"\tall\t%s\t%ld\t%lu\t%lu\t%.2f\t%.0f\t%lu\n", str_arg(name), bench_status_str[total_status],
+           (long)st.st_size, total_tokens, total_ns, st.st_size / secs / 1e6, total_tokens / secs, total_rss);
+}
+
+int main(int argc, char* argv[]) {
+    bench_opts opts = {.files = vec_new(string, 16),
+                       .include_paths = vec_new(string, 1),
+                       .synthetic_kb = vec_new(u32, 1),
+                       .repeat = 5};
+
+    for (int i = 1; i < argc; i++) {
+        string arg = string_wrap(argv[i]);
+        if (string_eq(arg, strlit("-h"))) {
+            bench_usage();
+            return 0;
+        }
+        if (string_eq(arg, strlit("-I")) || string_eq(arg, strlit("-repeat")) || string_eq(arg, strlit("-synthetic"))) {
+            if (i + 1 >= argc) {
+                bench_usage();
+                return -1;
+            }
+            i++;
+            string value = string_wrap(argv[i]);
+            if (string_eq(arg, strlit("-I"))) vec_append(&opts.include_paths, value);
+            else if (string_eq(arg, strlit("-repeat"))) opts.repeat = strtoul(value.raw, NULL, 10);
+            else vec_append(&opts.synthetic_kb, (u32)strtoul(value.raw, NULL, 10));
+            continue;
+        }
+        if (arg.len > 2 && arg.raw[0] == '-' && arg.raw[1] == 'I') {
+            vec_append(&opts.include_paths, string_make(arg.raw + 2, arg.len - 2));
+            continue;
+        }
+        vec_append(&opts.files, arg);
+    }
+    if (opts.repeat == 0) opts.repeat = 1;
+
+    //build the lexer tables once up here, so every child gets them for free and phase 3 only times lexing
+    lex_init();
+
+    printf("file\tphase\tstatus\tbytes\ttokens\tns\tmb_per_s\ttokens_per_s\tpeak_rss_kb\n");
+    for_vec(string* file, &opts.files) bench_file(&opts, *file, *file);
+    for_vec(u32* kb, &opts.synthetic_kb) {
+        string path = bench_synthetic_path(*kb);
+        bench_file(&opts, path, strprintf("synthetic-%uk", *kb));
+        unlink(path.raw);
+    }
+    return 0;
+}
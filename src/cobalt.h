@@ -11,6 +11,13 @@ typedef struct {
     string curr_file;
     bool implicit_output;
     bool no_colour;
+    //-emit-pch turns curr_file into a pch at output_path, and -include-pch starts from one. see pch.c
+    bool emit_pch;
+    string include_pch;
+    //-E, which stops after phase 4 and writes the tokens out to output_path (or stdout, if its -)
+    bool preprocess_only;
+    //-header-report=file, where every header phase 4 includes gets written up as a trace. see report.c
+    string header_report;
     Vec(string) args;
     parser_ctx* pctx;
     Vec(string) include_paths;
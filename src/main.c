@@ -15,7 +15,7 @@ int cobalt_main(int argc, char* argv[]);
 
 #ifndef FUZZ
 int main(int argc, char* argv[]) {
-    cobalt_main(argc, argv);    
+    return cobalt_main(argc, argv) == 0 ? 0 : 1;
 }
 #else
 int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
@@ -46,6 +46,10 @@ int cobalt_main(int argc, char* argv[]) {
                       .curr_file = strlit(""),
                       .implicit_output = false,
                       .no_colour = false,
+                      .emit_pch = false,
+                      .include_pch = strlit(""),
+                      .preprocess_only = false,
+                      .header_report = strlit(""),
                       .include_paths = vec_new(string, 1)};
     //default family of system headers
 
@@ -65,15 +69,21 @@ int cobalt_main(int argc, char* argv[]) {
 
     if (ctx.output_path.len == 0) {
         ctx.implicit_output = true;
-        ctx.output_path = strprintf(str_fmt".out", str_arg(string_make(ctx.curr_file.raw, ctx.curr_file.len - 2)));
+        //-E goes to stdout unless its told otherwise, same as everyone else
+        if (ctx.preprocess_only) ctx.output_path = strlit("-");
+        else if (ctx.emit_pch) ctx.output_path = strprintf(str_fmt".pch", str_arg(ctx.curr_file));
+        else ctx.output_path = strprintf(str_fmt".out", str_arg(string_make(ctx.curr_file.raw, ctx.curr_file.len - 2)));
     }
 
-    int retval = parse_file(&ctx, false);
+    int retval = parse_file(&ctx);
+    //a report of a file that didnt make it through is still worth having, so it gets written either way
+    if (ctx.header_report.len != 0 && report_write(ctx.header_report) != 0) retval = -1;
     if (retval == 0) {
         //more corpses
     }
 
-    return 0;
+    //whatever went wrong has been printed already. make and friends just need to know that it did
+    return retval;
 }
 
 void display_help() {
@@ -81,6 +91,10 @@ void display_help() {
     printf("Cobalt C Compiler options:\n");
     printf("\t -o <filename>:     Specify an output filename\n");
     printf("\t -I <path>:         Specify an include path that is searched before the system defaults\n");
+    printf("\t -E:                Preprocess only, writing the result to stdout (or the -o file)\n");
+    printf("\t -emit-pch:         Preprocess a header into a pch (filename.h.pch, unless -o says otherwise)\n");
+    printf("\t -include-pch <pch>: Start from the state a pch was made in, as if its header was included first\n");
+    printf("\t -header-report=<file>: Write what each included header cost as chrome trace event json\n");
     printf("\t -nocol:            Disables ansi escape sequences during printing\n");
     printf("\t -h:                Prints this help info\n");
     return;
@@ -115,6 +129,31 @@ void parse_args(cobalt_ctx* ctx) {
             exit(-1);
         }
 
+        if (string_eq(*arg, strlit("-E"))) {
+            ctx->preprocess_only = true;
+            continue;
+        }
+
+        if (string_eq(*arg, strlit("-emit-pch"))) {
+            ctx->emit_pch = true;
+            continue;
+        }
+
+        if (string_eq(*arg, strlit("-include-pch"))) {
+            if (i + 1 >= vec_len(ctx->args)) {
+                display_help();
+                exit(-1);
+            }
+            i++;
+            ctx->include_pch = ctx->args[i];
+            continue;
+        }
+
+        if (arg->len > strlen("-header-report=") && string_eq(string_make(arg->raw, strlen("-header-report=")), strlit("-header-report="))) {
+            ctx->header_report = string_make(arg->raw + strlen("-header-report="), arg->len - strlen("-header-report="));
+            continue;
+        }
+
 
         //get first 2 chars of arg to see if its an include
         string new_arg = *arg;
@@ -136,13 +175,24 @@ void parse_args(cobalt_ctx* ctx) {
             continue;
         }
 
-        //scan end of this string to see if its .c
+        //scan end of this string to see if its .c, or .h if we're making a pch out of it
         new_arg = *arg;
         new_arg.raw = new_arg.raw + arg->len - 2;
         new_arg.len = 2;
-        if (string_eq(new_arg, strlit(".c"))) {
+        if (string_eq(new_arg, strlit(".c")) || string_eq(new_arg, strlit(".h"))) {
             //we've got a file name
             ctx->curr_file = *arg;
         }
     }
+
+    //a header on its own is only any good for making a pch out of
+    string ext = ctx->curr_file;
+    if (ext.len >= 2 && !ctx->emit_pch) {
+        ext.raw = ext.raw + ext.len - 2;
+        ext.len = 2;
+        if (string_eq(ext, strlit(".h"))) {
+            printf(str_fmt" is a header, which can only be given with -emit-pch\n", str_arg(ctx->curr_file));
+            exit(-1);
+        }
+    }
 }
\ No newline at end of file
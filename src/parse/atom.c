@@ -0,0 +1,73 @@
+#include "alloc.h"
+#include "cobalt.h"
+#include "crash.h"
+#include "parse.h"
+
+#include "common/str.h"
+#include "common/vec.h"
+
+// the atom table. every identifier we lex gets interned here, and from then on its just a u32.
+// the strings are views into the source (or scratch) the identifier first turned up in, which never go away.
+// atom 0 is never handed out, and the predefined atoms in parse.h always get the ids right after it.
+// keywords are interned up front too, and remember which keyword they are, so classifying one is just an index.
+
+typedef struct {
+    string str;
+    //TOK_INVALID if this isnt a keyword
+    token_type keyword;
+} atom_entry;
+
+Vec(atom_entry) atom_entries = NULL;
+slot_table atom_slots = {0};
+
+u32 atom_hash(string str) {
+    //fnv-1a. identifiers are short, so theres not much to gain from anything fancier
+    u32 hash = 2166136261u;
+    for (size_t i = 0; i < str.len; i++) {
+        hash ^= (u8)str.raw[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool atom_match(void* key, u32 atom) {
+    return string_eq(atom_entries[atom].str, *(string*)key);
+}
+
+void atom_init() {
+    atom_entries = vec_new(atom_entry, 1024);
+    vec_append(&atom_entries, ((atom_entry){.str = strlit(""), .keyword = TOK_INVALID}));
+#define ATOM(name, str) if (atom_intern(strlit(str)) != (name)) crash("predefined atom " #name " got the wrong id!");
+    PREDEFINED_ATOMS
+#undef ATOM
+#define TOKEN(tok, str) atom_entries[atom_intern(strlit(str))].keyword = (tok);
+    KEYWORDS
+#undef TOKEN
+}
+
+u32 atom_intern(string str) {
+    if (atom_entries == NULL) atom_init();
+    return atom_intern_hashed(str, atom_hash(str));
+}
+
+u32 atom_intern_hashed(string str, u32 hash) {
+    //for when the hash was worked out somewhere else, like a lexer on another thread. see lex_adopt
+    if (atom_entries == NULL) atom_init();
+    slot* at = slot_find(&atom_slots, hash, atom_match, &str);
+    if (at->id != 0) return at->id;
+
+    u32 atom = vec_len(atom_entries);
+    vec_append(&atom_entries, ((atom_entry){.str = str, .keyword = TOK_INVALID}));
+    slot_add(&atom_slots, at, hash, atom);
+    return atom;
+}
+
+string atom_str(u32 atom) {
+    if (atom_entries == NULL || atom >= vec_len(atom_entries)) crash("atom %u was never interned!", atom);
+    return atom_entries[atom].str;
+}
+
+token_type atom_keyword(u32 atom) {
+    if (atom_entries == NULL || atom >= vec_len(atom_entries)) crash("atom %u was never interned!", atom);
+    return atom_entries[atom].keyword;
+}
@@ -0,0 +1,163 @@
+#include <sys/stat.h>
+
+#include "alloc.h"
+#include "cobalt.h"
+#include "crash.h"
+#include "parse.h"
+
+#include "common/str.h"
+#include "common/util.h"
+#include "common/vec.h"
+
+// the header cache. every header we include gets mapped and lexed once per process, and after that an #include is
+// just phase 4 reading the same tokens again. headers are keyed by what file they actually are (device, inode, mtime
+// and size), so a header reached through two different paths, or two spellings of the same path, is still one header.
+// which file an #include name means is include.c's job.
+
+Vec(header_file*) header_files = NULL;
+//keyed by device and inode. slots hold indices into header_files plus one
+slot_table header_slots = {0};
+
+u32 header_hash(u64 dev, u64 ino) {
+    return (u32)((dev * 0x9E3779B97F4A7C15ull) ^ (ino * 0xC2B2AE3D27D4EB4Full) >> 17);
+}
+
+bool header_match(void* key, u32 id) {
+    header_file* want = key;
+    return header_files[id - 1]->dev == want->dev && header_files[id - 1]->ino == want->ino;
+}
+
+int header_fill(parser_ctx* ctx, header_file* header) {
+    //lexes the header, if it hasnt been already. headers we only know about from a pch, or that __has_include found,
+    //dont get lexed until something actually includes them. one a prefetch thread has (or is) gets waited on instead
+    if (header->tokens != NULL) return 0;
+    if (header->job != NULL) prefetch_wait(ctx, header);
+    if (header->tokens != NULL) return 0;
+
+    //a prefetch that didnt work out still opened the file
+    source_file* src = header->src != NULL ? header->src : source_open(header->path);
+    if (src == NULL) {
+        printf("unable to open file "str_fmt"\n", str_arg(header->path));
+        return -1;
+    }
+    header->src = src;
+
+    parser_ctx lctx = {.tokens = vec_new(token, 1),
+                       .src = src,
+                       .curr_offset = 0,
+                       .ctx = ctx->ctx};
+    u64 start = report_enabled ? report_now() : 0;
+    if (parser_phase3(&lctx) != 0) return -1;
+    if (report_enabled) report_lexed(header, start, report_now(), 1);
+    header_finish(ctx, header, lctx.tokens);
+    return 0;
+}
+
+void header_finish(parser_ctx* ctx, header_file* header, Vec(token) tokens) {
+    //header has been lexed into tokens, by us or a prefetch thread. whatever it includes is worth getting started on
+    for_vec(token* tok, &tokens) tok->was_included = true;
+    header->tokens = tokens;
+    header->directives = pp_find_directives(tokens);
+    header->guard = header_find_guard(tokens);
+    prefetch_includes(ctx, tokens, header->directives, include_dir_of(header->path));
+}
+
+void header_register(header_file* header) {
+    //puts header in the table, in place of anything we had for the same file before
+    if (header_files == NULL) header_files = vec_new(header_file*, 64);
+    u32 hash = header_hash(header->dev, header->ino);
+    slot* at = slot_find(&header_slots, hash, header_match, header);
+    if (at->id != 0) {
+        header_files[at->id - 1] = header;
+        return;
+    }
+    vec_append(&header_files, header);
+    slot_add(&header_slots, at, hash, vec_len(header_files));
+}
+
+bool header_is_directive(Vec(token) tokens, size_t i, u32 name) {
+    //is tokens[i] the # of a directive called name
+    if (tokens[i].itype != CTOK_HASH || !tokens[i].after_newline || i + 1 >= vec_len(tokens)) return false;
+    return tokens[i + 1].line == tokens[i].line && token_is_atom(tokens[i + 1], name);
+}
+
+u32 header_find_guard(Vec(token) tokens) {
+    //looks for the usual include guard, where the first thing in the file opens a conditional that the last thing
+    //in the file closes:
+    //  #ifndef X        (or #if !defined X, or #if !defined(X))
+    //  ...
+    //  #endif
+    //with no #else or #elif on the outside. a header like that has nothing in it once X is defined, so we dont have
+    //to read it again. gives back the atom of X, or 0 if the header isnt guarded like this
+    if (vec_len(tokens) < 3 || tokens[0].itype != CTOK_HASH) return 0;
+    size_t line = tokens[0].line;
+    //the rest of the first line is what we're checking
+    size_t end = 1;
+    while (end < vec_len(tokens) && tokens[end].line == line) end++;
+
+    u32 guard = 0;
+    if (header_is_directive(tokens, 0, ATOM_IFNDEF) && end == 3 && tokens[2].type == PPTOK_IDENTIFIER) {
+        guard = tokens[2].atom;
+    } else if (header_is_directive(tokens, 0, ATOM_IF) && end >= 5 && tokens[2].itype == CTOK_EXCLAM
+               && token_is_atom(tokens[3], ATOM_DEFINED)) {
+        if (end == 5 && tokens[4].type == PPTOK_IDENTIFIER) guard = tokens[4].atom;
+        else if (end == 7 && tokens[4].itype == CTOK_OPEN_PAREN && tokens[5].type == PPTOK_IDENTIFIER
+                 && tokens[6].itype == CTOK_CLOSE_PAREN) guard = tokens[5].atom;
+    }
+    if (guard == 0) return 0;
+
+    //now find where that conditional ends. it has to be the last line of the file
+    size_t depth = 1;
+    for (size_t i = end; i < vec_len(tokens); i++) {
+        if (tokens[i].itype != CTOK_HASH || !tokens[i].after_newline) continue;
+        if (header_is_directive(tokens, i, ATOM_IF) || header_is_directive(tokens, i, ATOM_IFDEF)
+            || header_is_directive(tokens, i, ATOM_IFNDEF)) {
+            depth++;
+        } else if (depth == 1 && (header_is_directive(tokens, i, ATOM_ELSE) || header_is_directive(tokens, i, ATOM_ELIF)
+                   || header_is_directive(tokens, i, ATOM_ELIFDEF) || header_is_directive(tokens, i, ATOM_ELIFNDEF))) {
+            return 0;
+        } else if (header_is_directive(tokens, i, ATOM_ENDIF)) {
+            depth--;
+            if (depth != 0) continue;
+            //anything on a line after the #endif is outside the guard
+            size_t endif_line = tokens[i].line;
+            for (size_t j = i + 1; j < vec_len(tokens); j++) {
+                if (tokens[j].line != endif_line) return 0;
+            }
+            return guard;
+        }
+    }
+    return 0;
+}
+
+header_file* header_lookup(parser_ctx* ctx, string path) {
+    //gives back the header at path, which might not be lexed yet (see header_fill). NULL if theres no such file
+    struct stat st;
+    if (stat(clone_to_cstring(path), &st) != 0 || S_ISDIR(st.st_mode)) return NULL;
+
+    header_file want = {.dev = st.st_dev, .ino = st.st_ino};
+    slot* at = slot_find(&header_slots, header_hash(st.st_dev, st.st_ino), header_match, &want);
+    //same file, but if its been touched since we saw it, what we have is stale
+    if (at->id != 0 && header_files[at->id - 1]->mtime == (i64)st.st_mtime && header_files[at->id - 1]->size == (u64)st.st_size) {
+        header_file* header = header_files[at->id - 1];
+        //a header from a pch might have been found from somewhere else, so open it by the path that works now
+        if (header->tokens == NULL) header->path = path;
+        return header;
+    }
+
+    header_file* header = cmalloc(sizeof(*header));
+    *header = (header_file){.dev = st.st_dev,
+                            .ino = st.st_ino,
+                            .mtime = st.st_mtime,
+                            .size = st.st_size,
+                            .path = path,
+                            .src = NULL,
+                            .job = NULL,
+                            .prefetch_failed = false,
+                            .tokens = NULL,
+                            .directives = NULL,
+                            .once = false,
+                            .guard = 0};
+    header_register(header);
+    return header;
+}
@@ -0,0 +1,128 @@
+#include "alloc.h"
+#include "cobalt.h"
+#include "crash.h"
+#include "parse.h"
+
+#include "common/str.h"
+#include "common/util.h"
+#include "common/vec.h"
+
+// hide sets, as in dave prosser's expansion algorithm: the set of macro names that cant expand right now.
+// we keep one per expansion the preprocessor is in the middle of reading, rather than one per token, so a name is
+// only hidden while its own expansion is still being read. thats what gcc and clang do, and its what the EVAL and
+// DEFER tricks (see cobalt.h) rely on to get more than one round of expansion out of a macro.
+//
+// the sets are interned, so a set is a u32 and two sets are equal if their ids are. id 0 is the empty set.
+// each set is a sorted run of atoms in hideset_atoms.
+// the same few additions happen over and over (think EVAL chains), so they go through a small cache first.
+
+typedef struct {
+    u32 start;
+    u32 len;
+} hideset_entry;
+
+Vec(hideset_entry) hideset_entries = NULL;
+Vec(u32) hideset_atoms = NULL;
+slot_table hideset_slots = {0};
+//where sets get built before we know if theyre new
+Vec(u32) hideset_scratch = NULL;
+
+#define HIDESET_CACHE_SIZE 4096
+
+typedef struct {
+    u32 set;
+    u32 atom;
+    u32 result;
+} hideset_cache_entry;
+
+hideset_cache_entry hideset_add_cache[HIDESET_CACHE_SIZE];
+
+u32 hideset_hash(u32* atoms, size_t len) {
+    //fnv-1a over the atoms
+    u32 hash = 2166136261u;
+    for_n(i, 0, len) {
+        hash ^= atoms[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+//the set hideset_intern is looking for
+typedef struct {
+    u32* atoms;
+    size_t len;
+} hideset_key;
+
+bool hideset_match(void* key, u32 set) {
+    hideset_key* want = key;
+    hideset_entry entry = hideset_entries[set];
+    return entry.len == want->len && memcmp(&hideset_atoms[entry.start], want->atoms, entry.len * sizeof(u32)) == 0;
+}
+
+void hideset_init() {
+    hideset_entries = vec_new(hideset_entry, 256);
+    hideset_atoms = vec_new(u32, 1024);
+    hideset_scratch = vec_new(u32, 16);
+    //the empty set
+    vec_append(&hideset_entries, ((hideset_entry){.start = 0, .len = 0}));
+    //an empty cache entry is never a hit, since adding to a set never gives the empty set
+    for_n(i, 0, HIDESET_CACHE_SIZE) {
+        hideset_add_cache[i] = (hideset_cache_entry){0};
+    }
+}
+
+u32 hideset_intern(u32* atoms, size_t len) {
+    //atoms has to be sorted, with no repeats
+    if (len == 0) return 0;
+    if (hideset_entries == NULL) hideset_init();
+
+    u32 hash = hideset_hash(atoms, len);
+    hideset_key key = {.atoms = atoms, .len = len};
+    slot* at = slot_find(&hideset_slots, hash, hideset_match, &key);
+    if (at->id != 0) return at->id;
+
+    u32 set = vec_len(hideset_entries);
+    vec_append(&hideset_entries, ((hideset_entry){.start = vec_len(hideset_atoms), .len = len}));
+    for_n(i, 0, len) vec_append(&hideset_atoms, atoms[i]);
+    slot_add(&hideset_slots, at, hash, set);
+    return set;
+}
+
+bool hideset_contains(u32 set, u32 atom) {
+    if (set == 0) return false;
+    hideset_entry entry = hideset_entries[set];
+    //sets are a handful of names at most, a plain scan is fine
+    for_n(i, 0, entry.len) {
+        u32 member = hideset_atoms[entry.start + i];
+        if (member == atom) return true;
+        if (member > atom) return false;
+    }
+    return false;
+}
+
+u32 hideset_cache_slot(u32 set, u32 atom) {
+    return ((set * 2654435769u) ^ (atom * 40503u)) & (HIDESET_CACHE_SIZE - 1);
+}
+
+u32 hideset_add(u32 set, u32 atom) {
+    if (hideset_entries == NULL) hideset_init();
+    hideset_cache_entry* cached = &hideset_add_cache[hideset_cache_slot(set, atom)];
+    if (cached->set == set && cached->atom == atom && cached->result != 0) return cached->result;
+
+    vec_clear(&hideset_scratch);
+    hideset_entry entry = hideset_entries[set];
+    bool added = false;
+    for_n(i, 0, entry.len) {
+        u32 member = hideset_atoms[entry.start + i];
+        if (member == atom) return set;
+        if (!added && member > atom) {
+            vec_append(&hideset_scratch, atom);
+            added = true;
+        }
+        vec_append(&hideset_scratch, member);
+    }
+    if (!added) vec_append(&hideset_scratch, atom);
+    u32 result = hideset_intern(hideset_scratch, vec_len(hideset_scratch));
+    *cached = (hideset_cache_entry){.set = set, .atom = atom, .result = result};
+    return result;
+}
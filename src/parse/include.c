@@ -0,0 +1,190 @@
+#include <dirent.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "alloc.h"
+#include "cobalt.h"
+#include "crash.h"
+#include "parse.h"
+
+#include "common/str.h"
+#include "common/util.h"
+#include "common/vec.h"
+
+// include resolution. working out which file an #include means is a walk down the search path, and most of the
+// places on it wont have the header, so doing that with open() costs a failed syscall per directory per #include.
+// instead, every resolution is remembered by where it was asked from, what it asked for, and which way it was
+// spelled, so the same #include anywhere in the same directory is one hash lookup, whether it was found or not.
+// the walk itself doesnt open anything either. each directory on the path gets read once, and after that asking it
+// if it has a file is a binary search. a directory too big to be worth reading keeps a list of what we've asked it
+// instead, so it only ever gets asked about a name once.
+//
+// "name" looks next to the file doing the #include, then in each -I path in the order they were given, then the
+// system paths. <name> skips the first step.
+
+//reading a directory this big costs more than it'd save, so past this we ask it one name at a time
+#define INCLUDE_LISTING_MAX 4096
+
+typedef struct {
+    //if the directory was read in full, present is everything in it, and missing is unused.
+    //otherwise present and missing are whatever we've asked about so far. all of them are sorted atoms
+    bool listed;
+    bool exists;
+    Vec(u32) present;
+    Vec(u32) missing;
+} include_listing;
+
+typedef struct {
+    u32 from_dir;
+    u32 name;
+    bool is_system;
+    //NULL if theres no such header
+    header_file* header;
+} include_entry;
+
+//indexed by the atom of a directory path. NULL if we havent looked at that directory yet
+Vec(include_listing*) include_listings = NULL;
+Vec(include_entry) include_entries = NULL;
+//slots hold indices into include_entries plus one
+slot_table include_slots = {0};
+
+bool include_sorted_has(Vec(u32) atoms, u32 atom, size_t* insert_at) {
+    //binary search. insert_at gets where atom would go, if it isnt there
+    size_t low = 0;
+    size_t high = vec_len(atoms);
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (atoms[mid] == atom) return true;
+        if (atoms[mid] < atom) low = mid + 1;
+        else high = mid;
+    }
+    if (insert_at != NULL) *insert_at = low;
+    return false;
+}
+
+void include_sorted_add(Vec(u32)* atoms, u32 atom) {
+    size_t at;
+    if (!include_sorted_has(*atoms, atom, &at)) vec_insert(atoms, at, atom);
+}
+
+int include_atom_cmp(const void* a, const void* b) {
+    u32 left = *(const u32*)a;
+    u32 right = *(const u32*)b;
+    return (left > right) - (left < right);
+}
+
+string include_join(string dir, string name) {
+    //dir + name, with exactly one / between them. an empty dir is the current directory
+    if (dir.len == 0) return name;
+    if (dir.raw[dir.len - 1] == '/') return string_concat(dir, name);
+    return strprintf(str_fmt"/"str_fmt, str_arg(dir), str_arg(name));
+}
+
+string include_dir_of(string path) {
+    //everything up to and including the last /, or nothing if path is just a file name
+    for (size_t i = path.len; i > 0; i--) {
+        if (path.raw[i - 1] == '/') return string_make(path.raw, i);
+    }
+    return strlit("");
+}
+
+include_listing* include_listing_of(string dir) {
+    //gets the listing of dir, reading it in if we havent already
+    if (include_listings == NULL) include_listings = vec_new(include_listing*, 64);
+    u32 dir_atom = atom_intern(dir);
+    while (vec_len(include_listings) <= dir_atom) vec_append(&include_listings, NULL);
+    if (include_listings[dir_atom] != NULL) return include_listings[dir_atom];
+
+    include_listing* listing = cmalloc(sizeof(*listing));
+    *listing = (include_listing){.listed = false,
+                                 .exists = false,
+                                 .present = vec_new(u32, 16),
+                                 .missing = vec_new(u32, 16)};
+    include_listings[dir_atom] = listing;
+
+    DIR* handle = opendir(dir.len == 0 ? "." : clone_to_cstring(dir));
+    if (handle == NULL) return listing;
+    listing->exists = true;
+    listing->listed = true;
+    struct dirent* entry;
+    while ((entry = readdir(handle)) != NULL) {
+        if (vec_len(listing->present) >= INCLUDE_LISTING_MAX) {
+            //too big to keep. we'll ask it about names as they come up instead
+            listing->listed = false;
+            vec_clear(&listing->present);
+            break;
+        }
+        //subdirectories stay in. we cant tell them apart without a stat, and header_lookup turns them away anyway
+        //atoms keep the string they're given, and d_name is gone once we move on, so it needs a copy
+        vec_append(&listing->present, atom_intern(strprintf("%s", entry->d_name)));
+    }
+    closedir(handle);
+    if (listing->listed) {
+        //atoms get handed out in whatever order we meet names, so sort them for searching
+        qsort(listing->present, vec_len(listing->present), sizeof(u32), include_atom_cmp);
+    }
+    return listing;
+}
+
+bool include_exists(string dir, string name) {
+    //does dir have a file called name, which can have directories in it. only ever stats a path once
+    string sub_dir = include_dir_of(name);
+    string file = string_make(name.raw + sub_dir.len, name.len - sub_dir.len);
+    include_listing* listing = include_listing_of(sub_dir.len == 0 ? dir : include_join(dir, sub_dir));
+    if (!listing->exists) return false;
+    u32 file_atom = atom_intern(file);
+    if (listing->listed) return include_sorted_has(listing->present, file_atom, NULL);
+
+    if (include_sorted_has(listing->present, file_atom, NULL)) return true;
+    if (include_sorted_has(listing->missing, file_atom, NULL)) return false;
+    struct stat st;
+    bool found = stat(clone_to_cstring(include_join(dir, name)), &st) == 0 && !S_ISDIR(st.st_mode);
+    include_sorted_add(found ? &listing->present : &listing->missing, file_atom);
+    return found;
+}
+
+u32 include_hash(u32 from_dir, u32 name, bool is_system) {
+    return (from_dir * 2654435769u) ^ (name * 40503u) ^ (is_system ? 0x9E3779B9u : 0);
+}
+
+bool include_match(void* key, u32 id) {
+    include_entry* want = key;
+    include_entry* entry = &include_entries[id - 1];
+    return entry->from_dir == want->from_dir && entry->name == want->name && entry->is_system == want->is_system;
+}
+
+header_file* include_search(parser_ctx* ctx, string name, bool is_system, string from_dir) {
+    //the walk down the search path, for a name we havent resolved from here before
+    if (name.len != 0 && name.raw[0] == '/') {
+        return include_exists(strlit(""), name) ? header_lookup(ctx, name) : NULL;
+    }
+    if (!is_system && include_exists(from_dir, name)) {
+        header_file* header = header_lookup(ctx, include_join(from_dir, name));
+        if (header != NULL) return header;
+    }
+    for_n(i, 0, vec_len(ctx->ctx->include_paths)) {
+        string dir = ctx->ctx->include_paths[i];
+        if (!include_exists(dir, name)) continue;
+        header_file* header = header_lookup(ctx, include_join(dir, name));
+        if (header != NULL) return header;
+    }
+    return NULL;
+}
+
+header_file* include_resolve(parser_ctx* ctx, string name, bool is_system, string from_dir) {
+    //finds the header an #include names, from the file in from_dir. NULL if theres no such header.
+    //a <name> is found the same way from anywhere, so it doesnt care where its from
+    if (include_entries == NULL) include_entries = vec_new(include_entry, 256);
+    include_entry want = {.from_dir = is_system ? 0 : atom_intern(from_dir),
+                          .name = atom_intern(name),
+                          .is_system = is_system,
+                          .header = NULL};
+    u32 hash = include_hash(want.from_dir, want.name, is_system);
+    slot* at = slot_find(&include_slots, hash, include_match, &want);
+    if (at->id != 0) return include_entries[at->id - 1].header;
+
+    want.header = include_search(ctx, name, is_system, from_dir);
+    vec_append(&include_entries, want);
+    slot_add(&include_slots, at, hash, vec_len(include_entries));
+    return want.header;
+}
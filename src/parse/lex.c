@@ -5,6 +5,7 @@
 #include "cobalt.h"
 #include "crash.h"
 #include "parse.h"
+#include "scan.h"
 
 #include "common/ansi.h"
 #include "common/str.h"
@@ -20,38 +21,148 @@
                "\u" <hex-quad> (not supported)
 */
 
+// phases 1 to 3 all happen in one go, straight off the source buffer.
+// phase 1 only has to throw away a utf-8 BOM, since we only accept utf-8 anyway.
+// phase 2 (line splicing) is done as we read: backslash-newline pairs are stepped over by lex_advance, so a token
+// only gets copied out of the buffer if it actually straddles a splice.
+// tokens are numbered by logical line, so everything on a spliced line shares a number. nothing about lines is
+// stored while lexing, diagnostics go to the source's line table instead.
+
+#define LEX_BUF ctx->src->buf.raw
+#define LEX_LEN ctx->src->buf.len
+
+#define AT_LINE_END (ctx->curr_offset >= LEX_LEN || LEX_BUF[ctx->curr_offset] == '\n')
+
+#define CURR_CHAR (AT_LINE_END ? '\0' : LEX_BUF[ctx->curr_offset])
+
+#define scan_next_char() lex_peek(ctx, 1)
+
+#define scan_next_char_from(offset) lex_peek(ctx, (offset))
+
+size_t lex_splice_end(parser_ctx* ctx, size_t offset) {
+    //step over any \\\n at offset, giving the position of the next char that actually exists in the logical line
+    while (offset + 1 < LEX_LEN && LEX_BUF[offset] == '\\' && LEX_BUF[offset + 1] == '\n') offset += 2;
+    return offset;
+}
+
+void lex_advance(parser_ctx* ctx) {
+    //tok_end is where the token we're building stops, which is NOT the same as curr_offset if a splice follows it
+    ctx->tok_end = ctx->curr_offset + 1;
+    ctx->curr_offset = lex_splice_end(ctx, ctx->tok_end);
+    if (ctx->curr_offset != ctx->tok_end) ctx->lex_spliced = true;
+}
+
+void lex_advance_by(parser_ctx* ctx, size_t count) {
+    //for runs handed back by lex_scan. none of them include \ or \n, so there cant be a splice inside the run,
+    //only (maybe) right after it, which lex_advance deals with
+    if (count == 0) return;
+    ctx->curr_offset += count - 1;
+    lex_advance(ctx);
+}
+
+#define LEX_SCAN(scanner) lex_scan.scanner(LEX_BUF + ctx->curr_offset, LEX_LEN - ctx->curr_offset)
+
+u8 lex_peek(parser_ctx* ctx, size_t offset) {
+    //same as the old scan_next_char, but it has to walk over splices
+    size_t pos = ctx->curr_offset;
+    for (size_t i = 0; i < offset && pos < LEX_LEN && LEX_BUF[pos] != '\n'; i++) {
+        pos = lex_splice_end(ctx, pos + 1);
+    }
+    if (pos >= LEX_LEN || LEX_BUF[pos] == '\n') return '\0';
+    return LEX_BUF[pos];
+}
+
+void lex_emit(parser_ctx* ctx, token_type type, token_type itype, size_t start_offset) {
+    u32 loc = ctx->src->base + start_offset;
+    u32 len = ctx->tok_end - start_offset;
+    if (ctx->lex_spliced) {
+        //we've crossed a splice since this token started, so it might need stitching back together.
+        //this is the only time we ever copy a token's text, and the copy goes into scratch.
+        string text = string_make(LEX_BUF + start_offset, len);
+        string stitched = string_alloc(text.len);
+        size_t stitched_len = 0;
+        for (size_t i = 0; i < text.len; i++) {
+            if (text.raw[i] == '\\' && i + 1 < text.len && text.raw[i + 1] == '\n') {
+                i++;
+                continue;
+            }
+            stitched.raw[stitched_len++] = text.raw[i];
+        }
+        stitched.len = stitched_len;
+        if (stitched.len != text.len) {
+            len = stitched.len;
+            if (ctx->lex_deferred) {
+                //scratch is shared, so this waits in our own buffer for lex_adopt. the location is an offset into it
+                loc = vec_len(ctx->lex_scratch);
+                for_n(i, 0, stitched.len) vec_append(&ctx->lex_scratch, stitched.raw[i]);
+                vec_append(&ctx->lex_stitched, vec_len(ctx->tokens));
+            } else {
+                loc = source_scratch(stitched);
+            }
+        }
+        cfree(stitched.raw);
+    }
+    //identifiers are interned here, once, so nothing after us ever compares their text.
+    //a deferred lex cant touch the atom table, so it only hashes them, and lex_adopt does the rest
+    if (type == PPTOK_IDENTIFIER && ctx->lex_deferred) {
+        bool in_scratch = vec_len(ctx->lex_stitched) != 0 && ctx->lex_stitched[vec_len(ctx->lex_stitched) - 1] == vec_len(ctx->tokens);
+        vec_append(&ctx->lex_hashes, atom_hash(string_make(in_scratch ? ctx->lex_scratch + loc : LEX_BUF + start_offset, len)));
+    } else if (type == PPTOK_IDENTIFIER) {
+        len = atom_intern(token_text((token){.loc = loc, .len = len}));
+    }
+
+    token new_tok = (token){.type = type,
+                            .itype = itype,
+                            .loc = loc,
+                            .len = len, //or the atom, for identifiers
+                            .after_newline = ctx->lex_after_newline,
+                            .preceded_by_space = ctx->lex_space,
+                            .line = ctx->curr_line};
+    ctx->lex_after_newline = false;
+    ctx->lex_space = false;
+    if (ctx->lex_single != NULL) {
+        *ctx->lex_single = new_tok;
+        ctx->lex_single = NULL;
+        return;
+    }
+    vec_append(&ctx->tokens, new_tok);
+}
+
+void lex_end_line(parser_ctx* ctx) {
+    //curr_offset is sat on a real \n, so this logical line is done
+    ctx->curr_line++;
+    ctx->curr_offset = lex_splice_end(ctx, ctx->curr_offset + 1);
+    ctx->lex_after_newline = true;
+    ctx->lex_space = false;
+}
+
+int lex_bad_token(parser_ctx* ctx, size_t start_offset) {
+    //whatever starts at start_offset and ends at tok_end isnt a token. it might well be in a group phase 4 skips,
+    //where it doesnt matter (like the ' in a "don't" inside #if 0), so it goes in as a PPTOK_BAD and we carry on.
+    //if phase 4 ever reads it, lex_explain lexes it again without the tolerance, which prints the error
+    ctx->lex_spliced = false;
+    lex_emit(ctx, PPTOK_BAD, TOK_INVALID, start_offset);
+    return 0;
+}
+
 // <pp-identifier> ::= <non_digit> (<non_digit> | <digit>)*
 // we ignore XID_Start and XID_Continue characteristics, since we dont support wchar.
 
-#define CURR_LINE ctx->logical_lines[ctx->curr_line]
-
 int pp_scan_identifier(parser_ctx* ctx) {
-    size_t len = 0;
     size_t start_offset = ctx->curr_offset;
-    u8 c = CURR_LINE.raw[ctx->curr_offset];
-    if (isalpha(c) || c == '_') {
-        len++;
-        ctx->curr_offset++;
+    u8 c = CURR_CHAR;
+    if (lex_is_ident_start(c)) {
+        lex_advance(ctx);
     } else {
         print_lexing_error(ctx, "expected [a-zA-Z], got %c\n", c);
         return -1;
     }
 
-    for (ctx->curr_offset; ctx->curr_offset < CURR_LINE.len; ctx->curr_offset++) {
-        c = CURR_LINE.raw[ctx->curr_offset];
-        // (<non_digit> | <digit> | "_")*
-        if (isalnum(c) || c == '_') {
-            len++;
-            continue;
-        } 
-        break;
-    }
+    // (<non_digit> | <digit> | "_")*
+    //the body goes in bulk, and we only go round again if a splice cut it short
+    for (size_t run = LEX_SCAN(ident); run != 0; run = LEX_SCAN(ident)) lex_advance_by(ctx, run);
 
-    token new_tok = (token){.type = PPTOK_IDENTIFIER,
-                            .tok = string_make(CURR_LINE.raw + start_offset, len),
-                            .line = ctx->curr_line};
-    vec_append(&ctx->tokens, new_tok);
-    ctx->curr_offset--;
+    lex_emit(ctx, PPTOK_IDENTIFIER, TOK_INVALID, start_offset);
     return 0;
 }
 /*
@@ -62,49 +173,55 @@ pp-number = digit |
             pp-number "."
 */
 
-#define scan_next_char() \
-    ((ctx->curr_offset + 1 < ctx->logical_lines[ctx->curr_line].len) ? (ctx->logical_lines[ctx->curr_line].raw[ctx->curr_offset + 1]) : ('\0'))
-
-#define CURR_CHAR ctx->logical_lines[ctx->curr_line].raw[ctx->curr_offset]
-
 int pp_scan_number(parser_ctx* ctx) {
     size_t start_offset = ctx->curr_offset;
     u8 c = CURR_CHAR;
     //following <digit> | "." <digit> branch first
-    if (isdigit(c)) ctx->curr_offset++;
+    if (lex_is_digit(c)) lex_advance(ctx);
 
-    else if (c == '.' && isdigit(scan_next_char())) ctx->curr_offset++;
+    else if (c == '.' && lex_is_digit(scan_next_char())) lex_advance(ctx);
     else {
         print_lexing_error(ctx, "expected digit or ., got %c", c);
         return -1;   
     }
     //now, we're onto the "builder" branches, which build leftwards
-    for (ctx->curr_offset; ctx->curr_offset < CURR_LINE.len; ctx->curr_offset++) {
+    while (!AT_LINE_END) {
         c = CURR_CHAR;
         //<pp-number> ("e" | "E" | "p" | "P") ("+" | "-") 
         if (c == 'e' || c == 'E' || c == 'p' || c == 'P') {
             if (scan_next_char() == '+' || scan_next_char() == '-') {
-                ctx->curr_offset++;
+                lex_advance(ctx);
+                lex_advance(ctx);
                 continue;
             }
         }
         //<pp-number> "."
         if (c == '.') {
-            ctx->curr_offset++;
+            lex_advance(ctx);
             break;
         }
         //<pp-number> ("'" | E) (<digit> | <nondigit>)
-        if (c == '\'') continue;
-        if (isalnum(c) || c == '_') continue;
-        else break;
-
-
+        //plain digits and letters are the common case, so they go in bulk.
+        //e and p still have to come through here one at a time, to check for a sign after them
+        if (c != 'e' && c != 'E' && c != 'p' && c != 'P' && lex_is_ident(c)) {
+            size_t run = LEX_SCAN(ident);
+            for (size_t i = 1; i < run; i++) {
+                u8 d = LEX_BUF[ctx->curr_offset + i];
+                if (d == 'e' || d == 'E' || d == 'p' || d == 'P') {
+                    run = i;
+                    break;
+                }
+            }
+            lex_advance_by(ctx, run);
+            continue;
+        }
+        if (c == '\'' || lex_is_ident(c)) {
+            lex_advance(ctx);
+            continue;
+        }
+        break;
     }
-    token new_tok = (token){.type = PPTOK_NUMBER,
-                            .tok = string_make(CURR_LINE.raw + start_offset, ctx->curr_offset - start_offset),
-                            .line = ctx->curr_line};
-    vec_append(&ctx->tokens, new_tok);
-    ctx->curr_offset--;
+    lex_emit(ctx, PPTOK_NUMBER, TOK_INVALID, start_offset);
     return 0;
 }
 
@@ -148,9 +265,20 @@ void print_lexing_error(parser_ctx* ctx, char* format, ...) {
          |                     ^
     */
 
+    if (ctx->src == NULL) {
+        printf("NOTE: no source yet defined. what are you up to?\n");
+        return;
+    }
+    //not on this thread. the main thread will lex it again if it turns out to matter, and print it then
+    if (ctx->lex_deferred) {
+        ctx->lex_errored = true;
+        return;
+    }
+    u32 line = source_line_of(ctx->src, ctx->curr_offset);
+
     //print the "test.c:3: error: unexpected }" section
-    if (ctx->ctx->no_colour) printf(str_fmt ":%d: error: ", str_arg(ctx->ctx->curr_file), ctx->curr_line + 1);
-    else printf(Bold str_fmt ":%d: " Reset Red Bold"error: "Reset, str_arg(ctx->ctx->curr_file), ctx->curr_line + 1);
+    if (ctx->ctx->no_colour) printf(str_fmt ":%d: error: ", str_arg(ctx->src->path), line + 1);
+    else printf(Bold str_fmt ":%d: " Reset Red Bold"error: "Reset, str_arg(ctx->src->path), line + 1);
 
     va_list args;
     va_start(args, format);
@@ -159,21 +287,18 @@ void print_lexing_error(parser_ctx* ctx, char* format, ...) {
     printf("\n");
     
     //left justify the number when printing
-    size_t num_len = snprintf(NULL, 0, "%d", ctx->curr_line + 1);
+    size_t num_len = snprintf(NULL, 0, "%d", line + 1);
     string left_just_string = string_wrap("     ");
     left_just_string.raw += num_len;
-    printf(str_fmt"%d | ", str_arg(left_just_string), ctx->curr_line + 1);
-
-    if (ctx->logical_lines == NULL) {
-        printf("NOTE: no logical lines yet defined. what are you up to?\n");
-        return;
-    }
+    printf(str_fmt"%d | ", str_arg(left_just_string), line + 1);
 
     //split the erroring line into 3 pieces, so we can bold the section we want
-    string error_line = ctx->logical_lines[ctx->curr_line];
-    string left_piece = string_make(error_line.raw, ctx->curr_offset);
-    string central_piece = string_make(error_line.raw + ctx->curr_offset, 1);
-    string right_piece = string_make(error_line.raw + ctx->curr_offset + 1, error_line.len - ctx->curr_offset - 1);
+    string error_line = source_line_text(ctx->src, line);
+    size_t column = source_column_of(ctx->src, ctx->curr_offset);
+    if (column >= error_line.len) column = error_line.len == 0 ? 0 : error_line.len - 1;
+    string left_piece = string_make(error_line.raw, column);
+    string central_piece = string_make(error_line.raw + column, error_line.len == 0 ? 0 : 1);
+    string right_piece = string_make(error_line.raw + column + central_piece.len, error_line.len - column - central_piece.len);
     
     //print out the erroring line
     if (ctx->ctx->no_colour) printf(str_fmt"\n", str_arg(error_line));
@@ -213,27 +338,11 @@ U here represents all chars, i just cannot be arsed to write out all the specifi
 */
 
 size_t pp_detect_encoding(parser_ctx* ctx) {
-    //first, check if the current line has atleast 2 further chars
-    if (ctx->curr_offset + 2 < ctx->logical_lines[ctx->curr_line].len) {
-        //we've got atleast 2 more chars, so we can do the u8" check
-        string modified_line = CURR_LINE;
-        modified_line.len = 3;
-        modified_line.raw += ctx->curr_offset;
-        if (string_eq(modified_line, string_wrap("u8\""))) return 2; //enough to skip u8
-        if (string_eq(modified_line, string_wrap("u8\'"))) return 2; //enough to skip u8
-    } 
-    if (ctx->curr_offset + 1 < ctx->logical_lines[ctx->curr_line].len) {
-        //we've got atleast ONE extra char
-        string modified_line = CURR_LINE;
-        modified_line.len = 2;
-        modified_line.raw += ctx->curr_offset;
-        if (string_eq(modified_line, string_wrap("u\""))) return 1;
-        if (string_eq(modified_line, string_wrap("u\'"))) return 1;
-        if (string_eq(modified_line, string_wrap("U\""))) return 1;
-        if (string_eq(modified_line, string_wrap("U\'"))) return 1;
-        if (string_eq(modified_line, string_wrap("L\""))) return 1;
-        if (string_eq(modified_line, string_wrap("L\'"))) return 1;
-    }
+    u8 c = CURR_CHAR;
+    u8 next = scan_next_char();
+    //u8" and u8' first, since u" would eat the front of them
+    if (c == 'u' && next == '8' && (scan_next_char_from(2) == '\"' || scan_next_char_from(2) == '\'')) return 2; //enough to skip u8
+    if ((c == 'u' || c == 'U' || c == 'L') && (next == '\"' || next == '\'')) return 1;
     return 0;
 }
 
@@ -241,21 +350,30 @@ int pp_scan_char_or_str(parser_ctx* ctx) {
     //god, the grammars for these are awful
     size_t start_offset = ctx->curr_offset;
     //scan encoding first
-    ctx->curr_offset += pp_detect_encoding(ctx); //skip chars
+    for (size_t i = pp_detect_encoding(ctx); i > 0; i--) lex_advance(ctx); //skip chars
     //now, we choose which path to follow.
     bool is_char = false;
     if (CURR_CHAR == '\"') is_char = false;
     else if (CURR_CHAR == '\'') is_char = true;
     else crash("we somehow got into pp_scan_char_or_str without \" or \'! we got %c instead", CURR_CHAR);
 
-    ctx->curr_offset++;
-    for (; ctx->curr_offset < CURR_LINE.len; ctx->curr_offset++) {
-        if (is_char && CURR_CHAR == '\'') break;
-        if (!is_char && CURR_CHAR == '\"') break;
-        if (CURR_CHAR == '\n') { 
+    lex_advance(ctx);
+    //where we'd pick up again if this turns out to be unterminated, in which case only the quote is bad
+    size_t quote_end = ctx->tok_end;
+    size_t quote_resume = ctx->curr_offset;
+    bool bad_escape = false;
+    for (;;) {
+        if (AT_LINE_END) {
+            if (ctx->lex_tolerant) {
+                ctx->tok_end = quote_end;
+                ctx->curr_offset = quote_resume;
+                return lex_bad_token(ctx, start_offset);
+            }
             print_lexing_error(ctx, "Found \'\\n\' when attempting to lex char or string literal");
             return -1;
         }
+        if (is_char && CURR_CHAR == '\'') break;
+        if (!is_char && CURR_CHAR == '\"') break;
         if (CURR_CHAR == '\\') {
             //we've found an escape sequence!
             switch (scan_next_char()) {
@@ -271,614 +389,265 @@ int pp_scan_char_or_str(parser_ctx* ctx) {
                 case 't':
                 case 'v':
                 case 'x':                    
-                    ctx->curr_offset++;
+                    lex_advance(ctx);
+                    lex_advance(ctx);
                     continue;
             }
 
-            if (isdigit(scan_next_char()) && scan_next_char() != '8' && scan_next_char() != '9') {
+            if (lex_is_digit(scan_next_char()) && scan_next_char() != '8' && scan_next_char() != '9') {
                 //octal
-                ctx->curr_offset++;
+                lex_advance(ctx);
+                lex_advance(ctx);
+                continue;
+            }
+            if (ctx->lex_tolerant) {
+                //the whole literal is bad, but it still ends where it would have
+                bad_escape = true;
+                lex_advance(ctx);
+                if (!AT_LINE_END) lex_advance(ctx);
                 continue;
             }
-            print_lexing_error(ctx, "Unknown escape sequence \\%c", CURR_CHAR);
+            print_lexing_error(ctx, "Unknown escape sequence \\%c", scan_next_char());
             return -1;
         }
+        lex_advance(ctx);
     }
-    token new_tok = (token){.type = is_char ? PPTOK_CHAR_CONST : PPTOK_STR_LIT,
-                            .tok = string_make(CURR_LINE.raw + start_offset, ctx->curr_offset - start_offset + 1),
-                            .line = ctx->curr_line};
-    vec_append(&ctx->tokens, new_tok);
+    lex_advance(ctx); //closing quote
+    if (bad_escape) return lex_bad_token(ctx, start_offset);
+    lex_emit(ctx, is_char ? PPTOK_CHAR_CONST : PPTOK_STR_LIT, TOK_INVALID, start_offset);
     return 0;
 }
 
-#undef scan_next_char
-#undef CURR_CHAR
-
-#define scan_next_char() \
-    ((ctx->curr_offset + 1 < line.len) ? (line.raw[ctx->curr_offset + 1]) : ('\0'))
+// the punctuator DFA. this is built once from PUNCT and DIGRAPHS, so adding a punctuator is just adding it to the list.
+// chars are squashed into classes first (most bytes can never be part of a punctuator), and then we walk
+// punct_next until we fall off, remembering the last state that accepted. thats maximal munch, and it backs off
+// by itself for things like %:% (which is %: then %).
+
+#define PUNCT_DEAD 0
+#define PUNCT_START 1
+#define PUNCT_MAX_STATES 128
+#define PUNCT_MAX_CLASSES 32
+
+u8 punct_class[256] = {0};
+u8 punct_class_count = 1; //class 0 is "not a punctuator char"
+u8 punct_next[PUNCT_MAX_STATES][PUNCT_MAX_CLASSES] = {0};
+token_type punct_accept[PUNCT_MAX_STATES] = {0}; //TOK_INVALID means the state doesnt accept
+u8 punct_state_count = 2;
+
+void punct_dfa_add(string spelling, token_type itype) {
+    u8 state = PUNCT_START;
+    for (size_t i = 0; i < spelling.len; i++) {
+        u8 c = spelling.raw[i];
+        if (punct_class[c] == 0) {
+            if (punct_class_count == PUNCT_MAX_CLASSES) crash("too many punctuator chars for the DFA!");
+            punct_class[c] = punct_class_count++;
+        }
+        u8* next = &punct_next[state][punct_class[c]];
+        if (*next == PUNCT_DEAD) {
+            if (punct_state_count == PUNCT_MAX_STATES) crash("too many punctuator states for the DFA!");
+            *next = punct_state_count++;
+        }
+        state = *next;
+    }
+    punct_accept[state] = itype;
+}
 
-#define scan_next_char_from(offset) \
-    ((ctx->curr_offset + (offset) < line.len) ? (line.raw[ctx->curr_offset + (offset)]) : ('\0'))
+void lex_init() {
+    //everything the lexer needs built before it starts. only the first call does anything
+    if (lex_scan.whitespace != NULL) return;
+#define TOKEN(tok, str) punct_dfa_add(strlit(str), (tok));
+    PUNCT
+    DIGRAPHS
+#undef TOKEN
+    //last, since its what says we've been here
+    lex_scan_init();
+}
 
+int pp_scan_punct(parser_ctx* ctx) {
+    size_t start_offset = ctx->curr_offset;
+    u8 state = PUNCT_START;
+    size_t munch = 0;
+    token_type itype = TOK_INVALID;
+    //lex_peek gives back \0 at the end of a line, which is class 0, which is always dead
+    for (size_t i = 0; state != PUNCT_DEAD; i++) {
+        state = punct_next[state][punct_class[lex_peek(ctx, i)]];
+        if (punct_accept[state] != TOK_INVALID) {
+            itype = punct_accept[state];
+            munch = i + 1;
+        }
+    }
+    if (munch == 0) {
+        if (ctx->lex_tolerant) {
+            lex_advance(ctx);
+            return lex_bad_token(ctx, start_offset);
+        }
+        print_lexing_error(ctx, "encountered unexpected char %c", CURR_CHAR);
+        return -1;
+    }
+    for (size_t i = 0; i < munch; i++) lex_advance(ctx);
+    lex_emit(ctx, PPTOK_PUNCT, itype, start_offset);
+    return 0;
+}
 
-#define CURR_CHAR line.raw[ctx->curr_offset]
+// lexes whatever sits at curr_offset: one token, a run of whitespace, a comment, or a line ending.
+// returns -1 on error.
+int lex_step(parser_ctx* ctx) {
+    size_t start_offset = ctx->curr_offset;
+    ctx->lex_spliced = false;
 
-int parser_phase3(parser_ctx* ctx) {
-    //we continually iterate over all the characters in each logical line,
-    //and if we come across special characters, we operate inside this switch case to get
-    //correct tokenisation behaviour.
-    //no pp-toks require us to keep track of whitespace, so we're ignoring
-    //whitespace rules.
-
-    bool ml_comment = false;
-    bool is_header = false;
-    for_n(i, 0, vec_len(ctx->logical_lines)) {
-        bool after_newline = true;
-        size_t vec_len_before = vec_len(ctx->logical_lines);
-        string line = ctx->logical_lines[i];
-
-        ctx->curr_line = i; //for pp_scan_identifier
-        for (ctx->curr_offset = 0; ctx->curr_offset < line.len; ctx->curr_offset++) {
-            if (vec_len_before != vec_len(ctx->logical_lines)) after_newline = false;
-            if (ml_comment == true) {
-                //we are in ml comment scanning mode.
-                //we scan this char, and the next char, until we find */. we can then exit ml_comment mode
-                if (CURR_CHAR == '*' && scan_next_char() == '/') {
-                    ml_comment = false;
-                    ctx->curr_offset++;
-                }
-                continue;
-            }
-            switch (CURR_CHAR) {
-                case ' ':
-                case '\f': //FIXME?: is this right?
-                case '\t':
-                case '\r':
-                case '\n': {
-                    //we need to emit a whitespace "token", because the c standard is stupid.
-                    size_t start_offset = ctx->curr_offset;
-                    for (; ctx->curr_offset < line.len; ctx->curr_offset++) {
-                        if (CURR_CHAR != ' ' && CURR_CHAR != '\t' && CURR_CHAR != '\n' && CURR_CHAR != '\r' && CURR_CHAR != '\f') break;
-                    }
-                    ctx->curr_offset--;
-                    token new_tok = (token){.type = TOK_WHITESPACE,
-                                            .itype = TOK_WHITESPACE,
-                                            .tok = string_make(line.raw + start_offset, ctx->curr_offset - start_offset + 1),
-                                            .line = ctx->curr_line};
-                    //quickly, we're gonna fix up the whitespace so it prints right
-                    for (size_t i = 0; i < new_tok.tok.len; i++) {
-                        //if (new_tok.tok.raw[i] == '\t') new_tok.tok.raw[i] = 't';
-                        //if (new_tok.tok.raw[i] == '\n') new_tok.tok.raw[i] = 'n';
-                        //if (new_tok.tok.raw[i] == '\r') new_tok.tok.raw[i] = 'r';
-                    }
-                    vec_append(&ctx->tokens, new_tok);
-                    continue;
-                }
+    if (LEX_BUF[ctx->curr_offset] == '\n') {
+        lex_end_line(ctx);
+        return 0;
+    }
 
-                // punctuators:
-                case '[':
-                case ']':
-                case '(':
-                case ')':
-                case '{':
-                case '}': {
-                    //create token
-                    token new_tok = (token){.type = PPTOK_PUNCT,
-                                             .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                             .line = ctx->curr_line};
-                    //assign correct ctok
-                    token_type itype = TOK_INVALID;
-                    switch (CURR_CHAR) {
-                        case '[': itype = CTOK_OPEN_SQUBRACE; break;
-                        case ']': itype = CTOK_CLOSE_SQUBRACE; break;
-                        case '(': itype = CTOK_OPEN_PAREN; break;
-                        case ')': itype = CTOK_CLOSE_PAREN; break;
-                        case '{': itype = CTOK_OPEN_BRACE; break;
-                        case '}': itype = CTOK_CLOSE_BRACE; break;
-                    }
-                    new_tok.itype = itype;
-                    vec_append(&ctx->tokens, new_tok);
-                    continue; 
-                }
-                case '.': { // . ...
-                    if (scan_next_char() == '.') {
-                        if (scan_next_char_from(2) == '.') {
-                            token new_tok = (token){.type = PPTOK_PUNCT,
-                                                    .itype = CTOK_ELLIPSIS,
-                                                    .tok = string_make(line.raw + ctx->curr_offset, 3),
-                                                    .line = ctx->curr_line};
-                            vec_append(&ctx->tokens, new_tok);        
-                            ctx->curr_offset += 2;                
-                            continue;
-                        }
-                        //we've detected just ..
-                        //this is erroring
-                        print_lexing_error(ctx, "unexpected token .. found when parsing . case");
+    switch (CURR_CHAR) {
+        case ' ':
+        case '\f': //FIXME?: is this right?
+        case '\t':
+        case '\r': {
+            //whitespace doesnt get a token, the next token just remembers there was some before it
+            for (size_t run = LEX_SCAN(whitespace); run != 0; run = LEX_SCAN(whitespace)) lex_advance_by(ctx, run);
+            ctx->lex_space = true;
+            return 0;
+        }
+        case '/': { // /* //, anything else is a punctuator
+            if (scan_next_char() == '*') { // /* case
+                //this one is VERY special.
+                //we now scan ahead for a corresponding */, running over as many lines as we need to
+                lex_advance(ctx); //skip /*
+                lex_advance(ctx);
+                for (;;) {
+                    if (ctx->curr_offset >= LEX_LEN) {
+                        //point at the comment that was left open, not the end of the file
+                        ctx->curr_offset = start_offset;
+                        print_lexing_error(ctx, "did not find a corresponding */ to close a multi-line comment.");
                         return -1;
                     }
-
-                    token new_tok = (token){.type = PPTOK_PUNCT,
-                                            .itype = CTOK_DOT,
-                                            .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                            .line = ctx->curr_line};
-                    vec_append(&ctx->tokens, new_tok);
-                    continue;
-                }
-                case '-': { // -= -> -- -
-                    if (scan_next_char() != '=' && scan_next_char() != '>' && scan_next_char() != '-') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_MINUS,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);
-                        continue;
-                    } else if (scan_next_char() == '=') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_ASSIGN_SUB,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);
-                        ctx->curr_offset++;
-                        continue;
-                    } else if (scan_next_char() == '>') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_ARROW,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);
-                        ctx->curr_offset++;
+                    //everything up to the next *, \n or \\ cant end the comment, so skip it in one go
+                    size_t run = LEX_SCAN(block_comment);
+                    if (run != 0) {
+                        lex_advance_by(ctx, run);
                         continue;
-                    } else if (scan_next_char() == '-') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_DEC,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);
-                        ctx->curr_offset++;
-                        continue;
-                    }
-                    return -1;
-                }
-                case '+': { // += ++ +
-                    if (scan_next_char() != '=' && scan_next_char() != '+') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_PLUS,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);        
-                        continue;               
-                    } else if (scan_next_char() == '=') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_ASSIGN_ADD,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);
-                        ctx->curr_offset++;
-                        continue;                                 
-                    } else if (scan_next_char() == '+') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_INC,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);
-                        ctx->curr_offset++;
-                        continue;                                 
-                    }
-                    return -1;
-                }
-                case '*': { // *= * 
-                    if (scan_next_char() != '=') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_TIMES,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);              
-                        continue;          
-                    } else if (scan_next_char() == '=') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_ASSIGN_TIMES,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);              
-                        ctx->curr_offset++;
-                        continue;          
-                    }
-                    return -1;
-                }
-                case '~': { // ~
-                    token new_tok = (token){.type = PPTOK_PUNCT,
-                                            .itype = CTOK_TILDE,
-                                            .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                            .line = ctx->curr_line};
-                    vec_append(&ctx->tokens, new_tok);
-                    continue;
-                }
-                case '!': { // != !
-                    if (scan_next_char() != '=') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_EXCLAM,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);              
-                        continue;          
-                    } else if (scan_next_char() == '=') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_NOT_EQ,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);              
-                        ctx->curr_offset++;
-                        continue;          
                     }
-                    return -1;
-                }
-                case '/': { // / /* /= //
-                    //this COULD be punctuation, namely / or /=. we now check for this
-                    if (scan_next_char() != '=' && scan_next_char() != '*' && scan_next_char() != '/') { // / case.
-                        //this if is kinda ugly, but its required to correctly lex with identifiers against punct
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_FWSLASH,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);
-                        //we dont skip offset here, since we only scan this one
-                        continue;
-                    } else if (scan_next_char() == '=') { // /= case
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_ASSIGN_DIV,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);
-                        ctx->curr_offset++;
-                        continue;                        
-                    } else if (scan_next_char() == '*') { // /* case
-                        //this one is VERY special.
-                        //we now scan ahead, searching every 2 characters for a corresponding */
-                        //this requires a lexer state change
-                        ctx->curr_offset++; //skip /*
-                        ml_comment = true;
-                        continue;  
-                    } else if (scan_next_char() == '/') { // // case
-                        //we can now skip this line COMPLETELY, so we set offset to the end of the line
-                        ctx->curr_offset = line.len;
+                    if (LEX_BUF[ctx->curr_offset] == '\n') {
+                        lex_end_line(ctx);
                         continue;
                     }
-                    return -1;
-                }
-                case '%': { //%:%: %> %= %: %
-                    if (scan_next_char() != ':' && scan_next_char() != '>' && scan_next_char() != '=') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_PERCENT,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);          
-                        continue;              
-                    } else if (scan_next_char() == '>') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_CLOSE_BRACE,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);    
-                        ctx->curr_offset++;
-                        continue;                     
-                    } else if (scan_next_char() == '=') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_ASSIGN_MOD,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);    
-                        ctx->curr_offset++;
-                        continue;                                   
-                    } else if (scan_next_char() == ':') {
-                        if (scan_next_char_from(2) == '%' && scan_next_char_from(3) == ':') {
-                            token new_tok = (token){.type = PPTOK_PUNCT,
-                                                    .itype = CTOK_HASH_HASH,
-                                                    .tok = string_make(line.raw + ctx->curr_offset, 4),
-                                                    .line = ctx->curr_line};
-                            vec_append(&ctx->tokens, new_tok);    
-                            ctx->curr_offset+=3;
-                            continue;                                     
-                        }
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_HASH,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);    
-                        ctx->curr_offset++;
-                        continue;                                   
-                    } 
-                    return -1;
-                }
-                case '<': { // <<= << <= <: <% < 
-                    if (scan_next_char() != '<' && scan_next_char() != '=' && scan_next_char() != ':' && scan_next_char() != '%') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_LESS_THAN,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);          
-                        continue;         
-                    } else if (scan_next_char() == '<') {
-                        if (scan_next_char_from(2) == '=') {
-                            token new_tok = (token){.type = PPTOK_PUNCT,
-                                                    .itype = CTOK_ASSIGN_LSHIFT,
-                                                    .tok = string_make(line.raw + ctx->curr_offset, 3),
-                                                    .line = ctx->curr_line};
-                            vec_append(&ctx->tokens, new_tok);      
-                            ctx->curr_offset+=2;    
-                            continue;                              
-                        }
-
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_LSHIFT,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);      
-                        ctx->curr_offset++;    
-                        continue;                                
-                    } else if (scan_next_char() == '=') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_LESS_EQ,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);      
-                        ctx->curr_offset++;    
-                        continue;                               
-                    } else if (scan_next_char() == ':') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_OPEN_SQUBRACE,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);      
-                        ctx->curr_offset++;    
-                        continue;                                
-                    } else if (scan_next_char() == '%') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_OPEN_BRACE,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);      
-                        ctx->curr_offset++;    
-                        continue;                                
-                    }
-                    return -1;
-                }
-                case '>': { // >>= >> >= > 
-                    if (scan_next_char() != '>' && scan_next_char() != '=') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_GREATER_THAN,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);       
-                        continue;                                 
-                    } else if (scan_next_char() == '>') {
-                        if (scan_next_char_from(2) == '=') {
-                            token new_tok = (token){.type = PPTOK_PUNCT,
-                                                    .itype = CTOK_ASSIGN_RSHIFT,
-                                                    .tok = string_make(line.raw + ctx->curr_offset, 3),
-                                                    .line = ctx->curr_line};
-                            vec_append(&ctx->tokens, new_tok);      
-                            ctx->curr_offset+=2;    
-                            continue;                              
-                        }
-
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_RSHIFT,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);      
-                        ctx->curr_offset++;    
-                        continue;                              
-                    } else if (scan_next_char() == '=') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_GREATER_EQ,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);      
-                        ctx->curr_offset++;    
-                        continue;                                
+                    if (CURR_CHAR == '*' && scan_next_char() == '/') {
+                        lex_advance(ctx);
+                        lex_advance(ctx);
+                        break;
                     }
-                    return -1;
+                    lex_advance(ctx);
                 }
-                case '=': { // == = 
-                    if (scan_next_char() != '=') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_EQ,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);       
-                        continue;                                                
-                    } else if (scan_next_char() == '=') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_EQ_EQ,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);       
-                        ctx->curr_offset++;
-                        continue;                            
-                    }
-                    return -1;
+                //a comment is worth one space
+                ctx->lex_space = true;
+                return 0;
+            } else if (scan_next_char() == '/') { // // case
+                //we can now skip the rest of this line COMPLETELY
+                while (!AT_LINE_END) {
+                    size_t run = LEX_SCAN(line_comment);
+                    if (run != 0) lex_advance_by(ctx, run);
+                    else lex_advance(ctx);
                 }
-                case '^': { // ^= ^
-                    if (scan_next_char() != '=') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_CARET,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);       
-                        continue;                                                
-                    } else if (scan_next_char() == '=') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_ASSIGN_XOR,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);       
-                        ctx->curr_offset++;
-                        continue;                            
-                    }
-                    return -1;
-                }
-                case '|': { // |= || | 
-                    if (scan_next_char() != '=' && scan_next_char() != '|') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_OR,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);       
-                        continue;                                            
-                    } else if (scan_next_char() == '=') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_ASSIGN_OR,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);       
-                        ctx->curr_offset++;
-                        continue;                               
-                    } else if (scan_next_char() == '|') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_OR_OR,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);       
-                        ctx->curr_offset++;
-                        continue;                               
-                    }
-                    return -1;
-                } 
-                case '&': { // &= && &
-                    if (scan_next_char() != '=' && scan_next_char() != '&') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_AMPERSAND,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);       
-                        continue;                                            
-                    } else if (scan_next_char() == '=') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_ASSIGN_AND,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);       
-                        ctx->curr_offset++;
-                        continue;                               
-                    } else if (scan_next_char() == '&') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_AND_AND,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);       
-                        ctx->curr_offset++;
-                        continue;                               
-                    }
-                    return -1;
-                }   
-                case '?': { // ?
-                    token new_tok = (token){.type = PPTOK_PUNCT,
-                                            .itype = CTOK_QUESTION,
-                                            .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                            .line = ctx->curr_line};
-                    vec_append(&ctx->tokens, new_tok);              
-                    continue;      
-                }    
-                case ':': { // :> :: : 
-                    if (scan_next_char() != '>' && scan_next_char() != ':') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_COLON,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);       
-                        continue;                                            
-                    } else if (scan_next_char() == '>') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_CLOSE_BRACE,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);       
-                        ctx->curr_offset++;
-                        continue;                               
-                    } else if (scan_next_char() == ':') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_COLON_COLON,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);       
-                        ctx->curr_offset++;
-                        continue;                               
-                    }
-                    return -1;
-                }
-                case ';': { // ;
-                    token new_tok = (token){.type = PPTOK_PUNCT,
-                                            .itype = CTOK_SEMICOLON,
-                                            .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                            .line = ctx->curr_line};
-                    vec_append(&ctx->tokens, new_tok);              
-                    continue;      
-                }   
-                case ',': { // ,
-                    token new_tok = (token){.type = PPTOK_PUNCT,
-                                            .itype = CTOK_COMMA,
-                                            .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                            .line = ctx->curr_line};
-                    vec_append(&ctx->tokens, new_tok);              
-                    continue;      
-                }        
-                case '#': { // # ## 
-                    if (scan_next_char() != '#') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_HASH,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 1),
-                                                .after_newline = after_newline,
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);       
-                        continue;                                                
-                    } else if (scan_next_char() == '#') {
-                        token new_tok = (token){.type = PPTOK_PUNCT,
-                                                .itype = CTOK_HASH_HASH,
-                                                .tok = string_make(line.raw + ctx->curr_offset, 2),
-                                                .line = ctx->curr_line};
-                        vec_append(&ctx->tokens, new_tok);       
-                        ctx->curr_offset++;
-                        continue;                            
-                    }
-                    return -1;                    
-                }
-                case '\'': // char literals
-                case '\"': { // string literals
-                    if (pp_scan_char_or_str(ctx) != 0) return -1;
-                    continue;                    
-                }
-
-                default:
-                    //first, we need to detect if we've just fell into an encoding for a string or char lit
-                    if (pp_detect_encoding(ctx) != 0) {
-                        //we did, lets scan a char or str.
-                        if (pp_scan_char_or_str(ctx) != 0) return -1;
-                        continue;
-                    }
-
-                    if (isalpha(CURR_CHAR) || CURR_CHAR == '_') {
-                        if (pp_scan_identifier(ctx) != 0) return -1;
-                        continue;
-                    } 
-                    if (isdigit(CURR_CHAR)) {
-                        if (pp_scan_number(ctx) != 0) return -1;
-                        continue;
-                    }
-                    print_lexing_error(ctx, "encountered unexpected char %c", line.raw[ctx->curr_offset], i + 1, ctx->curr_offset + 1);
-                    return -1;
+                return 0;
             }
+            return pp_scan_punct(ctx);
         }
+        case '\'': // char literals
+        case '\"': // string literals
+            return pp_scan_char_or_str(ctx);
+
+        default:
+            //first, we need to detect if we've just fell into an encoding for a string or char lit
+            if (pp_detect_encoding(ctx) != 0) return pp_scan_char_or_str(ctx);
+            if (lex_is_ident_start(CURR_CHAR)) return pp_scan_identifier(ctx);
+            if (lex_is_digit(CURR_CHAR) || (CURR_CHAR == '.' && lex_is_digit(scan_next_char()))) return pp_scan_number(ctx);
+            return pp_scan_punct(ctx);
+    }
+}
+
+void lex_begin(parser_ctx* ctx) {
+    ctx->curr_line = 0;
+    ctx->curr_offset = 0;
 
+    //phase 1: a utf-8 BOM carries no information for us, so its dropped before we start
+    if (LEX_LEN >= 3 && memcmp(LEX_BUF, "\xEF\xBB\xBF", 3) == 0) ctx->curr_offset = 3;
+    ctx->curr_offset = lex_splice_end(ctx, ctx->curr_offset);
+    ctx->lex_after_newline = true;
+    ctx->lex_space = false;
+}
 
+int parser_phase3(parser_ctx* ctx) {
+    //we continually iterate over all the characters in the source buffer,
+    //and lex_step works out what to do with whatever we're sat on.
+    //whitespace never becomes a token. all we keep of it is preceded_by_space on the token after it,
+    //which is enough for stringising and for printing the stream back out.
+    lex_init();
+    lex_begin(ctx);
+    ctx->lex_tolerant = true;
+
+    while (ctx->curr_offset < LEX_LEN) {
+        if (lex_step(ctx) != 0) return -1;
     }
 
-    if (ml_comment == true) {
-        print_lexing_error(ctx, "did not find a corresponding */ to close a multi-line comment.");
+    //"A source file that is not empty shall end in a new-line character, which shall not be immediately preceded by a
+    //backslash character before any such splicing takes place."
+    //we let the first half of that go, but not the second.
+    if (LEX_LEN >= 2 && LEX_BUF[LEX_LEN - 2] == '\\' && LEX_BUF[LEX_LEN - 1] == '\n') {
+        ctx->curr_offset = LEX_LEN - 2;
+        print_lexing_error(ctx, "Unexpected \\ at end of file");
+        return -1;
     }
 
     return 0;
 }
 
+void lex_adopt(parser_ctx* ctx) {
+    //finishes off a deferred lex, now that we're back where the atom table and scratch can be touched
+    if (vec_len(ctx->lex_scratch) != 0) {
+        //stitched tokens have an offset into lex_scratch, which all goes into scratch in one go
+        u32 base = source_scratch(string_make(ctx->lex_scratch, vec_len(ctx->lex_scratch)));
+        for_vec(u32* index, &ctx->lex_stitched) ctx->tokens[*index].loc += base;
+    }
+    size_t next_hash = 0;
+    for_vec(token* tok, &ctx->tokens) {
+        if (tok->type != PPTOK_IDENTIFIER) continue;
+        source_file* src = source_for_loc(tok->loc);
+        tok->atom = atom_intern_hashed(string_make(src->buf.raw + (tok->loc - src->base), tok->len), ctx->lex_hashes[next_hash++]);
+    }
+    vec_destroy(&ctx->lex_hashes);
+    vec_destroy(&ctx->lex_scratch);
+    vec_destroy(&ctx->lex_stitched);
+    ctx->lex_deferred = false;
+}
+
+size_t lex_one_token(cobalt_ctx* cctx, string text, u32 base, token* out) {
+    //lexes exactly one token from the start of text, which has to live at location base.
+    //gives back how many bytes it used, or 0 if there wasnt a token to be had.
+    source_file src = {.path = strlit("<token>"), .buf = text, .base = base};
+    parser_ctx lctx = {.src = &src, .ctx = cctx, .lex_single = out};
+    lex_init();
+    lex_begin(&lctx);
+
+    //lex_emit clears lex_single once its written the token, so thats how we know to stop
+    while (lctx.lex_single != NULL && lctx.curr_offset < text.len) {
+        if (lex_step(&lctx) != 0) return 0;
+    }
+    if (lctx.lex_single != NULL) return 0;
+    return lctx.tok_end;
+}
+
+int lex_explain(parser_ctx* ctx, token bad) {
+    //bad never got stitched, so its location is still in the file it came from, and lexing from there gets us to
+    //the same error as before. always gives back -1
+    source_file* src = token_source(bad);
+    token out;
+    parser_ctx lctx = {.src = src, .ctx = ctx->ctx, .curr_offset = bad.loc - src->base, .lex_single = &out};
+    if (lex_step(&lctx) != -1) crash("a bad token lexed fine the second time!");
+    return -1;
+}
+
 bool is_c_token(string str) {
     return false;
 }
@@ -0,0 +1,117 @@
+#include "alloc.h"
+#include "cobalt.h"
+#include "crash.h"
+#include "parse.h"
+
+#include "common/str.h"
+#include "common/util.h"
+#include "common/vec.h"
+
+// the macro table. macros are keyed by the atom of their name, so looking one up is a hash of a u32 and a short probe,
+// no matter how many thousands of macros the system headers have dumped on us.
+// the records themselves live in a pool of fixed size chunks that never move, so anyone halfway through an expansion
+// can hang onto a macro_define* even if more macros get defined (or this one gets undefined) under them.
+// records are never reused, an #undef just unhooks the record from its name.
+//
+// the table also keeps the memos phase 4 makes of object-like macros (see pp_memo), since its the one place every
+// #define and #undef goes through. each memo knows which names it read, and changing any of them drops it.
+
+#define MACRO_CHUNK_SIZE 256
+
+u32 macro_hash(u32 atom) {
+    //atoms are handed out in order, so spread them out before masking. fibonacci hashing does that for free
+    return atom * 2654435769u;
+}
+
+macro_table* macro_table_new() {
+    macro_table* table = cmalloc(sizeof(*table));
+    *table = (macro_table){.entries = vec_new(macro_entry, 256),
+                           .slots = {0},
+                           .chunks = vec_new(macro_define*, 4),
+                           .chunk_used = MACRO_CHUNK_SIZE,
+                           .memos = vec_new(macro_memo, 256),
+                           .memo_users = vec_new(Vec(u32), 256)};
+    return table;
+}
+
+macro_define* macro_lookup(macro_table* table, u32 atom) {
+    //fibonacci hashing is a bijection on u32s, so the hash is as good as the atom and theres nothing else to check
+    slot* at = slot_find(&table->slots, macro_hash(atom), NULL, NULL);
+    return at->id != 0 ? table->entries[at->id - 1].def : NULL;
+}
+
+macro_define* macro_add(macro_table* table, macro_define def) {
+    if (def.name.type != PPTOK_IDENTIFIER) crash("tried to define a macro without an identifier for a name!");
+
+    if (table->chunk_used == MACRO_CHUNK_SIZE) {
+        vec_append(&table->chunks, cmalloc(MACRO_CHUNK_SIZE * sizeof(macro_define)));
+        table->chunk_used = 0;
+    }
+    macro_define* record = &table->chunks[vec_len(table->chunks) - 1][table->chunk_used++];
+    *record = def;
+
+    macro_forget(table, def.name.atom);
+    u32 hash = macro_hash(def.name.atom);
+    slot* at = slot_find(&table->slots, hash, NULL, NULL);
+    if (at->id != 0) {
+        table->entries[at->id - 1].def = record;
+        return record;
+    }
+    vec_append(&table->entries, ((macro_entry){.atom = def.name.atom, .def = record}));
+    slot_add(&table->slots, at, hash, vec_len(table->entries));
+    return record;
+}
+
+bool macro_remove(macro_table* table, u32 atom) {
+    slot* at = slot_find(&table->slots, macro_hash(atom), NULL, NULL);
+    if (at->id == 0 || table->entries[at->id - 1].def == NULL) return false;
+    table->entries[at->id - 1].def = NULL;
+    macro_forget(table, atom);
+    return true;
+}
+
+macro_memo* macro_memo_of(macro_table* table, u32 atom) {
+    //the pointer is only good until the next call, since making room can move the memos
+    while (vec_len(table->memos) <= atom) {
+        vec_append(&table->memos, ((macro_memo){.known = false, .expansion = NULL}));
+    }
+    return &table->memos[atom];
+}
+
+void macro_memo_depends(macro_table* table, u32 user, u32 atom) {
+    //user's memo read atom, so it goes if atom changes
+    while (vec_len(table->memo_users) <= atom) vec_append(&table->memo_users, NULL);
+    if (table->memo_users[atom] == NULL) table->memo_users[atom] = vec_new(u32, 4);
+    vec_append(&table->memo_users[atom], user);
+}
+
+void macro_forget(macro_table* table, u32 atom) {
+    //atom is being (un)defined, so every memo that read it is wrong now. a user can be listed here after its
+    //memo has been remade without reading atom, which just costs it a remake
+    if (atom >= vec_len(table->memo_users) || table->memo_users[atom] == NULL) return;
+    for_vec(u32* user, &table->memo_users[atom]) {
+        macro_memo* memo = &table->memos[*user];
+        if (memo->expansion != NULL) vec_destroy(&memo->expansion);
+        memo->known = false;
+    }
+    vec_clear(&table->memo_users[atom]);
+}
+
+bool macro_same_definition(macro_define* a, macro_define* b) {
+    //6.10.5.2: a macro can be redefined, but only to exactly what it already was.
+    //the spacing inside the list has to match too, but how much space there was doesnt matter
+    if (a->is_function != b->is_function || a->is_variadic != b->is_variadic) return false;
+    if (vec_len(a->arguments) != vec_len(b->arguments)) return false;
+    if (vec_len(a->replacement_list) != vec_len(b->replacement_list)) return false;
+    for_n(i, 0, vec_len(a->arguments)) {
+        if (!string_eq(token_text(a->arguments[i]), token_text(b->arguments[i]))) return false;
+    }
+    for_n(i, 0, vec_len(a->replacement_list)) {
+        token left = a->replacement_list[i];
+        token right = b->replacement_list[i];
+        if (left.type != right.type) return false;
+        if (i != 0 && left.preceded_by_space != right.preceded_by_space) return false;
+        if (!string_eq(token_text(left), token_text(right))) return false;
+    }
+    return true;
+}
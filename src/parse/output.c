@@ -0,0 +1,133 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "cobalt.h"
+#include "crash.h"
+#include "parse.h"
+
+#include "common/str.h"
+#include "common/util.h"
+#include "common/vec.h"
+
+// -E output. phase 4's tokens get written out as text, one line of output per line they came from, with
+// # line "file" markers wherever the file changes or the lines jump too far to be worth filling in with blank ones.
+// everything goes through one big buffer, which only hits the file when its full, so even a huge translation unit
+// is a few hundred write calls rather than one per token.
+//
+// markers and blank lines go by physical line, so they agree with __LINE__ and with the file itself. tokens only know
+// their logical line, so each one goes out on the physical line its logical line starts on. everything on a run of
+// spliced lines ends up on one line of output, and blank lines after it make up the difference.
+
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+//a gap of more lines than this gets a marker instead of blank lines, same as gcc
+#define OUTPUT_MAX_BLANK_LINES 8
+
+typedef struct {
+    int fd;
+    char* buf;
+    size_t len;
+    bool failed;
+} output_writer;
+
+void output_flush(output_writer* out) {
+    size_t done = 0;
+    while (done < out->len && !out->failed) {
+        ssize_t written = write(out->fd, out->buf + done, out->len - done);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) out->failed = true;
+        else done += written;
+    }
+    out->len = 0;
+}
+
+void output_write(output_writer* out, char* text, size_t len) {
+    if (out->len + len > OUTPUT_BUFFER_SIZE) output_flush(out);
+    //anything too big for the buffer on its own just goes straight through
+    if (len > OUTPUT_BUFFER_SIZE) {
+        out->len = len;
+        char* buf = out->buf;
+        out->buf = text;
+        output_flush(out);
+        out->buf = buf;
+        return;
+    }
+    memcpy(out->buf + out->len, text, len);
+    out->len += len;
+}
+
+void output_char(output_writer* out, char c) {
+    if (out->len == OUTPUT_BUFFER_SIZE) output_flush(out);
+    out->buf[out->len++] = c;
+}
+
+void output_marker(output_writer* out, u32 line, string path) {
+    //# line "file", with any \ or " in the path escaped like a string literal
+    char number[16];
+    int number_len = snprintf(number, sizeof(number), "# %u \"", line + 1);
+    output_write(out, number, number_len);
+    for_n(i, 0, path.len) {
+        if (path.raw[i] == '\\' || path.raw[i] == '"') output_char(out, '\\');
+        output_char(out, path.raw[i]);
+    }
+    output_write(out, "\"\n", 2);
+}
+
+int pp_write_output(parser_ctx* ctx, string path) {
+    //writes what phase 4 left in ctx to path, or to stdout if path is -
+    bool to_stdout = string_eq(path, strlit("-"));
+    int fd = to_stdout ? STDOUT_FILENO : open(clone_to_cstring(path), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("unable to open "str_fmt" for writing\n", str_arg(path));
+        return -1;
+    }
+    //anything printf is still sat on has to go out before we start writing around it
+    if (to_stdout) fflush(stdout);
+    output_writer out = {.fd = fd, .buf = cmalloc(OUTPUT_BUFFER_SIZE), .len = 0, .failed = false};
+
+    size_t next_origin = 0;
+    source_file* src = NULL;
+    string src_path = {0};
+    u32 line = 0;
+    bool at_line_start = true;
+    for_n(i, 0, vec_len(ctx->tokens)) {
+        token tok = ctx->tokens[i];
+        bool new_file = false;
+        while (next_origin < vec_len(ctx->origins) && ctx->origins[next_origin].index <= i) {
+            //every origin is a new visit to a file, even if its the same file as before
+            pp_origin origin = ctx->origins[next_origin++];
+            src = origin.src;
+            src_path = src != NULL ? src->path : origin.path;
+            new_file = true;
+        }
+
+        //tokens from a pch dont have a file to look at, but the pch gave them the physical line already
+        u32 tok_line = src != NULL ? source_physical_line(src, tok.line) : tok.line;
+        if (new_file || tok_line < line || tok_line - line > OUTPUT_MAX_BLANK_LINES) {
+            if (!at_line_start) output_char(&out, '\n');
+            output_marker(&out, tok_line, src_path);
+            at_line_start = true;
+        } else if (tok_line != line) {
+            //end the line we're on, and leave a blank one for each line that had nothing in it
+            for (; line < tok_line; line++) output_char(&out, '\n');
+            at_line_start = true;
+        }
+        line = tok_line;
+
+        if (tok.preceded_by_space && !at_line_start) output_char(&out, ' ');
+        string text = token_text(tok);
+        output_write(&out, text.raw, text.len);
+        at_line_start = false;
+    }
+    if (!at_line_start) output_char(&out, '\n');
+    output_flush(&out);
+    cfree(out.buf);
+
+    bool failed = out.failed;
+    if (!to_stdout && close(fd) != 0) failed = true;
+    if (failed) printf("unable to write "str_fmt"\n", str_arg(path));
+    return failed ? -1 : 0;
+}
@@ -7,6 +7,7 @@
 #include "cobalt.h"
 #include "parse.h"
 #include "alloc.h"
+#include "crash.h"
 
 #include "common/ansi.h"
 #include "common/str.h"
@@ -20,147 +21,78 @@
 // NOTABLE deviations: we ignore 6.10.5.4.3, since that seems fucking annoying. if this comes up as an issue,
 //                     we can implement this correctly.                 
 
-int parse_file(cobalt_ctx* ctx, bool is_include) {
-    //load file into buffer
-    FsFile* curr_file = fs_open(clone_to_cstring(ctx->curr_file), false, false);
-    if (curr_file == NULL && !is_include) {
+int parse_file(cobalt_ctx* ctx) {
+    //before anything can go wrong, so theres a report (even an empty one) however far we get
+    if (ctx->header_report.len != 0) report_start(ctx);
+
+    //map the file in. we dont copy it, every line and token we make is a view into this
+    source_file* src = source_open(ctx->curr_file);
+    if (src == NULL) {
         printf("unable to open file "str_fmt": %s\n", str_arg(ctx->curr_file), strerror(errno));
         return -1;
-    } else if (curr_file == NULL) {
-        //we search in the ctx's include paths for the correct path.
-        for_n(i, 0, vec_len(ctx->include_paths)) {
-            string* path = &ctx->include_paths[i];
-            string new_path = string_concat(*path, ctx->curr_file);
-            printf("trying path: "str_fmt"\n", str_arg(new_path));
-            curr_file = fs_open(clone_to_cstring(new_path), false, false);
-            if (curr_file != NULL) {
-                i = vec_len(ctx->include_paths) + 1;
-            }
-        }
-
-        if (curr_file == NULL) {
-            printf("unable to open file: "str_fmt"\n", str_arg(ctx->curr_file));
-            return -1;
-        }
     }
 
-
-
-    string buf = string_alloc(curr_file->size + 1);
-    fs_read(curr_file, buf.raw, buf.len);
-    fs_close(curr_file);
-
     #ifdef FUZZ
     unlink("fuzz.c");
     #endif
 
-    //now, we split the entire file up into "lines"
-    //this forms the physical lines, which will be augmented to then form the logical lines
-    //__LINE__ does not respect physical line information, so for ease of implementation we'll make it respect
-    //logical line information.
-    Vec(string) physical_lines = vec_new(string, 1);
-    size_t starting_val = 0;
-    size_t len = 0;
-
-    //TODO FATAL: fix the off by one here thats causing an OOB read w/ memcpy
-    for (size_t i = 0; i < buf.len; i++) {
-        //even though the c standard says in 5.1.1.2.2 that 
-        //"A source file that is not empty shall end in a new-line character, which shall not be immediately preceded by a
-        //backslash character before any such splicing takes place."
-        //we're gonna allow non-newline ends
-        if (buf.raw[i] == '\n' || i + 1 >= buf.len) {
-            if (len == 0) {
-                starting_val++;
-                continue;
-            }
-            //we've hit a newline (or EOF)!
-            //increase len, and then slice
-            
-            len++;
-            //we create a new line allocation and put it in physical_lines
-            //since we wanna mutate these lines to put them in logical_lines
-            //could this be optimised to use less memory? yeah, but thats fine
-            string line = string_alloc(len);
-            //move info into line
-            memmove(line.raw, buf.raw + starting_val, len);
-            //append and update walker info
-            vec_append(&physical_lines, line);
-            starting_val = i + 1;
-            len = 0;
-            continue;
-        }
-        len++;
-    }
-
-
-    //phase 1 is skipped for now
-    //parser_phase1(ctx);
-
     parser_ctx* pctx = cmalloc(sizeof(*pctx));
     *pctx = (parser_ctx){.tokens = vec_new(token, 1),
+                         .src = src,
                          .curr_offset = 0,
                          .ctx = ctx,
-                         .pragma_files = vec_new(string, 1),
-                         .defines = vec_new(macro_define, 1)};
+                         .defines = macro_table_new(),
+                         .prelude = NULL,
+                         .prelude_origins = NULL,
+                         .origins = NULL};
 
     ctx->pctx = pctx;
 
-    if (parser_phase2(pctx, physical_lines) != 0) return -1;
+    if (ctx->include_pch.len != 0 && pch_load(pctx, ctx->include_pch) != 0) return -1;
+
+    //phases 1 and 2 are folded into the scanner, so they happen as we tokenise
+    if (report_phase(pctx, "phase 3", parser_phase3) != 0) return -1;
 
-    if (parser_phase3(pctx) != 0) return -1;
+    if (report_phase(pctx, "phase 4", parser_phase4) != 0) return -1;
 
-    int retval = parser_phase4(pctx);
-    if (retval == 0x1234) return 0x1234; //pragma sentinel
-    else if (retval != 0) return -1;
-    
-    if (is_include) return 0;
+    //a pch is everything phase 4 knows, so thats as far as we go
+    if (ctx->emit_pch) return pch_write(pctx, ctx->output_path);
 
-    if (parser_phase5(pctx) != 0) return -1;
+    //and -E is just phase 4's output, written out as text
+    if (ctx->preprocess_only) return pp_write_output(pctx, ctx->output_path);
 
-    if (parser_phase6(pctx) != 0) return -1;
-    
-    print_token_stream(pctx);
+    if (report_phase(pctx, "phase 5", parser_phase5) != 0) return -1;
 
-    if (parser_phase7(pctx) != 0) return -1;
+    if (report_phase(pctx, "phase 6", parser_phase6) != 0) return -1;
+
+    if (report_phase(pctx, "phase 7", parser_phase7) != 0) return -1;
 
     cfree(pctx);
 
     return 0;
 }
 
-void print_parsing_error(parser_ctx* ctx, token err_tok, char* format, ...) {
-    //this handles errors relating to tokens, and so needs a token based error printing
-    print_token_stream(ctx);
-    if (ctx->ctx->no_colour) printf(str_fmt ":%d: error: ", str_arg(ctx->ctx->curr_file), err_tok.line + 1);
-    else printf(Bold str_fmt ":%d: " Reset Red Bold"error: "Reset, str_arg(ctx->ctx->curr_file), err_tok.line + 1);
-
-    va_list args;
-    va_start(args, format);
-    vprintf(format, args);
-    va_end(args);
-    printf("\n");
-    
+void print_token_snippet(parser_ctx* ctx, token err_tok, u32 line, source_file* src, char* highlight) {
     //left justify the number when printing
-    size_t num_len = snprintf(NULL, 0, "%d", err_tok.line + 1);
+    size_t num_len = snprintf(NULL, 0, "%d", line + 1);
     string left_just_string = strlit("     ");
     left_just_string.raw += num_len;
-    printf(str_fmt"%d | ", str_arg(left_just_string), err_tok.line + 1);
-
-    //assuming this token is actually from the line we care about, this should be relatively easy.
- 
-    //split the erroring line into 3 pieces, so we can bold the section we want
-    string error_line = ctx->logical_lines[err_tok.line];
-    string left_piece = string_make(error_line.raw, err_tok.tok.raw - error_line.raw);
-    string central_piece = err_tok.tok;
-    string right_piece = string_make(error_line.raw + left_piece.len + err_tok.tok.len, error_line.len - central_piece.len - left_piece.len);
-    
-    if (left_piece.len + central_piece.len + 1 > 0xFFFF) return; //we're in a macro
+    printf(str_fmt"%d | ", str_arg(left_just_string), line + 1);
+
+    //split the erroring line into 3 pieces, so we can bold the section we want.
+    //a token that runs over a splice only gets underlined up to the end of its first line.
+    string error_line = source_line_text(src, line);
+    size_t column = source_column_of(src, err_tok.loc - src->base);
+    string err_text = token_source_text(err_tok);
+    if (column > error_line.len) column = error_line.len;
+    if (err_text.len > error_line.len - column) err_text.len = error_line.len - column;
+    string left_piece = string_make(error_line.raw, column);
+    string central_piece = string_make(error_line.raw + column, err_text.len);
+    string right_piece = string_make(error_line.raw + column + central_piece.len, error_line.len - column - central_piece.len);
 
     //print out the erroring line
     if (ctx->ctx->no_colour) printf(str_fmt"\n", str_arg(error_line));
-    else printf(str_fmt Bold Red str_fmt Reset str_fmt, str_arg(left_piece), str_arg(central_piece), str_arg(right_piece));
-
-    if (right_piece.raw[right_piece.len - 1] != '\n') printf("\n");
+    else printf(str_fmt "%s" str_fmt Reset str_fmt"\n", str_arg(left_piece), highlight, str_arg(central_piece), str_arg(right_piece));
 
     //on linux, we could use ansi escape sequences to move the cursor.
     //i do not trust microsoft to implement this correctly.
@@ -174,7 +106,7 @@ void print_parsing_error(parser_ctx* ctx, token err_tok, char* format, ...) {
         if (isgraph(left_piece.raw[i])) break;
     }
     //copy that many bytes from left_piece into empty_space, so that the tabs match to ensure correct positioning
-    memcpy(empty_space.raw + 1, left_piece.raw, i);
+    memcpy(empty_space.raw, left_piece.raw, i);
     //now, we fill out with ~
     for (size_t i = left_piece.len; i < left_piece.len + central_piece.len; i++) {
         empty_space.raw[i] = '~';
@@ -182,64 +114,45 @@ void print_parsing_error(parser_ctx* ctx, token err_tok, char* format, ...) {
     empty_space.raw[left_piece.len] = '^';
 
     if (ctx->ctx->no_colour) printf("      | "str_fmt"\n", str_arg(empty_space));
-    else printf("      | "Red Bold str_fmt Reset"\n", str_arg(empty_space));
-    return;
+    else printf("      | %s"str_fmt Reset"\n", highlight, str_arg(empty_space));
 }
 
-void print_parsing_warning(parser_ctx* ctx, token err_tok, char* format, ...) {
+void print_parsing_error(parser_ctx* ctx, token err_tok, char* format, ...) {
     //this handles errors relating to tokens, and so needs a token based error printing
+    //tokens made up during macro expansion dont have a line we can show, so they get the logical line number
+    //and no snippet
+    source_file* src = token_source(err_tok);
+    string file = src != NULL ? src->path : ctx->ctx->curr_file;
+    u32 line = src != NULL ? source_line_of(src, err_tok.loc - src->base) : err_tok.line;
 
-    if (ctx->ctx->no_colour) printf(str_fmt ":%d: warning: ", str_arg(ctx->ctx->curr_file), err_tok.line + 1);
-    else printf(Bold str_fmt ":%d: " Yellow Bold"warning: "Reset, str_arg(ctx->ctx->curr_file), err_tok.line + 1);
+    if (ctx->ctx->no_colour) printf(str_fmt ":%d: error: ", str_arg(file), line + 1);
+    else printf(Bold str_fmt ":%d: " Reset Red Bold"error: "Reset, str_arg(file), line + 1);
 
     va_list args;
     va_start(args, format);
     vprintf(format, args);
     va_end(args);
     printf("\n");
-    
-    //left justify the number when printing
-    size_t num_len = snprintf(NULL, 0, "%d", err_tok.line + 1);
-    string left_just_string = strlit("     ");
-    left_just_string.raw += num_len;
-    printf(str_fmt"%d | ", str_arg(left_just_string), err_tok.line + 1);
 
-    //assuming this token is actually from the line we care about, this should be relatively easy.
-
-    //split the erroring line into 3 pieces, so we can bold the section we want
-    string error_line = ctx->logical_lines[err_tok.line];
-    string left_piece = string_make(error_line.raw, err_tok.tok.raw - error_line.raw);
-    string central_piece = err_tok.tok;
-    string right_piece = string_make(error_line.raw + left_piece.len + err_tok.tok.len, error_line.len - central_piece.len - left_piece.len);
-    
-    //print out the erroring line
-    if (ctx->ctx->no_colour) printf(str_fmt"\n", str_arg(error_line));
-    else printf(str_fmt Bold Yellow str_fmt Reset str_fmt, str_arg(left_piece), str_arg(central_piece), str_arg(right_piece));
+    if (src != NULL) print_token_snippet(ctx, err_tok, line, src, Red Bold);
+}
 
-    if (right_piece.raw[right_piece.len - 1] != '\n') printf("\n");
+void print_parsing_warning(parser_ctx* ctx, token err_tok, char* format, ...) {
+    //this handles errors relating to tokens, and so needs a token based error printing
+    source_file* src = token_source(err_tok);
+    string file = src != NULL ? src->path : ctx->ctx->curr_file;
+    u32 line = src != NULL ? source_line_of(src, err_tok.loc - src->base) : err_tok.line;
 
-    //on linux, we could use ansi escape sequences to move the cursor.
-    //i do not trust microsoft to implement this correctly.
-    string empty_space;
-    empty_space.raw = ccharalloc(left_piece.len + central_piece.len + 1, ' ');
-    empty_space.len = left_piece.len + central_piece.len + 1;
+    if (ctx->ctx->no_colour) printf(str_fmt ":%d: warning: ", str_arg(file), line + 1);
+    else printf(Bold str_fmt ":%d: " Yellow Bold"warning: "Reset, str_arg(file), line + 1);
 
-    //now, we scan left_piece until we hit non-whitespace
-    size_t i = 0;
-    for (; i < left_piece.len; i++) {
-        if (isgraph(left_piece.raw[i])) break;
-    }
-    //copy that many bytes from left_piece into empty_space, so that the tabs match to ensure correct positioning
-    memcpy(empty_space.raw + 1, left_piece.raw, i);
-    //now, we fill out with ~
-    for (size_t i = left_piece.len; i < left_piece.len + central_piece.len; i++) {
-        empty_space.raw[i] = '~';
-    }
-    empty_space.raw[left_piece.len] = '^';
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
 
-    if (ctx->ctx->no_colour) printf("      | "str_fmt"\n", str_arg(empty_space));
-    else printf("      | "Yellow Bold str_fmt Reset"\n", str_arg(empty_space));
-    return;
+    if (src != NULL) print_token_snippet(ctx, err_tok, line, src, Yellow Bold);
 }
 
 macro_define init_define() {
@@ -257,55 +170,40 @@ void print_token_stream(parser_ctx* ctx) {
             curr_line = tok->line;
             printf("\n%d: ", curr_line);
         }
-        printf(str_fmt, str_arg(tok->tok));
+        //whitespace is gone by now, so one space stands in for however much there was
+        if (tok->preceded_by_space) printf(" ");
+        printf(str_fmt, str_arg(token_text(*tok)));
     }
     printf("\n");
 }
 
-void parser_phase1(cobalt_ctx* ctx) {
-
-}
-
-int parser_phase2(parser_ctx* ctx, Vec(string) physical_lines) {
-    //phase 2
-    //find all instances of \\n, and delete them, creating fresh new logical lines
-    //we also trim \n here in our logical lines, breaking phase 3 conformance, but its fine
-    Vec(string) logical_lines = vec_new(string, 1);
-
-    string new_line = {.raw = NULL, .len = 0};
-    for_n(i, 0, vec_len(physical_lines)) {
-        string* line = &physical_lines[i];
-        if (new_line.raw == NULL) new_line = *line;
-        //scan to the end of the line to see if it matches the pattern "\\n"
-        //if the line is the LAST line, this check should error!
-        string mut_line = new_line;
-        //same check as the .c check from main.c
-        mut_line.raw = mut_line.raw + mut_line.len - 2;
-        mut_line.len = 2;
-
-        if (string_eq(mut_line, strlit("\\\n"))) {
-            //we need to merge lines!
-            //first, check if this is the last line
-            if (i + 1 >= vec_len(physical_lines)) {
-                //we're at the end! this is ERRORING!
-                print_lexing_error(ctx, "Unexpected \\ at end of file");
-                return -1;
-            }
-            //get rid of the \\n
-            new_line.len -= 2;
-            //create new string with next one appended, then make it logical
-            new_line = string_concat(new_line, physical_lines[i + 1]);
-            
-            continue;
-        } else {
-            new_line.len--;
-            vec_append(&logical_lines, new_line);
-            new_line = (string){.raw = NULL, .len = 0};
-        }
+void token_compact(parser_ctx* ctx, token_rewrite rewrite) {
+    //one pass over ctx->tokens, with a read cursor and a write cursor behind it. rewrite says what the tokens at
+    //the read cursor turn into, which is never more than it used up, so writing never catches up with reading
+    size_t write = 0;
+    size_t read = 0;
+    while (read < vec_len(ctx->tokens)) {
+        token out;
+        bool keep = false;
+        size_t used = rewrite(ctx, read, &out, &keep);
+        if (used == 0) crash("token rewrite didnt use up any tokens!");
+        if (keep) ctx->tokens[write++] = out;
+        read += used;
     }
-    ctx->logical_lines = logical_lines;
+    vec_len(ctx->tokens) = write;
+}
 
-    return 0;
+void token_splice(Vec(token)* tokens, size_t at, size_t remove, token* with, size_t count) {
+    //replaces the remove tokens at at with the count tokens in with. everything after the range gets moved once,
+    //however many tokens go in or come out, so this is the only way anything should be put in the middle of a vec.
+    //with cant point into tokens, since making room can move it
+    size_t len = vec_len(*tokens);
+    size_t tail = len - at - remove;
+    //make room on the end first. whatever gets appended here is overwritten by the move
+    for (size_t i = remove; i < count; i++) vec_append(tokens, (token){});
+    memmove(&(*tokens)[at + count], &(*tokens)[at + remove], tail * sizeof(token));
+    if (count != 0) memcpy(&(*tokens)[at], with, count * sizeof(token));
+    vec_len(*tokens) = len - remove + count;
 }
 
 /*  Each source character set member and escape sequence in character constants and string
@@ -318,59 +216,50 @@ int parser_phase5(parser_ctx* ctx) {
     return 0;
 }
 
-#define skip_token(offset) do { \
-    ctx->curr_tok_index += offset; \
-} while(0)
-
-#define next_token() ((ctx->curr_tok_index + 1 < vec_len(ctx->tokens)) ? ctx->tokens[ctx->curr_tok_index + 1] : (token){})
-
-#define next_token_from(offset) ((ctx->curr_tok_index + (offset) < vec_len(ctx->tokens)) ? ctx->tokens[ctx->curr_tok_index + (offset)] : (token){})
-
-#define curr_token() ((ctx->curr_tok_index < vec_len(ctx->tokens)) ? ctx->tokens[ctx->curr_tok_index] : (token){})
-
-#define skip_whitespace() do { \
-    if (curr_token().type == TOK_WHITESPACE) ctx->curr_tok_index++; \
-} while(0)
-
 // Adjacent string literal tokens are concatenated.
-int parser_phase6(parser_ctx* ctx) {
-    for_n(i, 0, vec_len(ctx->tokens)) {
-        token* tok = &ctx->tokens[i];
-        //augh.
-        ctx->curr_tok_index = i;
-        size_t old_index = i;
-        if (tok->type == PPTOK_STR_LIT) {
-            skip_token(1);
-            if (curr_token().type == TOK_WHITESPACE) skip_token(1);
-            if (curr_token().type != PPTOK_STR_LIT) continue;
-
-            
-            //we combine the two strlits
-            token left_str = *tok;
-            token right_str = curr_token();
-            //cut off extraneous " chars
-            left_str.tok.len -= 1;
-            right_str.tok.len -= 1;
-            right_str.tok.raw += 1;
-
-            string new_strlit = string_concat(left_str.tok, right_str.tok);
-            token new_str = {.type = PPTOK_STR_LIT,
-                             .itype = TOK_STR_LIT,
-                             .line = left_str.line,
-                             .was_included = false,
-                             .tok = new_strlit};
-            //remove left and right strings
-            vec_remove_ordered(&ctx->tokens, old_index);
-            if (ctx->tokens[old_index].type == TOK_WHITESPACE) vec_remove_ordered(&ctx->tokens, old_index);
-            vec_remove_ordered(&ctx->tokens, old_index);
-            
-            //insert new string
-            vec_insert(&ctx->tokens, old_index, new_str);
-            
-            //restore i
-            i = old_index - 1;
+size_t parser_concat_strings(parser_ctx* ctx, size_t at, token* out, bool* keep) {
+    //a run of string literals becomes one, built in one go however long the run is
+    Vec(token) tokens = ctx->tokens;
+    *out = tokens[at];
+    *keep = true;
+    if (tokens[at].type != PPTOK_STR_LIT) return 1;
+    size_t end = at + 1;
+    while (end < vec_len(tokens) && tokens[end].type == PPTOK_STR_LIT) end++;
+    if (end - at == 1) return 1;
+
+    //every " where two strings meet gets cut, so the first loses its last char and the rest lose their first
+    size_t len = 0;
+    for_n(i, at, end) len += token_text(tokens[i]).len - 1;
+    len += 1;
+    string joined = string_alloc(len);
+    size_t cursor = 0;
+    for_n(i, at, end) {
+        string text = token_text(tokens[i]);
+        if (i != at) {
+            text.raw++;
+            text.len--;
         }
+        if (i != end - 1) text.len--;
+        memcpy(joined.raw + cursor, text.raw, text.len);
+        cursor += text.len;
     }
+    joined.len = cursor;
+
+    token left_str = tokens[at];
+    *out = (token){.type = PPTOK_STR_LIT,
+                   .itype = TOK_STR_LIT,
+                   .line = left_str.line,
+                   .after_newline = left_str.after_newline,
+                   .preceded_by_space = left_str.preceded_by_space,
+                   .was_included = false,
+                   .loc = source_scratch(joined),
+                   .len = joined.len};
+    cfree(joined.raw);
+    return end - at;
+}
+
+int parser_phase6(parser_ctx* ctx) {
+    token_compact(ctx, parser_concat_strings);
     return 0;
 }
 
@@ -378,21 +267,16 @@ int parser_phase7(parser_ctx* ctx) {
     /* Token transformation: Convert tokens over to their syntactical versions */
     for_n(i, 0, vec_len(ctx->tokens)) {
         token* tok = &ctx->tokens[i];
-        if (tok->type == TOK_WHITESPACE) {
-            vec_remove_ordered(&ctx->tokens, i);
-            i--;
-            continue;
-        }
 
         if (tok->type == PPTOK_CHAR_CONST) tok->itype = TOK_CONSTANT;
-        if (tok->type == PPTOK_IDENTIFIER) tok->itype = TOK_IDENTIFIER;
         if (tok->type == PPTOK_NUMBER) tok->itype = TOK_CONSTANT;
+        //punctuators got their itype when they were lexed, so only identifiers are left to sort out.
+        //keywords were interned before anything else, and their atoms know which keyword they are.
+        if (tok->type == PPTOK_IDENTIFIER) {
+            token_type keyword = atom_keyword(tok->atom);
+            tok->itype = keyword != TOK_INVALID ? keyword : TOK_IDENTIFIER;
+        }
 
-        #define TOKEN(type, str) if (string_eq(tok->tok, strlit((str)))) tok->itype = (type);
-            PUNCT 
-            KEYWORDS
-        #undef TOKEN
-    
         /* Copy over the type to itype */
         if (tok->itype == TOK_INVALID)
             tok->itype = tok->type;
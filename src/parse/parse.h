@@ -52,6 +52,15 @@
     TOKEN(CTOK_HASH, "#") \
     TOKEN(CTOK_HASH_HASH, "##") \
 
+// alternate spellings. these arent tokens of their own, they lex straight to the itype they stand for
+#define DIGRAPHS \
+    TOKEN(CTOK_OPEN_SQUBRACE, "<:") \
+    TOKEN(CTOK_CLOSE_SQUBRACE, ":>") \
+    TOKEN(CTOK_OPEN_BRACE, "<%") \
+    TOKEN(CTOK_CLOSE_BRACE, "%>") \
+    TOKEN(CTOK_HASH, "%:") \
+    TOKEN(CTOK_HASH_HASH, "%:%:") \
+
 #define KEYWORDS \
     TOKEN(CTOK_ALIGNAS, "alignas") \
     TOKEN(CTOK_ALIGNOF, "alignof") \
@@ -110,7 +119,6 @@
 
 #define TOKENS \
     TOKEN(TOK_INVALID, "[INVALID]") \
-    TOKEN(TOK_WHITESPACE, "whitespace") \
     /* token: */ \
     TOKEN(TOK_IDENTIFIER, "identifier") \
     TOKEN(TOK_CONSTANT, "constant") \
@@ -122,6 +130,8 @@
     TOKEN(PPTOK_CHAR_CONST, "character-constant") \
     TOKEN(PPTOK_STR_LIT, "pp-string-literal") \
     TOKEN(PPTOK_PUNCT, "pp-punctuator") \
+    /* something that wouldnt lex. phase 4 only complains about it if it reads it, see lex_bad_token */ \
+    TOKEN(PPTOK_BAD, "[bad token]") \
     /* from here on, these are non-c tokens, but these make parsing easier. */ \
     /* these get transformed during step 3 of compilation, before its supposed to. */ \
     /* we still keep track of the c token type (token:), but we use itype for actual parsing */ \
@@ -139,17 +149,85 @@ typedef enum: u8 {
 #undef TOKEN
 } token_type;
 
+// tokens get copied by value everywhere, so they're kept to 16 bytes.
+// the text lives in whatever source the token came from, and you get it back with token_text.
 typedef struct {
     token_type type;
     token_type itype;
-    string tok;
-    bool after_newline;
+    bool after_newline : 1;
+    //there was whitespace (or a comment) between this and the token before it, on the same line
+    bool preceded_by_space : 1;
+    bool was_included : 1;
+    //this name turned up inside its own expansion, so it never gets expanded again (6.10.5.4)
+    bool no_expand : 1;
     u32 line;
-    bool was_included;
-    string included_from;
-    bool from_macro_param;
+    //where the text starts in the global location space. see source.c
+    u32 loc;
+    //identifiers dont need a length, their atom already knows it
+    union {
+        u32 len;
+        u32 atom;
+    };
 } token;
 
+_Static_assert(sizeof(token) == 16, "token has grown past 16 bytes");
+
+// atoms we need to know the id of up front. these get interned first, in this order,
+// so their ids are constants and can be switched on
+#define PREDEFINED_ATOMS \
+    ATOM(ATOM_VA_ARGS, "__VA_ARGS__") \
+    ATOM(ATOM_VA_OPT, "__VA_OPT__") \
+    ATOM(ATOM_LINE_MACRO, "__LINE__") \
+    ATOM(ATOM_FILE_MACRO, "__FILE__") \
+    ATOM(ATOM_DEFINED, "defined") \
+    ATOM(ATOM_HAS_INCLUDE, "__has_include") \
+    ATOM(ATOM_HAS_C_ATTRIBUTE, "__has_c_attribute") \
+    /* directive names */ \
+    ATOM(ATOM_IF, "if") \
+    ATOM(ATOM_IFDEF, "ifdef") \
+    ATOM(ATOM_IFNDEF, "ifndef") \
+    ATOM(ATOM_ELIF, "elif") \
+    ATOM(ATOM_ELIFDEF, "elifdef") \
+    ATOM(ATOM_ELIFNDEF, "elifndef") \
+    ATOM(ATOM_ELSE, "else") \
+    ATOM(ATOM_ENDIF, "endif") \
+    ATOM(ATOM_INCLUDE, "include") \
+    ATOM(ATOM_EMBED, "embed") \
+    ATOM(ATOM_DEFINE, "define") \
+    ATOM(ATOM_UNDEF, "undef") \
+    ATOM(ATOM_LINE, "line") \
+    ATOM(ATOM_WARNING, "warning") \
+    ATOM(ATOM_ERROR, "error") \
+    ATOM(ATOM_PRAGMA, "pragma") \
+    ATOM(ATOM_ONCE, "once") \
+
+enum {
+    ATOM_NONE,
+#define ATOM(name, str) name,
+    PREDEFINED_ATOMS
+#undef ATOM
+};
+
+//only identifiers have an atom. anything else has its length there, so check the type first
+#define token_is_atom(tok, _atom) ((tok).type == PPTOK_IDENTIFIER && (tok).atom == (_atom))
+#define token_same_ident(a, b) ((a).type == PPTOK_IDENTIFIER && (b).type == PPTOK_IDENTIFIER && (a).atom == (b).atom)
+
+// see slots.c
+typedef struct {
+    u32 hash;
+    //0 if the slot is empty
+    u32 id;
+} slot;
+
+typedef struct {
+    slot* slots;
+    size_t count;
+    size_t used;
+} slot_table;
+
+//is id the entry key is asking for
+typedef bool (*slot_match)(void* key, u32 id);
+
 typedef struct {
     bool is_function;
     bool is_variadic;
@@ -158,35 +236,279 @@ typedef struct {
     token name;
 } macro_define;
 
+typedef struct {
+    u32 atom;
+    //NULL once the name has been #undef'd. it keeps its entry, in case it gets defined again
+    macro_define* def;
+} macro_entry;
+
+// an object-like macro, expanded all the way down ahead of time. see pp_memo
+typedef struct {
+    //we've looked at this macro since it (or anything it reads) last changed. if expansion is still NULL, it cant
+    //be memoized, and gets expanded the usual way
+    bool known;
+    //whether the invocation's newline makes it onto the first token, or gets lost to an empty expansion on the way
+    bool first_after_newline;
+    //the expansion ended in a macro that expanded to nothing, with whitespace before it
+    bool trailing_space;
+    Vec(token) expansion;
+} macro_memo;
+
+typedef struct {
+    //every name thats been defined, in the order it first was. slots holds indices into it plus one
+    Vec(macro_entry) entries;
+    slot_table slots;
+    //the pool macro_defines live in. chunks never move, so pointers into them stay good
+    Vec(macro_define*) chunks;
+    size_t chunk_used;
+    //indexed by atom
+    Vec(macro_memo) memos;
+    //indexed by atom, the macros whose memo read that name, and have to be thrown away if it gets (un)defined
+    Vec(Vec(u32)) memo_users;
+} macro_table;
+
+typedef struct {
+    string path;
+    //the whole file. this is a private, read-only mapping where we can get one, so treat it as const
+    string buf;
+    bool is_mapped;
+    //scratch chunks hold text that was made up, and dont have lines worth printing
+    bool is_scratch;
+    //location of buf[0]
+    u32 base;
+    //offset of the start of each physical line. NULL until a diagnostic asks for a line
+    Vec(u32) line_starts;
+    //the physical line each logical line starts on. NULL until -E asks for one
+    Vec(u32) logical_starts;
+} source_file;
+
+typedef struct _prefetch_job prefetch_job;
+
+// a header, lexed once and kept for every #include of it. see header.c
+typedef struct {
+    u64 dev;
+    u64 ino;
+    i64 mtime;
+    u64 size;
+    string path;
+    //NULL until the header has been opened. see header_fill
+    source_file* src;
+    //set while the header is waiting for, or being lexed on, a prefetch thread. see prefetch.c
+    prefetch_job* job;
+    //set once a prefetch thread has failed to lex it, after which its only ever lexed by header_fill
+    bool prefetch_failed;
+    //the header as it came out of phase 3
+    Vec(token) tokens;
+    //where each directive starts. see pp_find_directives
+    Vec(u32) directives;
+    //set by #pragma once, after which including it again does nothing
+    bool once;
+    //the macro an #ifndef around the whole header checks, or 0 if it isnt guarded like that.
+    //while the guard is defined, including the header again does nothing
+    u32 guard;
+    //how long phase 3 took over it, for -header-report
+    u64 lex_ns;
+} header_file;
+
+// phase 4's output is read from more than one file, and a token from a macro only knows where the macro was
+// defined, so phase 4 notes which file it was reading each time that changes. see pp_note_origin
+typedef struct {
+    //the first token of the run, in phase 4's output. phase 6 moves tokens around, so these are only good until then
+    u32 index;
+    //NULL for tokens that came from a pch
+    source_file* src;
+    //for tokens from a pch, the header they were in. their lines are already physical lines in it
+    string path;
+} pp_origin;
+
 typedef struct _parser_ctx {
+    source_file* src;
     Vec(token) tokens;
     size_t curr_tok_index;
+    //lexer state. curr_offset is into src->buf, and always sits past any splices
     size_t curr_offset;
+    //logical line, counting from 0. only tokens use this, diagnostics go through the line table
     size_t curr_line;
-    Vec(string) logical_lines;
+    size_t tok_end;
+    bool lex_spliced;
+    bool lex_after_newline;
+    bool lex_space;
+    //set while lexing a whole file. anything that wont lex turns into a PPTOK_BAD, instead of stopping us there
+    bool lex_tolerant;
+    //if set, the next token lexed goes here instead of into tokens. see lex_one_token
+    token* lex_single;
+    //set when we're lexing on a prefetch thread, where nothing shared can be touched. identifiers keep their length
+    //and get a hash in lex_hashes instead of an atom, and anything stitched goes in lex_scratch, with its index in
+    //lex_stitched. lex_adopt turns all that into a normal token stream once we're back on the main thread
+    bool lex_deferred;
+    //a deferred lex cant print its errors, so it just says there was one, and the main thread lexes it again to
+    //print them
+    bool lex_errored;
+    Vec(u32) lex_hashes;
+    Vec(char) lex_scratch;
+    Vec(u32) lex_stitched;
     cobalt_ctx* ctx;
-    Vec(string) pragma_files;
-    Vec(macro_define) defines;
-    token curr_macro_name;
+    macro_table* defines;
+    //tokens from a pch, which phase 4 puts ahead of everything it reads. NULL if there wasnt one
+    Vec(token) prelude;
+    //and which header each run of them came from
+    Vec(pp_origin) prelude_origins;
+    //which file each run of tokens phase 4 made came from. see pp_origin
+    Vec(pp_origin) origins;
 } parser_ctx;
 
+// phase 4 reads tokens through a stack of these. see preproc.c
+typedef struct {
+    Vec(token) tokens;
+    size_t pos;
+    //the macros that cant expand while we're reading this frame. see hideset.c
+    u32 hideset;
+    //a file, rather than a macros expansion. only files get to have directives, and their tokens arent ours to free
+    bool is_file;
+    //the header this frame is reading, or NULL for the file we were asked to compile
+    header_file* header;
+    //for files, where each directive starts, so skipped groups can jump straight from one to the next
+    Vec(u32) directives;
+    //for files, how many conditionals were open when we started reading it. it has to leave it the same
+    size_t cond_base;
+    //for files, which file frame this was, counting from 1. a header read twice in a row is two different visits
+    u32 visit;
+} pp_frame;
+
+// one #if (or #ifdef, or #ifndef) we're inside of, up to its #endif
+typedef struct {
+    //the directive that opened it, for errors
+    token opener;
+    //one of its groups has been read already, so every group after it gets skipped
+    bool taken;
+    bool seen_else;
+} pp_cond;
+
+typedef struct {
+    parser_ctx* ctx;
+    Vec(pp_frame) frames;
+    Vec(token) out;
+    //a macro that expanded to nothing had whitespace before it, which the next token out gets
+    bool pending_space;
+    //the name of the outermost macro being expanded, which is where __LINE__ and __FILE__ point
+    token invocation;
+    //only the file itself gets to have directives
+    bool run_directives;
+    Vec(pp_cond) conds;
+    //something went wrong somewhere we couldnt hand back an error from. see pp_pop_frame
+    bool errored;
+    //only the expander phase 4 runs keeps these, the ones for arguments and #if dont go anywhere
+    Vec(pp_origin) origins;
+    //how many file frames there have been, and which of them the last origin was for
+    u32 visits;
+    u32 origin_visit;
+} pp_expander;
+
+//looks at tokens[at] onwards and gives back how many it used up (at least 1). if it sets keep, out takes their place,
+//otherwise they're dropped. see token_compact
+typedef size_t (*token_rewrite)(parser_ctx* ctx, size_t at, token* out, bool* keep);
+
 extern char* token_str[];
 extern char* token_enum_str[];
 
-int parse_file(cobalt_ctx* ctx, bool is_include);
+int parse_file(cobalt_ctx* ctx);
+
+source_file* source_open(string path);
+source_file* source_for_loc(u32 loc);
+source_file* token_source(token tok);
+u32 source_line_of(source_file* src, u32 offset);
+u32 source_physical_line(source_file* src, u32 logical);
+u32 source_column_of(source_file* src, u32 offset);
+string source_line_text(source_file* src, u32 line);
+u32 source_scratch(string text);
+string token_text(token tok);
+string token_source_text(token tok);
+
+slot* slot_find(slot_table* table, u32 hash, slot_match match, void* key);
+void slot_add(slot_table* table, slot* at, u32 hash, u32 id);
+
+u32 atom_intern(string str);
+u32 atom_intern_hashed(string str, u32 hash);
+u32 atom_hash(string str);
+string atom_str(u32 atom);
+token_type atom_keyword(u32 atom);
+
+macro_table* macro_table_new();
+macro_define* macro_lookup(macro_table* table, u32 atom);
+macro_define* macro_add(macro_table* table, macro_define def);
+bool macro_remove(macro_table* table, u32 atom);
+bool macro_same_definition(macro_define* a, macro_define* b);
+macro_memo* macro_memo_of(macro_table* table, u32 atom);
+void macro_memo_depends(macro_table* table, u32 user, u32 atom);
+void macro_forget(macro_table* table, u32 atom);
+
+extern Vec(header_file*) header_files;
+
+header_file* header_lookup(parser_ctx* ctx, string path);
+int header_fill(parser_ctx* ctx, header_file* header);
+void header_finish(parser_ctx* ctx, header_file* header, Vec(token) tokens);
+void header_register(header_file* header);
+header_file* include_resolve(parser_ctx* ctx, string name, bool is_system, string from_dir);
+string include_dir_of(string path);
+u32 header_find_guard(Vec(token) tokens);
+
+void prefetch_header(parser_ctx* ctx, header_file* header);
+void prefetch_includes(parser_ctx* ctx, Vec(token) tokens, Vec(u32) directives, string from_dir);
+void prefetch_harvest(parser_ctx* ctx);
+void prefetch_wait(parser_ctx* ctx, header_file* header);
+
+extern bool report_enabled;
+
+u64 report_now();
+void report_start(cobalt_ctx* ctx);
+int report_phase(parser_ctx* ctx, char* name, int (*phase)(parser_ctx*));
+void report_lexed(header_file* header, u64 start, u64 end, u32 thread);
+void report_open(header_file* header);
+void report_close();
+void report_count_macro();
+void report_count_expansion();
+int report_write(string path);
+
+int pch_write(parser_ctx* ctx, string path);
+int pch_load(parser_ctx* ctx, string path);
+
+u32 hideset_add(u32 set, u32 atom);
+bool hideset_contains(u32 set, u32 atom);
 
-void parser_phase1(cobalt_ctx* ctx);
-int parser_phase2(parser_ctx* ctx, Vec(string) physical_lines);
 int parser_phase3(parser_ctx* ctx);
+void lex_init();
+void lex_adopt(parser_ctx* ctx);
+size_t lex_one_token(cobalt_ctx* cctx, string text, u32 base, token* out);
+int lex_explain(parser_ctx* ctx, token bad);
 int parser_phase4(parser_ctx* ctx);
 int parser_phase5(parser_ctx* ctx);
 int parser_phase6(parser_ctx* ctx);
 int parser_phase7(parser_ctx* ctx);
 
 void print_token_stream(parser_ctx* ctx);
+int pp_write_output(parser_ctx* ctx, string path);
+void token_splice(Vec(token)* tokens, size_t at, size_t remove, token* with, size_t count);
+void token_compact(parser_ctx* ctx, token_rewrite rewrite);
+
+int pp_expand(pp_expander* exp);
+Vec(token) pp_expand_list(pp_expander* exp, Vec(token) tokens);
+bool pp_is_conditional(token name);
+int pp_directive(pp_expander* exp);
+int pp_run_directive(pp_expander* exp);
+Vec(u32) pp_find_directives(Vec(token) tokens);
+bool pp_is_defined(parser_ctx* ctx, u32 atom);
+void pp_skip_group(pp_expander* exp);
+int pp_eval_condition(pp_expander* exp, bool* result);
+int pp_header_name(parser_ctx* ctx, Vec(token) line, size_t* pos, string* name, bool* is_system);
+string pp_includer_dir(pp_expander* exp);
 
-int handle_include(parser_ctx* ctx, size_t hash_location);
+int handle_include(parser_ctx* ctx, pp_expander* exp);
 int handle_define(parser_ctx* ctx);
+int handle_if(parser_ctx* ctx, pp_expander* exp);
+int handle_ifdef(parser_ctx* ctx, pp_expander* exp, bool negate);
+int handle_else(parser_ctx* ctx, pp_expander* exp, u32 directive);
+int handle_endif(parser_ctx* ctx, pp_expander* exp);
+int pp_add_define(parser_ctx* ctx, macro_define new_def);
 
 #define pp_stream(tok) print_token_stream(&(parser_ctx){.tokens = (tok)})
 
@@ -0,0 +1,393 @@
+#include <stdio.h>
+
+#include "alloc.h"
+#include "cobalt.h"
+#include "crash.h"
+#include "parse.h"
+
+#include "common/str.h"
+#include "common/util.h"
+#include "common/vec.h"
+
+// precompiled headers. -emit-pch runs a header through phase 4 and writes out everything a translation unit would
+// have after including it: the tokens it turned into, every macro it left defined, and every header it pulled in
+// (with its guard and #pragma once, so including those again is still free). -include-pch maps that file back in
+// and starts phase 4 from there, without lexing a thing.
+//
+// nothing in the file is a pointer or a location, so it doesnt care where its mapped. tokens refer to their text by
+// offset, and the file itself gets registered as a source, so a loaded token's location is just the file's base
+// plus that offset. identifiers are written once each, and get interned once each on load.
+//
+// the header's own tokens remember which file they came from (see pch_origin), so -E output after an -include-pch
+// still points at the headers, not the pch.
+//
+// the layout is a pch_file_header, then the atoms, tokens, macros, headers and origins arrays, then the text they all
+// point into. every section starts 8 byte aligned, so the arrays can be read straight out of the mapping.
+
+#define PCH_MAGIC "COBALTPC"
+//bump this whenever anything below changes shape
+#define PCH_VERSION 3
+
+typedef struct {
+    char magic[8];
+    u32 version;
+    //these catch a file from a build with a different token layout
+    u32 token_size;
+    u32 atom_count;
+    u32 atom_offset;
+    //the first stream_count tokens are the header itself, the rest belong to macros
+    u32 token_count;
+    u32 stream_count;
+    u32 token_offset;
+    u32 macro_count;
+    u32 macro_offset;
+    u32 header_count;
+    u32 header_offset;
+    u32 origin_count;
+    u32 origin_offset;
+    u32 text_offset;
+    u32 text_len;
+} pch_file_header;
+
+typedef struct {
+    //relative to the start of the file
+    u32 offset;
+    u32 len;
+} pch_atom;
+
+typedef struct {
+    u8 type;
+    u8 itype;
+    u8 flags;
+    u8 pad;
+    //for the header's own tokens this is the physical line, since thats all anyone wants it for after loading.
+    //tokens in macros keep their logical line
+    u32 line;
+    //for identifiers this is an index into the atoms, for everything else its where the text is
+    u32 text;
+    u32 len;
+} pch_token;
+
+#define PCH_AFTER_NEWLINE 1
+#define PCH_PRECEDED_BY_SPACE 2
+#define PCH_WAS_INCLUDED 4
+#define PCH_NO_EXPAND 8
+
+typedef struct {
+    //indices into the tokens
+    u32 name;
+    u32 first_argument;
+    u32 argument_count;
+    u32 first_replacement;
+    u32 replacement_count;
+    u8 is_function;
+    u8 is_variadic;
+    u8 pad[2];
+} pch_macro;
+
+typedef struct {
+    u64 dev;
+    u64 ino;
+    i64 mtime;
+    u64 size;
+    pch_atom path;
+    //index into the atoms plus one, or 0 if theres no guard
+    u32 guard;
+    u8 once;
+    u8 pad[3];
+} pch_header;
+
+typedef struct {
+    //the first of the header's own tokens that came from path. it runs up to the next one
+    u32 index;
+    pch_atom path;
+} pch_origin;
+
+// writing
+
+typedef struct {
+    Vec(pch_atom) atoms;
+    Vec(pch_token) tokens;
+    Vec(pch_macro) macros;
+    Vec(pch_header) headers;
+    Vec(pch_origin) origins;
+    //text, relative to the start of the text section until we know where that is
+    Vec(char) text;
+    //for each atom, its index in atoms plus one, or 0 if we havent written it yet
+    Vec(u32) atom_index;
+} pch_writer;
+
+pch_atom pch_add_text(pch_writer* w, string text) {
+    pch_atom span = {.offset = vec_len(w->text), .len = text.len};
+    for_n(i, 0, text.len) vec_append(&w->text, text.raw[i]);
+    return span;
+}
+
+u32 pch_add_atom(pch_writer* w, u32 atom) {
+    while (vec_len(w->atom_index) <= atom) vec_append(&w->atom_index, 0);
+    if (w->atom_index[atom] == 0) {
+        vec_append(&w->atoms, pch_add_text(w, atom_str(atom)));
+        w->atom_index[atom] = vec_len(w->atoms);
+    }
+    return w->atom_index[atom] - 1;
+}
+
+void pch_add_token(pch_writer* w, token tok) {
+    pch_token out = {.type = tok.type,
+                     .itype = tok.itype,
+                     .flags = (tok.after_newline ? PCH_AFTER_NEWLINE : 0) | (tok.preceded_by_space ? PCH_PRECEDED_BY_SPACE : 0)
+                            | (tok.was_included ? PCH_WAS_INCLUDED : 0) | (tok.no_expand ? PCH_NO_EXPAND : 0),
+                     .pad = 0,
+                     .line = tok.line};
+    if (tok.type == PPTOK_IDENTIFIER) {
+        out.text = pch_add_atom(w, tok.atom);
+        out.len = 0;
+    } else {
+        pch_atom span = pch_add_text(w, token_text(tok));
+        out.text = span.offset;
+        out.len = span.len;
+    }
+    vec_append(&w->tokens, out);
+}
+
+u32 pch_align(u32 offset) {
+    return (offset + 7) & ~7u;
+}
+
+int pch_write(parser_ctx* ctx, string path) {
+    //writes out the state phase 4 left ctx in. gives back -1 if the file couldnt be written
+    pch_writer w = {.atoms = vec_new(pch_atom, 256),
+                    .tokens = vec_new(pch_token, vec_len(ctx->tokens) + 1),
+                    .macros = vec_new(pch_macro, 256),
+                    .headers = vec_new(pch_header, 16),
+                    .origins = vec_new(pch_origin, 16),
+                    .text = vec_new(char, 4096),
+                    .atom_index = vec_new(u32, 256)};
+
+    for_vec(token* tok, &ctx->tokens) pch_add_token(&w, *tok);
+    u32 stream_count = vec_len(w.tokens);
+    //phase 4 said which file each run of tokens came from. tokens from another pch have their physical line already
+    for_n(i, 0, vec_len(ctx->origins)) {
+        pp_origin origin = ctx->origins[i];
+        size_t end = i + 1 < vec_len(ctx->origins) ? ctx->origins[i + 1].index : stream_count;
+        string origin_path = origin.src != NULL ? origin.src->path : origin.path;
+        vec_append(&w.origins, ((pch_origin){.index = origin.index, .path = pch_add_text(&w, origin_path)}));
+        if (origin.src == NULL) continue;
+        for_n(j, origin.index, end) w.tokens[j].line = source_physical_line(origin.src, ctx->tokens[j].line);
+    }
+
+    macro_table* table = ctx->defines;
+    for_vec(macro_entry* entry, &table->entries) {
+        macro_define* def = entry->def;
+        if (def == NULL) continue;
+        pch_macro macro = {.name = vec_len(w.tokens),
+                           .is_function = def->is_function,
+                           .is_variadic = def->is_variadic};
+        pch_add_token(&w, def->name);
+        macro.first_argument = vec_len(w.tokens);
+        macro.argument_count = vec_len(def->arguments);
+        for_vec(token* tok, &def->arguments) pch_add_token(&w, *tok);
+        macro.first_replacement = vec_len(w.tokens);
+        macro.replacement_count = vec_len(def->replacement_list);
+        for_vec(token* tok, &def->replacement_list) pch_add_token(&w, *tok);
+        vec_append(&w.macros, macro);
+    }
+
+    if (header_files != NULL) {
+        for_vec(header_file** header, &header_files) {
+            vec_append(&w.headers, ((pch_header){.dev = (*header)->dev,
+                                                  .ino = (*header)->ino,
+                                                  .mtime = (*header)->mtime,
+                                                  .size = (*header)->size,
+                                                  .path = pch_add_text(&w, (*header)->path),
+                                                  .guard = (*header)->guard != 0 ? pch_add_atom(&w, (*header)->guard) + 1 : 0,
+                                                  .once = (*header)->once}));
+        }
+    }
+
+    pch_file_header file = {.version = PCH_VERSION,
+                            .token_size = sizeof(pch_token),
+                            .atom_count = vec_len(w.atoms),
+                            .token_count = vec_len(w.tokens),
+                            .stream_count = stream_count,
+                            .macro_count = vec_len(w.macros),
+                            .header_count = vec_len(w.headers),
+                            .origin_count = vec_len(w.origins),
+                            .text_len = vec_len(w.text)};
+    memcpy(file.magic, PCH_MAGIC, sizeof(file.magic));
+    file.atom_offset = pch_align(sizeof(file));
+    file.token_offset = pch_align(file.atom_offset + file.atom_count * sizeof(pch_atom));
+    file.macro_offset = pch_align(file.token_offset + file.token_count * sizeof(pch_token));
+    file.header_offset = pch_align(file.macro_offset + file.macro_count * sizeof(pch_macro));
+    file.origin_offset = pch_align(file.header_offset + file.header_count * sizeof(pch_header));
+    file.text_offset = pch_align(file.origin_offset + file.origin_count * sizeof(pch_origin));
+
+    //now we know where the text goes, everything that points into it can be made relative to the file
+    for_vec(pch_atom* atom, &w.atoms) atom->offset += file.text_offset;
+    for_vec(pch_header* header, &w.headers) header->path.offset += file.text_offset;
+    for_vec(pch_origin* origin, &w.origins) origin->path.offset += file.text_offset;
+    for_vec(pch_token* tok, &w.tokens) {
+        if (tok->type != PPTOK_IDENTIFIER) tok->text += file.text_offset;
+    }
+
+    FILE* out = fopen(clone_to_cstring(path), "wb");
+    if (out == NULL) {
+        printf("unable to open "str_fmt" for writing\n", str_arg(path));
+        return -1;
+    }
+    char zeroes[8] = {0};
+    bool ok = fwrite(&file, sizeof(file), 1, out) == 1;
+    ok &= fwrite(zeroes, 1, file.atom_offset - sizeof(file), out) == file.atom_offset - sizeof(file);
+    ok &= fwrite(w.atoms, sizeof(pch_atom), file.atom_count, out) == file.atom_count;
+    ok &= fwrite(zeroes, 1, file.token_offset - (file.atom_offset + file.atom_count * sizeof(pch_atom)), out)
+          == file.token_offset - (file.atom_offset + file.atom_count * sizeof(pch_atom));
+    ok &= fwrite(w.tokens, sizeof(pch_token), file.token_count, out) == file.token_count;
+    ok &= fwrite(zeroes, 1, file.macro_offset - (file.token_offset + file.token_count * sizeof(pch_token)), out)
+          == file.macro_offset - (file.token_offset + file.token_count * sizeof(pch_token));
+    ok &= fwrite(w.macros, sizeof(pch_macro), file.macro_count, out) == file.macro_count;
+    ok &= fwrite(zeroes, 1, file.header_offset - (file.macro_offset + file.macro_count * sizeof(pch_macro)), out)
+          == file.header_offset - (file.macro_offset + file.macro_count * sizeof(pch_macro));
+    ok &= fwrite(w.headers, sizeof(pch_header), file.header_count, out) == file.header_count;
+    ok &= fwrite(zeroes, 1, file.origin_offset - (file.header_offset + file.header_count * sizeof(pch_header)), out)
+          == file.origin_offset - (file.header_offset + file.header_count * sizeof(pch_header));
+    ok &= fwrite(w.origins, sizeof(pch_origin), file.origin_count, out) == file.origin_count;
+    ok &= fwrite(zeroes, 1, file.text_offset - (file.origin_offset + file.origin_count * sizeof(pch_origin)), out)
+          == file.text_offset - (file.origin_offset + file.origin_count * sizeof(pch_origin));
+    ok &= fwrite(w.text, 1, file.text_len, out) == file.text_len;
+    ok &= fclose(out) == 0;
+    if (!ok) printf("unable to write "str_fmt"\n", str_arg(path));
+
+    vec_destroy(&w.atoms);
+    vec_destroy(&w.tokens);
+    vec_destroy(&w.macros);
+    vec_destroy(&w.headers);
+    vec_destroy(&w.origins);
+    vec_destroy(&w.text);
+    vec_destroy(&w.atom_index);
+    return ok ? 0 : -1;
+}
+
+// loading
+
+bool pch_in_bounds(source_file* src, u32 offset, u64 count, u64 size) {
+    return (u64)offset + count * size <= src->buf.len && offset % 8 == 0;
+}
+
+token pch_read_token(source_file* src, pch_token in, Vec(u32) atoms, pch_atom* atom_spans) {
+    token tok = {.type = in.type,
+                 .itype = in.itype,
+                 .after_newline = (in.flags & PCH_AFTER_NEWLINE) != 0,
+                 .preceded_by_space = (in.flags & PCH_PRECEDED_BY_SPACE) != 0,
+                 .was_included = (in.flags & PCH_WAS_INCLUDED) != 0,
+                 .no_expand = (in.flags & PCH_NO_EXPAND) != 0,
+                 .line = in.line};
+    if (in.type == PPTOK_IDENTIFIER) {
+        //an identifier points at its name, which is as good a place as any
+        tok.atom = atoms[in.text];
+        tok.loc = src->base + atom_spans[in.text].offset;
+    } else {
+        tok.loc = src->base + in.text;
+        tok.len = in.len;
+    }
+    return tok;
+}
+
+int pch_load(parser_ctx* ctx, string path) {
+    //puts ctx in the state the pch at path was written from. its tokens go in ctx->prelude, ready for phase 4
+    source_file* src = source_open(path);
+    if (src == NULL) {
+        printf("unable to open pch "str_fmt"\n", str_arg(path));
+        return -1;
+    }
+    //theres nothing in here worth showing in a diagnostic
+    src->is_scratch = true;
+
+    pch_file_header file;
+    if (src->buf.len < sizeof(file)) goto corrupt;
+    memcpy(&file, src->buf.raw, sizeof(file));
+    if (memcmp(file.magic, PCH_MAGIC, sizeof(file.magic)) != 0 || file.version != PCH_VERSION || file.token_size != sizeof(pch_token)) {
+        printf(str_fmt" isnt a pch from this version of cobalt\n", str_arg(path));
+        return -1;
+    }
+    if (!pch_in_bounds(src, file.atom_offset, file.atom_count, sizeof(pch_atom))
+        || !pch_in_bounds(src, file.token_offset, file.token_count, sizeof(pch_token))
+        || !pch_in_bounds(src, file.macro_offset, file.macro_count, sizeof(pch_macro))
+        || !pch_in_bounds(src, file.header_offset, file.header_count, sizeof(pch_header))
+        || !pch_in_bounds(src, file.origin_offset, file.origin_count, sizeof(pch_origin))
+        || !pch_in_bounds(src, file.text_offset, file.text_len, 1)
+        || file.stream_count > file.token_count) goto corrupt;
+
+    pch_atom* atom_spans = (pch_atom*)(src->buf.raw + file.atom_offset);
+    pch_token* tokens = (pch_token*)(src->buf.raw + file.token_offset);
+    pch_macro* macros = (pch_macro*)(src->buf.raw + file.macro_offset);
+    pch_header* headers = (pch_header*)(src->buf.raw + file.header_offset);
+    pch_origin* origins = (pch_origin*)(src->buf.raw + file.origin_offset);
+
+    //every name gets interned once, as a view straight into the mapping
+    Vec(u32) atoms = vec_new(u32, file.atom_count + 1);
+    for_n(i, 0, file.atom_count) {
+        if ((u64)atom_spans[i].offset + atom_spans[i].len > src->buf.len) goto corrupt;
+        vec_append(&atoms, atom_intern(string_make(src->buf.raw + atom_spans[i].offset, atom_spans[i].len)));
+    }
+    for_n(i, 0, file.token_count) {
+        pch_token in = tokens[i];
+        if (in.type == PPTOK_IDENTIFIER ? in.text >= file.atom_count : (u64)in.text + in.len > src->buf.len) goto corrupt;
+    }
+
+    ctx->prelude = vec_new(token, file.stream_count + 1);
+    for_n(i, 0, file.stream_count) vec_append(&ctx->prelude, pch_read_token(src, tokens[i], atoms, atom_spans));
+    ctx->prelude_origins = vec_new(pp_origin, file.origin_count + 1);
+    for_n(i, 0, file.origin_count) {
+        pch_origin in = origins[i];
+        if ((u64)in.path.offset + in.path.len > src->buf.len || in.index > file.stream_count
+            || (i != 0 && in.index < origins[i - 1].index)) goto corrupt;
+        vec_append(&ctx->prelude_origins, ((pp_origin){.index = in.index,
+                                                       .src = NULL,
+                                                       .path = string_make(src->buf.raw + in.path.offset, in.path.len)}));
+    }
+
+    for_n(i, 0, file.macro_count) {
+        pch_macro in = macros[i];
+        if ((u64)in.first_argument + in.argument_count > file.token_count
+            || (u64)in.first_replacement + in.replacement_count > file.token_count
+            || in.name >= file.token_count || tokens[in.name].type != PPTOK_IDENTIFIER) goto corrupt;
+        macro_define def = {.is_function = in.is_function,
+                            .is_variadic = in.is_variadic,
+                            .arguments = vec_new(token, in.argument_count + 1),
+                            .replacement_list = vec_new(token, in.replacement_count + 1),
+                            .name = pch_read_token(src, tokens[in.name], atoms, atom_spans)};
+        for_n(j, 0, in.argument_count) {
+            vec_append(&def.arguments, pch_read_token(src, tokens[in.first_argument + j], atoms, atom_spans));
+        }
+        for_n(j, 0, in.replacement_count) {
+            vec_append(&def.replacement_list, pch_read_token(src, tokens[in.first_replacement + j], atoms, atom_spans));
+        }
+        macro_add(ctx->defines, def);
+    }
+
+    //the headers dont get lexed unless they're included again with their guard undefined
+    for_n(i, 0, file.header_count) {
+        pch_header in = headers[i];
+        if ((u64)in.path.offset + in.path.len > src->buf.len || in.guard > file.atom_count) goto corrupt;
+        header_file* header = cmalloc(sizeof(*header));
+        *header = (header_file){.dev = in.dev,
+                                .ino = in.ino,
+                                .mtime = in.mtime,
+                                .size = in.size,
+                                .path = string_make(src->buf.raw + in.path.offset, in.path.len),
+                                .src = NULL,
+                                .job = NULL,
+                                .prefetch_failed = false,
+                                .tokens = NULL,
+                                .directives = NULL,
+                                .once = in.once,
+                                .guard = in.guard != 0 ? atoms[in.guard - 1] : 0};
+        header_register(header);
+    }
+    vec_destroy(&atoms);
+    return 0;
+
+corrupt:
+    printf("pch "str_fmt" is corrupt\n", str_arg(path));
+    return -1;
+}
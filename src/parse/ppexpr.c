@@ -0,0 +1,518 @@
+#include "alloc.h"
+#include "cobalt.h"
+#include "crash.h"
+#include "parse.h"
+
+#include "common/str.h"
+#include "common/util.h"
+#include "common/vec.h"
+
+// the #if and #elif evaluator. by the time we get here the line has been macro expanded, so whats left is numbers,
+// character constants, punctuators, and identifiers that werent macros (which are all 0, bar true).
+// its a pratt parser straight over the tokens, that works out the value as it goes. values are intmax_t or
+// uintmax_t, which are both 64 bits for us, and the usual arithmetic conversions pick between them.
+// evaluating doesnt allocate anything. the operands of defined, __has_include and __has_c_attribute are
+// painted before the line is expanded, so a macro cant change what they ask about.
+
+typedef struct {
+    bool is_unsigned;
+    //signed values are kept as their two's complement
+    u64 value;
+} pp_value;
+
+typedef struct {
+    pp_expander* exp;
+    Vec(token) tokens;
+    size_t pos;
+    //the token before the expression, for errors at the end of the line
+    token directive;
+    //false on the side of a &&, || or ?: that doesnt count, where dividing by zero is fine
+    bool evaluate;
+    bool failed;
+} pp_eval;
+
+enum {
+    PP_PREC_NONE,
+    PP_PREC_COMMA,
+    PP_PREC_TERNARY,
+    PP_PREC_OR_OR,
+    PP_PREC_AND_AND,
+    PP_PREC_OR,
+    PP_PREC_CARET,
+    PP_PREC_AMPERSAND,
+    PP_PREC_EQUALITY,
+    PP_PREC_RELATIONAL,
+    PP_PREC_SHIFT,
+    PP_PREC_ADDITIVE,
+    PP_PREC_MULTIPLICATIVE,
+};
+
+pp_value pp_eval_expr(pp_eval* ev, int min_prec);
+
+token* pp_eval_peek(pp_eval* ev) {
+    return ev->pos < vec_len(ev->tokens) ? &ev->tokens[ev->pos] : NULL;
+}
+
+void pp_eval_error(pp_eval* ev, token* at, char* message) {
+    //only the first error is worth showing, anything after it is probably fallout
+    if (!ev->failed) print_parsing_error(ev->exp->ctx, at != NULL ? *at : ev->directive, message);
+    ev->failed = true;
+}
+
+bool pp_eval_expect(pp_eval* ev, token_type itype, char* message) {
+    token* tok = pp_eval_peek(ev);
+    if (tok == NULL || tok->itype != itype) {
+        pp_eval_error(ev, tok, message);
+        return false;
+    }
+    ev->pos++;
+    return true;
+}
+
+pp_value pp_eval_signed(i64 value) {
+    return (pp_value){.is_unsigned = false, .value = (u64)value};
+}
+
+int pp_eval_digit(char c) {
+    //the value of c as a digit in any base up to 16, or 16 if it isnt one
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return 16;
+}
+
+pp_value pp_eval_number(pp_eval* ev, token* tok) {
+    //an integer constant, as in 6.4.4.1. floating constants arent allowed in #if
+    string text = token_text(*tok);
+    size_t i = 0;
+    u64 base = 10;
+    if (text.len > 1 && text.raw[0] == '0' && (text.raw[1] == 'x' || text.raw[1] == 'X')) {
+        base = 16;
+        i = 2;
+    } else if (text.len > 1 && text.raw[0] == '0' && (text.raw[1] == 'b' || text.raw[1] == 'B')) {
+        base = 2;
+        i = 2;
+    } else if (text.raw[0] == '0') {
+        base = 8;
+    }
+
+    u64 value = 0;
+    bool overflow = false;
+    size_t digits_start = i;
+    for (; i < text.len; i++) {
+        //' is a digit separator, and means nothing
+        if (text.raw[i] == '\'') continue;
+        u64 digit = pp_eval_digit(text.raw[i]);
+        if (digit >= base) break;
+        if (value > (UINT64_MAX - digit) / base) overflow = true;
+        value = value * base + digit;
+    }
+    if (i == digits_start && base != 8) {
+        pp_eval_error(ev, tok, "invalid integer constant in preprocessor expression");
+        return pp_eval_signed(0);
+    }
+
+    //whatever is left has to be a suffix. u, l, ll, wb, in any order, and any case
+    bool is_unsigned = false;
+    bool seen_size = false;
+    while (i < text.len) {
+        char c = text.raw[i];
+        if ((c == 'u' || c == 'U') && !is_unsigned) {
+            is_unsigned = true;
+            i++;
+        } else if ((c == 'l' || c == 'L') && !seen_size) {
+            seen_size = true;
+            i++;
+            if (i < text.len && text.raw[i] == c) i++;
+        } else if ((c == 'w' || c == 'W') && !seen_size && i + 1 < text.len && text.raw[i + 1] == (c == 'w' ? 'b' : 'B')) {
+            seen_size = true;
+            i += 2;
+        } else {
+            break;
+        }
+    }
+    if (i != text.len) {
+        char c = text.raw[i];
+        if (c == '.' || ((c == 'e' || c == 'E') && base != 16) || c == 'p' || c == 'P') {
+            pp_eval_error(ev, tok, "floating constant in preprocessor expression");
+        } else {
+            pp_eval_error(ev, tok, "invalid suffix on integer constant");
+        }
+        return pp_eval_signed(0);
+    }
+    if (overflow) {
+        pp_eval_error(ev, tok, "integer constant is too large for its type");
+        return pp_eval_signed(0);
+    }
+    //a constant too big for intmax_t only fits in uintmax_t
+    if (value > INT64_MAX) is_unsigned = true;
+    return (pp_value){.is_unsigned = is_unsigned, .value = value};
+}
+
+pp_value pp_eval_char(pp_eval* ev, token* tok) {
+    //a character constant, as in 6.4.4.5. more than one char is allowed, and packs them in one byte at a time
+    string text = token_text(*tok);
+    size_t i = 0;
+    while (text.raw[i] != '\'') i++;
+    //a plain char is signed, the prefixed ones are whatever wchar_t, char16_t, char32_t and char8_t are
+    bool is_plain = i == 0;
+    bool is_utf8 = i == 2;
+    u32 width = is_plain || is_utf8 ? 8 : text.raw[0] == 'u' ? 16 : 32;
+    i++;
+
+    u64 value = 0;
+    size_t count = 0;
+    while (i < text.len && text.raw[i] != '\'') {
+        u64 c = (u8)text.raw[i++];
+        if (c == '\\' && i < text.len) {
+            char escape = text.raw[i++];
+            switch (escape) {
+                case 'a': c = '\a'; break;
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'n': c = '\n'; break;
+                case 'r': c = '\r'; break;
+                case 't': c = '\t'; break;
+                case 'v': c = '\v'; break;
+                case 'x':
+                    c = 0;
+                    while (i < text.len && pp_eval_digit(text.raw[i]) < 16) c = c * 16 + pp_eval_digit(text.raw[i++]);
+                    break;
+                default:
+                    if (escape >= '0' && escape <= '7') {
+                        c = escape - '0';
+                        for (size_t n = 1; n < 3 && i < text.len && text.raw[i] >= '0' && text.raw[i] <= '7'; n++) {
+                            c = c * 8 + (text.raw[i++] - '0');
+                        }
+                    } else {
+                        //\' \" \? and \\ are just themselves
+                        c = (u8)escape;
+                    }
+            }
+        }
+        if (width < 64) c &= (1ull << width) - 1;
+        value = count == 0 ? c : (value << width) | c;
+        count++;
+    }
+    if (count == 0) {
+        pp_eval_error(ev, tok, "empty character constant");
+        return pp_eval_signed(0);
+    }
+    //one plain char gets sign extended, like char does
+    if (is_plain && count == 1 && (value & 0x80)) value |= ~0xFFull;
+    else if (is_plain) value = (u64)(i64)(i32)value;
+    return pp_eval_signed((i64)value);
+}
+
+string pp_eval_strip_underscores(string name) {
+    //attributes can be spelled __name__ too, so they dont clash with macros
+    if (name.len > 4 && name.raw[0] == '_' && name.raw[1] == '_' && name.raw[name.len - 1] == '_' && name.raw[name.len - 2] == '_') {
+        return string_make(name.raw + 2, name.len - 4);
+    }
+    return name;
+}
+
+pp_value pp_eval_has_c_attribute(pp_eval* ev) {
+    //__has_c_attribute(attr) gives the date the standard added attr, or 0 for anything we dont know,
+    //which is every vendor attribute
+    if (!pp_eval_expect(ev, CTOK_OPEN_PAREN, "expected ( after __has_c_attribute")) return pp_eval_signed(0);
+    token* attr = pp_eval_peek(ev);
+    if (attr == NULL || attr->type != PPTOK_IDENTIFIER) {
+        pp_eval_error(ev, attr, "expected attribute name in __has_c_attribute");
+        return pp_eval_signed(0);
+    }
+    ev->pos++;
+    i64 value = 0;
+    token* after = pp_eval_peek(ev);
+    if (after != NULL && after->itype == CTOK_COLON_COLON) {
+        //a vendor prefix
+        ev->pos++;
+        token* vendor_attr = pp_eval_peek(ev);
+        if (vendor_attr == NULL || vendor_attr->type != PPTOK_IDENTIFIER) {
+            pp_eval_error(ev, vendor_attr, "expected attribute name after ::");
+            return pp_eval_signed(0);
+        }
+        ev->pos++;
+    } else {
+        string text = pp_eval_strip_underscores(token_text(*attr));
+        if (string_eq(text, strlit("deprecated"))) value = 201904;
+        else if (string_eq(text, strlit("fallthrough"))) value = 201904;
+        else if (string_eq(text, strlit("maybe_unused"))) value = 201904;
+        else if (string_eq(text, strlit("nodiscard"))) value = 202003;
+        else if (string_eq(text, strlit("noreturn"))) value = 202202;
+        else if (string_eq(text, strlit("_Noreturn"))) value = 202202;
+        else if (string_eq(text, strlit("unsequenced"))) value = 202207;
+        else if (string_eq(text, strlit("reproducible"))) value = 202207;
+    }
+    if (!pp_eval_expect(ev, CTOK_CLOSE_PAREN, "expected ) after __has_c_attribute")) return pp_eval_signed(0);
+    return pp_eval_signed(value);
+}
+
+pp_value pp_eval_has_include(pp_eval* ev) {
+    //__has_include("name") or __has_include(<name>) is 1 if #include would find it
+    if (!pp_eval_expect(ev, CTOK_OPEN_PAREN, "expected ( after __has_include")) return pp_eval_signed(0);
+    string header_name;
+    bool is_system;
+    if (pp_header_name(ev->exp->ctx, ev->tokens, &ev->pos, &header_name, &is_system) != 0) {
+        ev->failed = true;
+        return pp_eval_signed(0);
+    }
+    if (!pp_eval_expect(ev, CTOK_CLOSE_PAREN, "expected ) after __has_include")) return pp_eval_signed(0);
+    return pp_eval_signed(include_resolve(ev->exp->ctx, header_name, is_system, pp_includer_dir(ev->exp)) != NULL);
+}
+
+pp_value pp_eval_defined(pp_eval* ev) {
+    //defined X or defined(X)
+    token* tok = pp_eval_peek(ev);
+    bool paren = tok != NULL && tok->itype == CTOK_OPEN_PAREN;
+    if (paren) {
+        ev->pos++;
+        tok = pp_eval_peek(ev);
+    }
+    if (tok == NULL || tok->type != PPTOK_IDENTIFIER) {
+        pp_eval_error(ev, tok, "operator \"defined\" requires an identifier");
+        return pp_eval_signed(0);
+    }
+    ev->pos++;
+    if (paren && !pp_eval_expect(ev, CTOK_CLOSE_PAREN, "missing ) after \"defined\"")) return pp_eval_signed(0);
+    return pp_eval_signed(pp_is_defined(ev->exp->ctx, tok->atom));
+}
+
+pp_value pp_eval_unary(pp_eval* ev) {
+    token* tok = pp_eval_peek(ev);
+    if (tok == NULL) {
+        pp_eval_error(ev, NULL, "expected value in expression");
+        return pp_eval_signed(0);
+    }
+    ev->pos++;
+    switch (tok->type) {
+        case PPTOK_NUMBER:
+            return pp_eval_number(ev, tok);
+        case PPTOK_CHAR_CONST:
+            return pp_eval_char(ev, tok);
+        case PPTOK_IDENTIFIER:
+            if (tok->atom == ATOM_DEFINED) return pp_eval_defined(ev);
+            if (tok->atom == ATOM_HAS_INCLUDE) return pp_eval_has_include(ev);
+            if (tok->atom == ATOM_HAS_C_ATTRIBUTE) return pp_eval_has_c_attribute(ev);
+            //any identifier left over after expansion is 0, except true, which is 1
+            return pp_eval_signed(atom_keyword(tok->atom) == CTOK_TRUE);
+        default:
+            break;
+    }
+
+    pp_value operand;
+    switch (tok->itype) {
+        case CTOK_OPEN_PAREN:
+            operand = pp_eval_expr(ev, PP_PREC_COMMA);
+            pp_eval_expect(ev, CTOK_CLOSE_PAREN, "missing ) in expression");
+            return operand;
+        case CTOK_PLUS:
+            return pp_eval_unary(ev);
+        case CTOK_MINUS:
+            operand = pp_eval_unary(ev);
+            operand.value = -operand.value;
+            return operand;
+        case CTOK_TILDE:
+            operand = pp_eval_unary(ev);
+            operand.value = ~operand.value;
+            return operand;
+        case CTOK_EXCLAM:
+            operand = pp_eval_unary(ev);
+            return pp_eval_signed(operand.value == 0);
+        default:
+            pp_eval_error(ev, tok, "token is not valid in preprocessor expressions");
+            return pp_eval_signed(0);
+    }
+}
+
+int pp_eval_prec(token* tok) {
+    //the precedence of tok as a binary operator, or PP_PREC_NONE if it isnt one
+    if (tok == NULL || tok->type == PPTOK_IDENTIFIER) return PP_PREC_NONE;
+    switch (tok->itype) {
+        case CTOK_COMMA: return PP_PREC_COMMA;
+        case CTOK_QUESTION: return PP_PREC_TERNARY;
+        case CTOK_OR_OR: return PP_PREC_OR_OR;
+        case CTOK_AND_AND: return PP_PREC_AND_AND;
+        case CTOK_OR: return PP_PREC_OR;
+        case CTOK_CARET: return PP_PREC_CARET;
+        case CTOK_AMPERSAND: return PP_PREC_AMPERSAND;
+        case CTOK_EQ_EQ:
+        case CTOK_NOT_EQ: return PP_PREC_EQUALITY;
+        case CTOK_LESS_THAN:
+        case CTOK_GREATER_THAN:
+        case CTOK_LESS_EQ:
+        case CTOK_GREATER_EQ: return PP_PREC_RELATIONAL;
+        case CTOK_LSHIFT:
+        case CTOK_RSHIFT: return PP_PREC_SHIFT;
+        case CTOK_PLUS:
+        case CTOK_MINUS: return PP_PREC_ADDITIVE;
+        case CTOK_TIMES:
+        case CTOK_FWSLASH:
+        case CTOK_PERCENT: return PP_PREC_MULTIPLICATIVE;
+        default: return PP_PREC_NONE;
+    }
+}
+
+u64 pp_eval_shift(pp_value left, pp_value right, bool shift_left) {
+    //shifting by a negative amount shifts the other way, and shifting everything out leaves 0 (or all 1s, for a
+    //negative number shifted right). none of this is defined in C, but its what gcc does
+    i64 amount = (i64)right.value;
+    if (!right.is_unsigned && amount < 0) {
+        shift_left = !shift_left;
+        amount = -amount;
+    }
+    bool negative = !left.is_unsigned && (i64)left.value < 0;
+    if (right.is_unsigned ? right.value >= 64 : amount >= 64) {
+        return !shift_left && negative ? ~0ull : 0;
+    }
+    if (shift_left) return left.value << amount;
+    if (negative) return (u64)((i64)left.value >> amount);
+    return left.value >> amount;
+}
+
+pp_value pp_eval_binary(pp_eval* ev, token* op, pp_value left, pp_value right) {
+    //the usual arithmetic conversions, then the operation. signed arithmetic wraps, since we're built with -fwrapv
+    bool is_unsigned = left.is_unsigned || right.is_unsigned;
+    u64 a = left.value;
+    u64 b = right.value;
+    switch (op->itype) {
+        case CTOK_TIMES: return (pp_value){is_unsigned, a * b};
+        case CTOK_PLUS: return (pp_value){is_unsigned, a + b};
+        case CTOK_MINUS: return (pp_value){is_unsigned, a - b};
+        case CTOK_AMPERSAND: return (pp_value){is_unsigned, a & b};
+        case CTOK_CARET: return (pp_value){is_unsigned, a ^ b};
+        case CTOK_OR: return (pp_value){is_unsigned, a | b};
+        case CTOK_FWSLASH:
+        case CTOK_PERCENT: {
+            bool is_div = op->itype == CTOK_FWSLASH;
+            if (b == 0) {
+                if (ev->evaluate) pp_eval_error(ev, op, is_div ? "division by zero in #if" : "remainder by zero in #if");
+                return (pp_value){is_unsigned, 0};
+            }
+            if (is_unsigned) return (pp_value){true, is_div ? a / b : a % b};
+            //INT64_MIN / -1 doesnt fit, and traps if we let the hardware do it
+            if ((i64)a == INT64_MIN && (i64)b == -1) return pp_eval_signed(is_div ? INT64_MIN : 0);
+            return pp_eval_signed(is_div ? (i64)a / (i64)b : (i64)a % (i64)b);
+        }
+        //the type of a shift is the type of its left side
+        case CTOK_LSHIFT: return (pp_value){left.is_unsigned, pp_eval_shift(left, right, true)};
+        case CTOK_RSHIFT: return (pp_value){left.is_unsigned, pp_eval_shift(left, right, false)};
+        case CTOK_EQ_EQ: return pp_eval_signed(a == b);
+        case CTOK_NOT_EQ: return pp_eval_signed(a != b);
+        case CTOK_LESS_THAN: return pp_eval_signed(is_unsigned ? a < b : (i64)a < (i64)b);
+        case CTOK_GREATER_THAN: return pp_eval_signed(is_unsigned ? a > b : (i64)a > (i64)b);
+        case CTOK_LESS_EQ: return pp_eval_signed(is_unsigned ? a <= b : (i64)a <= (i64)b);
+        case CTOK_GREATER_EQ: return pp_eval_signed(is_unsigned ? a >= b : (i64)a >= (i64)b);
+        case CTOK_COMMA: return right;
+        default:
+            crash("pp_eval_binary got a token that isnt a binary operator!");
+            return pp_eval_signed(0);
+    }
+}
+
+pp_value pp_eval_expr(pp_eval* ev, int min_prec) {
+    pp_value left = pp_eval_unary(ev);
+    for (;;) {
+        if (ev->failed) return pp_eval_signed(0);
+        token* op = pp_eval_peek(ev);
+        int prec = pp_eval_prec(op);
+        if (prec == PP_PREC_NONE || prec < min_prec) return left;
+        ev->pos++;
+
+        bool evaluate = ev->evaluate;
+        if (op->itype == CTOK_AND_AND || op->itype == CTOK_OR_OR) {
+            //the right side is only evaluated if the left didnt already decide it
+            bool decided = op->itype == CTOK_AND_AND ? left.value == 0 : left.value != 0;
+            if (decided) ev->evaluate = false;
+            pp_value right = pp_eval_expr(ev, prec + 1);
+            ev->evaluate = evaluate;
+            left = pp_eval_signed(op->itype == CTOK_AND_AND ? left.value != 0 && right.value != 0
+                                                            : left.value != 0 || right.value != 0);
+        } else if (op->itype == CTOK_QUESTION) {
+            bool condition = left.value != 0;
+            ev->evaluate = evaluate && condition;
+            pp_value if_true = pp_eval_expr(ev, PP_PREC_COMMA);
+            if (!pp_eval_expect(ev, CTOK_COLON, "expected : in conditional expression")) return pp_eval_signed(0);
+            ev->evaluate = evaluate && !condition;
+            //?: groups right to left, so the right side can be another ?:
+            pp_value if_false = pp_eval_expr(ev, PP_PREC_TERNARY);
+            ev->evaluate = evaluate;
+            left = condition ? if_true : if_false;
+            left.is_unsigned = if_true.is_unsigned || if_false.is_unsigned;
+        } else {
+            pp_value right = pp_eval_expr(ev, prec + 1);
+            left = pp_eval_binary(ev, op, left, right);
+        }
+    }
+}
+
+void pp_eval_paint_operand(Vec(token) line, size_t* i) {
+    //stops the operand of defined, __has_include or __has_c_attribute from being expanded.
+    //*i is on the operator, and ends up on the last token of the operand
+    size_t next = *i + 1;
+    if (next >= vec_len(line)) return;
+    if (line[next].itype != CTOK_OPEN_PAREN) {
+        //defined X
+        line[next].no_expand = true;
+        *i = next;
+        return;
+    }
+    //anything up to the matching ), which for __has_include(<name>) can be a lot
+    size_t depth = 0;
+    for (; next < vec_len(line); next++) {
+        if (line[next].itype == CTOK_OPEN_PAREN) depth++;
+        if (line[next].itype == CTOK_CLOSE_PAREN && --depth == 0) break;
+        line[next].no_expand = true;
+    }
+    *i = next;
+}
+
+int pp_eval_condition(pp_expander* exp, bool* result) {
+    //evaluates the rest of the #if or #elif line that curr_tok_index is on the name of.
+    //gives back -1 if the expression was bad
+    parser_ctx* ctx = exp->ctx;
+    token directive = ctx->tokens[ctx->curr_tok_index];
+    Vec(token) line = vec_new(token, 8);
+    bool has_ident = false;
+    for (size_t i = ctx->curr_tok_index + 1; i < vec_len(ctx->tokens) && ctx->tokens[i].line == directive.line; i++) {
+        if (ctx->tokens[i].type == PPTOK_BAD) {
+            vec_destroy(&line);
+            return lex_explain(ctx, ctx->tokens[i]);
+        }
+        vec_append(&line, ctx->tokens[i]);
+        has_ident |= ctx->tokens[i].type == PPTOK_IDENTIFIER;
+    }
+    if (vec_len(line) == 0) {
+        print_parsing_error(ctx, directive, "#"str_fmt" with no expression", str_arg(token_text(directive)));
+        vec_destroy(&line);
+        return -1;
+    }
+
+    //plenty of conditions are just a number, and theres nothing to expand in those
+    if (has_ident) {
+        for (size_t i = 0; i < vec_len(line); i++) {
+            if (token_is_atom(line[i], ATOM_DEFINED) || token_is_atom(line[i], ATOM_HAS_C_ATTRIBUTE)) {
+                pp_eval_paint_operand(line, &i);
+            } else if (token_is_atom(line[i], ATOM_HAS_INCLUDE)) {
+                //a header name thats spelled out is left alone. one that comes out of a macro has to be expanded
+                if (i + 2 < vec_len(line) && (line[i + 2].type == PPTOK_STR_LIT || line[i + 2].itype == CTOK_LESS_THAN)) {
+                    pp_eval_paint_operand(line, &i);
+                }
+            }
+        }
+        Vec(token) expanded = pp_expand_list(exp, line);
+        vec_destroy(&line);
+        if (expanded == NULL) return -1;
+        line = expanded;
+    }
+
+    pp_eval ev = {.exp = exp, .tokens = line, .pos = 0, .directive = directive, .evaluate = true, .failed = false};
+    pp_value value = pp_eval_expr(&ev, PP_PREC_COMMA);
+    if (!ev.failed && ev.pos != vec_len(line)) {
+        pp_eval_error(&ev, &line[ev.pos], "missing binary operator before token");
+    }
+    vec_destroy(&line);
+    if (ev.failed) return -1;
+    *result = value.value != 0;
+    return 0;
+}
@@ -0,0 +1,236 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "cobalt.h"
+#include "crash.h"
+#include "parse.h"
+
+#include "common/str.h"
+#include "common/util.h"
+#include "common/vec.h"
+
+// include prefetch. phases 1 to 3 dont care what any macro is, so a header can be lexed the moment we know its going
+// to be included, long before phase 4 gets to the #include. whenever a file is lexed, we look over its #include lines,
+// resolve the ones with a plain "name" or <name>, and hand those headers to a pool of threads to lex. by the time
+// phase 4 reaches the #include, the tokens are usually already there.
+//
+// the lexers on the pool run deferred (see lex_adopt), so they dont touch the atom table, scratch, or the source
+// table, and dont print anything. everything else (opening the file, resolving names, finishing the tokens off)
+// happens on the main thread, which keeps all of that single threaded. lexing is most of the work, and thats what
+// gets spread out.
+//
+// this is speculative. an #include inside an #if thats never taken still gets its header lexed, which costs nothing
+// but the time it took. a header that fails to lex gets lexed again on the main thread if its actually included, so
+// the errors come out in the right place, and only if they should.
+
+//past this, the main thread cant hand out work fast enough for more threads to help
+#define PREFETCH_MAX_THREADS 8
+
+typedef enum {
+    PREFETCH_QUEUED,
+    PREFETCH_RUNNING,
+    PREFETCH_DONE,
+    //the main thread got to it first and lexed it itself. whichever thread picks it up next just drops it
+    PREFETCH_CANCELLED,
+} prefetch_state;
+
+struct _prefetch_job {
+    header_file* header;
+    parser_ctx lctx;
+    prefetch_state state;
+    bool failed;
+    //when it was lexed and by who, for -header-report. threads count from 2, the main thread is 1
+    u64 lex_start;
+    u64 lex_end;
+    u32 thread;
+    prefetch_job* next;
+};
+
+//everything here is guarded by prefetch_lock
+pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+//signalled when theres something in the queue
+pthread_cond_t prefetch_queued = PTHREAD_COND_INITIALIZER;
+//signalled when a job is done
+pthread_cond_t prefetch_done = PTHREAD_COND_INITIALIZER;
+prefetch_job* prefetch_head = NULL;
+prefetch_job* prefetch_tail = NULL;
+//done, but not handed back to their headers yet
+Vec(prefetch_job*) prefetch_finished = NULL;
+size_t prefetch_threads = 0;
+bool prefetch_started = false;
+
+void prefetch_discard(prefetch_job* job) {
+    //throws away a job that never got to hand its tokens over, along with everything the deferred lex kept
+    vec_destroy(&job->lctx.tokens);
+    vec_destroy(&job->lctx.lex_hashes);
+    vec_destroy(&job->lctx.lex_scratch);
+    vec_destroy(&job->lctx.lex_stitched);
+    cfree(job);
+}
+
+void* prefetch_worker(void* arg) {
+    u32 thread = (uintptr_t)arg;
+    while (true) {
+        pthread_mutex_lock(&prefetch_lock);
+        while (prefetch_head == NULL) pthread_cond_wait(&prefetch_queued, &prefetch_lock);
+        prefetch_job* job = prefetch_head;
+        prefetch_head = job->next;
+        if (prefetch_head == NULL) prefetch_tail = NULL;
+        if (job->state == PREFETCH_CANCELLED) {
+            pthread_mutex_unlock(&prefetch_lock);
+            prefetch_discard(job);
+            continue;
+        }
+        job->state = PREFETCH_RUNNING;
+        pthread_mutex_unlock(&prefetch_lock);
+
+        //clock_gettime is cheap enough that its not worth checking report_enabled from over here
+        job->lex_start = report_now();
+        job->failed = parser_phase3(&job->lctx) != 0 || job->lctx.lex_errored;
+        job->lex_end = report_now();
+        job->thread = thread;
+
+        pthread_mutex_lock(&prefetch_lock);
+        job->state = PREFETCH_DONE;
+        vec_append(&prefetch_finished, job);
+        pthread_cond_broadcast(&prefetch_done);
+        pthread_mutex_unlock(&prefetch_lock);
+    }
+    return NULL;
+}
+
+bool prefetch_start() {
+    //starts the pool the first time theres something for it. gives back false if theres no pool to be had
+    if (prefetch_started) return prefetch_threads != 0;
+    prefetch_started = true;
+    //the lexer builds its tables on first use, which has to happen before anyone else can be using them
+    lex_init();
+    prefetch_finished = vec_new(prefetch_job*, 16);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    //the main thread is busy with phase 4, so it gets a core to itself. with only the one core, a thread would
+    //just be taking turns with us, so theres no pool at all and headers get lexed when they're included
+    size_t count = cores > 1 ? cores - 1 : 0;
+    if (count > PREFETCH_MAX_THREADS) count = PREFETCH_MAX_THREADS;
+    for_n(i, 0, count) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, prefetch_worker, (void*)(uintptr_t)(i + 2)) != 0) break;
+        pthread_detach(thread);
+        prefetch_threads++;
+    }
+    return prefetch_threads != 0;
+}
+
+void prefetch_header(parser_ctx* ctx, header_file* header) {
+    //queues header to be lexed, unless theres no point
+    if (header->tokens != NULL || header->job != NULL || header->once || header->prefetch_failed) return;
+    if (header->guard != 0 && macro_lookup(ctx->defines, header->guard) != NULL) return;
+    if (!prefetch_start()) return;
+    //opening it here means the source table is only ever touched by us. if it wont open, the #include can say so
+    if (header->src == NULL) header->src = source_open(header->path);
+    if (header->src == NULL) return;
+
+    prefetch_job* job = cmalloc(sizeof(*job));
+    *job = (prefetch_job){.header = header,
+                          .lctx = {.tokens = vec_new(token, 1),
+                                   .src = header->src,
+                                   .curr_offset = 0,
+                                   .ctx = ctx->ctx,
+                                   .lex_deferred = true,
+                                   .lex_errored = false,
+                                   .lex_hashes = vec_new(u32, 256),
+                                   .lex_scratch = vec_new(char, 16),
+                                   .lex_stitched = vec_new(u32, 4)},
+                          .state = PREFETCH_QUEUED,
+                          .failed = false,
+                          .next = NULL};
+    header->job = job;
+
+    pthread_mutex_lock(&prefetch_lock);
+    if (prefetch_tail != NULL) prefetch_tail->next = job;
+    else prefetch_head = job;
+    prefetch_tail = job;
+    pthread_cond_signal(&prefetch_queued);
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+void prefetch_includes(parser_ctx* ctx, Vec(token) tokens, Vec(u32) directives, string from_dir) {
+    //queues every header tokens #includes by a plain name. computed includes need phase 4, so they wait for it
+    for_vec(u32* directive, &directives) {
+        size_t i = *directive;
+        if (i + 2 >= vec_len(tokens) || !token_is_atom(tokens[i + 1], ATOM_INCLUDE)) continue;
+        u32 line = tokens[i].line;
+        if (tokens[i + 1].line != line || tokens[i + 2].line != line) continue;
+
+        //only the shapes pp_header_name is happy with, so it doesnt print anything
+        token first = tokens[i + 2];
+        if (first.type != PPTOK_STR_LIT) {
+            if (first.itype != CTOK_LESS_THAN) continue;
+            size_t end = i + 3;
+            while (end < vec_len(tokens) && tokens[end].line == line && tokens[end].itype != CTOK_GREATER_THAN) end++;
+            if (end == i + 3 || end == vec_len(tokens) || tokens[end].line != line) continue;
+        }
+        if (first.type == PPTOK_STR_LIT && (token_text(first).len < 2 || token_text(first).raw[0] != '"')) continue;
+
+        Vec(token) line_tokens = vec_new(token, 4);
+        for (size_t j = i + 2; j < vec_len(tokens) && tokens[j].line == line; j++) vec_append(&line_tokens, tokens[j]);
+        string name;
+        bool is_system;
+        size_t pos = 0;
+        int retval = pp_header_name(ctx, line_tokens, &pos, &name, &is_system);
+        vec_destroy(&line_tokens);
+        if (retval != 0) continue;
+
+        header_file* header = include_resolve(ctx, name, is_system, from_dir);
+        if (header != NULL) prefetch_header(ctx, header);
+    }
+}
+
+void prefetch_finish(parser_ctx* ctx, prefetch_job* job) {
+    //hands a finished job's tokens to its header. a job that failed leaves the header to be lexed again, on the main
+    //thread, and only if its actually included. another thread would only fail the same way, so it never gets one
+    header_file* header = job->header;
+    header->job = NULL;
+    if (job->failed) {
+        header->prefetch_failed = true;
+        prefetch_discard(job);
+        return;
+    }
+    lex_adopt(&job->lctx);
+    if (report_enabled) report_lexed(header, job->lex_start, job->lex_end, job->thread);
+    header_finish(ctx, header, job->lctx.tokens);
+    cfree(job);
+}
+
+void prefetch_harvest(parser_ctx* ctx) {
+    //finishes off everything the pool is done with, which queues up whatever those headers include in turn
+    if (prefetch_threads == 0) return;
+    pthread_mutex_lock(&prefetch_lock);
+    if (vec_len(prefetch_finished) == 0) {
+        pthread_mutex_unlock(&prefetch_lock);
+        return;
+    }
+    Vec(prefetch_job*) finished = prefetch_finished;
+    prefetch_finished = vec_new(prefetch_job*, 16);
+    pthread_mutex_unlock(&prefetch_lock);
+
+    for_vec(prefetch_job** job, &finished) prefetch_finish(ctx, *job);
+    vec_destroy(&finished);
+}
+
+void prefetch_wait(parser_ctx* ctx, header_file* header) {
+    //phase 4 needs header now. if no thread has started on it, we take it back and lex it ourselves,
+    //otherwise we wait for whoever has it
+    pthread_mutex_lock(&prefetch_lock);
+    prefetch_job* job = header->job;
+    if (job->state == PREFETCH_QUEUED) {
+        job->state = PREFETCH_CANCELLED;
+        header->job = NULL;
+        pthread_mutex_unlock(&prefetch_lock);
+        return;
+    }
+    while (job->state != PREFETCH_DONE) pthread_cond_wait(&prefetch_done, &prefetch_lock);
+    pthread_mutex_unlock(&prefetch_lock);
+    prefetch_harvest(ctx);
+}
@@ -25,31 +25,31 @@ string pp_stringize_token_stream(Vec(token) stream) {
     size_t cursor = 1;
     builder.raw[0] = '\"';
     for_vec(token* tok, &stream) {
-        if (cursor + tok->tok.len > builder.len) {
-            //we need to realloc the raw builder's value. we double it and add the token's length
-            builder.raw = crealloc(builder.raw, builder.len * 2 + tok->tok.len);
-            builder.len = builder.len * 2 + tok->tok.len;
+        string text = token_text(*tok);
+        //everything this token can write: a space before it, and a string literal's quotes turn into \" each
+        size_t needed = text.len + 1 + (tok->type == PPTOK_STR_LIT ? 2 : 0);
+        if (cursor + needed > builder.len) {
+            //we need to realloc the raw builder's value. we double it and add what the token needs
+            builder.raw = crealloc(builder.raw, builder.len * 2 + needed);
+            builder.len = builder.len * 2 + needed;
         }
-        
+
+        //whitespace between tokens turns into exactly one space, and none at the start
+        if (tok->preceded_by_space && tok != stream) builder.raw[cursor++] = ' ';
+
         if (tok->type == PPTOK_STR_LIT) {
             //this one is gonna be fun.
             memmove(builder.raw + cursor, "\\\"", 2);
             cursor += 2;
-            memmove(builder.raw + cursor, tok->tok.raw + 1, tok->tok.len - 2);
-            cursor += tok->tok.len - 2;
+            memmove(builder.raw + cursor, text.raw + 1, text.len - 2);
+            cursor += text.len - 2;
             memmove(builder.raw + cursor, "\\\"", 2);
             cursor += 2;
             continue;
         }
 
-        if (tok->type == TOK_WHITESPACE) {
-            memmove(builder.raw + cursor, " ", 1);
-            cursor++;
-            continue;
-        }
-
-        memmove(builder.raw + cursor, tok->tok.raw, tok->tok.len);
-        cursor += tok->tok.len;
+        memmove(builder.raw + cursor, text.raw, text.len);
+        cursor += text.len;
     }
     //now, we add a " to the end
     if (cursor + 1 > builder.len) {
@@ -63,375 +63,508 @@ string pp_stringize_token_stream(Vec(token) stream) {
     return builder;
 }
 
-int pp_replace_ident(parser_ctx* ctx, size_t index) {
-    //scan macro defines list, if macro is defined we can cut it off
-    if (index > vec_len(ctx->tokens)) crash("Attempted to replace identifier thats not in the ctx->tokens list!\n");
-    if (ctx->tokens[index].type != PPTOK_IDENTIFIER) crash("Attempted to replace non-identifier! Got: %s\n", token_str[ctx->tokens[index].type]);
-    //we need to recursively call pp_replace_ident for any identifiers that do NOT match this one
-    macro_define potential_define = {};
-    bool found_define = false;
-  
-    token replaced_tok = ctx->tokens[index];
-
-    //find the correct macro
-    for_vec(macro_define* define, &ctx->defines) {
-        if (string_eq(replaced_tok.tok, define->name.tok)) {
-            found_define = true;
-            potential_define = *define;
-            break;
-        }
+// phase 4 runs as a producer. tokens are read from a stack of frames and written once to a fresh output vec, so
+// nothing ever gets inserted into (or removed from) the middle of the token stream.
+// the bottom frame is the file as it came out of phase 3, and every macro we expand pushes a frame holding its
+// substituted replacement list, which gets rescanned as it's read, all in one left to right pass.
+// each frame has a hide set (see hideset.c) of every macro whose expansion is being read while we're in it, which is
+// the set from the frame it was pushed over plus its own macro. a name in the hide set of the frame it was read from
+// is painted with no_expand, so it never expands again, even once its out of that frame.
+// an #include pushes a frame too, reading the headers cached tokens (see header.c) as if they'd been written right
+// where the #include was.
+
+#define PP_MAX_INCLUDE_DEPTH 200
+
+u32 pp_curr_hideset(pp_expander* exp) {
+    return exp->frames[vec_len(exp->frames) - 1].hideset;
+}
+
+bool pp_in_file(pp_expander* exp) {
+    //is the token we just read straight out of a file, rather than out of a macro
+    return exp->frames[vec_len(exp->frames) - 1].is_file;
+}
+
+void pp_push_frame(pp_expander* exp, Vec(token) tokens, u32 macro_atom) {
+    u32 hideset = hideset_add(pp_curr_hideset(exp), macro_atom);
+    vec_append(&exp->frames, ((pp_frame){.tokens = tokens, .pos = 0, .hideset = hideset, .is_file = false, .header = NULL}));
+}
+
+void pp_pop_frame(pp_expander* exp) {
+    pp_frame* frame = &exp->frames[vec_len(exp->frames) - 1];
+    //a headers tokens belong to the cache, and get read again by the next #include of it
+    if (!frame->is_file) vec_destroy(&frame->tokens);
+    //every #if in a file has to end in that file
+    if (frame->is_file && vec_len(exp->conds) > frame->cond_base) {
+        print_parsing_error(exp->ctx, exp->conds[frame->cond_base].opener, "unterminated conditional directive");
+        vec_len(exp->conds) = frame->cond_base;
+        exp->errored = true;
     }
+    if (frame->is_file && frame->header != NULL && report_enabled) report_close();
+    vec_len(exp->frames)--;
+}
 
-    if (found_define == false) return 0;
-    
-    if (potential_define.is_function == false) {
-        //now, we delete the token at index
-        vec_remove_ordered(&ctx->tokens, index);
-        //and repeatedly add the tokens in the list
-        for_n(i, 0, vec_len(potential_define.replacement_list)) {
-            token new_tok = potential_define.replacement_list[i];
-
-            //we need to make sure we update line info correctly
-            new_tok.line = replaced_tok.line;
-            vec_insert(&ctx->tokens, index + i, new_tok);
-        }
+token* pp_peek(pp_expander* exp) {
+    //drop any expansions we've finished reading. the bottom frame isnt ours, so it stays even once its empty
+    while (vec_len(exp->frames) > 1) {
+        pp_frame* top = &exp->frames[vec_len(exp->frames) - 1];
+        if (top->pos < vec_len(top->tokens)) break;
+        pp_pop_frame(exp);
+    }
+    pp_frame* top = &exp->frames[vec_len(exp->frames) - 1];
+    if (top->pos >= vec_len(top->tokens)) return NULL;
+    return &top->tokens[top->pos];
+}
+
+token pp_next(pp_expander* exp) {
+    //only call this once pp_peek has said theres something there
+    token* tok = pp_peek(exp);
+    pp_frame* top = &exp->frames[vec_len(exp->frames) - 1];
+    top->pos++;
+    //a token that wouldnt lex is only an error once its actually read, which it never is in a skipped group
+    if (top->is_file && tok->type == PPTOK_BAD) {
+        lex_explain(exp->ctx, *tok);
+        exp->errored = true;
+    }
+    return *tok;
+}
+
+void pp_note_origin(pp_expander* exp) {
+    //whatever goes out next is being read from the innermost file, so if thats not the one we said last, say so.
+    //that goes by visit rather than by file, since a header included twice in a row has to start over both times
+    if (exp->origins == NULL) return;
+    size_t i = vec_len(exp->frames) - 1;
+    while (!exp->frames[i].is_file) i--;
+    if (vec_len(exp->origins) != 0 && exp->origin_visit == exp->frames[i].visit) return;
+    header_file* header = exp->frames[i].header;
+    source_file* src = header != NULL ? header->src : exp->ctx->src;
+    exp->origin_visit = exp->frames[i].visit;
+    vec_append(&exp->origins, ((pp_origin){.index = vec_len(exp->out), .src = src}));
+}
+
+void pp_emit(pp_expander* exp, token tok) {
+    //a macro that expanded to nothing leaves its spacing for whatever comes next
+    if (exp->pending_space) tok.preceded_by_space = true;
+    exp->pending_space = false;
+    pp_note_origin(exp);
+    vec_append(&exp->out, tok);
+}
+
+bool pp_builtin(pp_expander* exp, token* tok) {
+    //__LINE__ and __FILE__ are the only macros that arent in the macro table, since they change under us.
+    //returns true if the token was one of them, and turns it into what it expands to
+    if (!token_is_atom(*tok, ATOM_LINE_MACRO) && !token_is_atom(*tok, ATOM_FILE_MACRO)) return false;
+
+    //inside an expansion, we want where the macro was used, not where it was defined
+    token site = pp_in_file(exp) ? *tok : exp->invocation;
+    //tokens that came out of a paste dont have a file, so they get the logical line instead
+    source_file* src = token_source(site);
+    string text;
+    if (token_is_atom(*tok, ATOM_LINE_MACRO)) {
+        u32 line = src != NULL ? source_line_of(src, site.loc - src->base) : site.line;
+        text = strprintf("%u", line + 1);
+        tok->type = PPTOK_NUMBER;
+        tok->itype = TOK_INVALID;
     } else {
-        //we scan ahead until we hit (, and then we grab the arguments
-        size_t tok_cursor = index;
-        tok_cursor++; //skip identifier
-        //printf("%d, %d\n", tok_cursor, ctx->tokens.len);
-        if (tok_cursor >= vec_len(ctx->tokens)) return 0; //already invalid, but this isn't ICE worthy.
-        if (ctx->tokens[tok_cursor].type == TOK_WHITESPACE) tok_cursor++;
-        if (ctx->tokens[tok_cursor].itype != CTOK_OPEN_PAREN) return 0;
-        
-        //FIXME?: handle when args are missing, but commas are there. basically, create and insert a nothing token on the same line
-        Vec(Vec(token)) args = vec_new(Vec(token), 1);
-        tok_cursor++;
-        Vec(token) arg_list = vec_new(token, 1);
-        size_t curr_depth = 0;
-        for (; tok_cursor < vec_len(ctx->tokens); tok_cursor++) {
-            //we're gonna skip ws until the argument starts
-            if (vec_len(arg_list) == 0 && ctx->tokens[tok_cursor].type == TOK_WHITESPACE) continue;
-            //if (ctx->tokens[tok_cursor].type == TOK_WHITESPACE) continue;
-
-            if (ctx->tokens[tok_cursor].itype == CTOK_OPEN_PAREN) {
-                vec_append(&arg_list, ctx->tokens[tok_cursor]);
-                curr_depth++;
-                continue;
-            }
+        //the path goes in as a string literal, so any \ or " in it needs escaping
+        string path = src != NULL ? src->path : exp->ctx->ctx->curr_file;
+        text = string_alloc(path.len * 2 + 2);
+        size_t cursor = 0;
+        text.raw[cursor++] = '"';
+        for_n(i, 0, path.len) {
+            if (path.raw[i] == '\\' || path.raw[i] == '"') text.raw[cursor++] = '\\';
+            text.raw[cursor++] = path.raw[i];
+        }
+        text.raw[cursor++] = '"';
+        text.len = cursor;
+        tok->type = PPTOK_STR_LIT;
+        tok->itype = TOK_STR_LIT;
+    }
+    tok->loc = source_scratch(text);
+    tok->len = text.len;
+    cfree(text.raw);
+    return true;
+}
 
-            if (ctx->tokens[tok_cursor].itype == CTOK_CLOSE_PAREN) {
-                if (curr_depth != 0) {
-                    vec_append(&arg_list, ctx->tokens[tok_cursor]);
-                    curr_depth--;
-                    continue;
-                }
-                //if args are empty, we skip appending.
+Vec(token) pp_expand_list(pp_expander* exp, Vec(token) tokens) {
+    //fully macro expands a list of tokens on its own, for arguments and computed includes.
+    //whatever is hidden out here stays hidden in there. gives back NULL if something went wrong
+    pp_expander sub = {.ctx = exp->ctx,
+                       .frames = vec_new(pp_frame, 4),
+                       .out = vec_new(token, vec_len(tokens) + 1),
+                       .pending_space = false,
+                       .invocation = exp->invocation,
+                       .run_directives = false};
+    vec_append(&sub.frames, ((pp_frame){.tokens = tokens, .pos = 0, .hideset = pp_curr_hideset(exp), .is_file = false, .header = NULL}));
+    int retval = pp_expand(&sub);
+    vec_destroy(&sub.frames);
+    if (retval != 0) return NULL;
+    return sub.out;
+}
 
-                if (vec_len(arg_list) == 0) break;
+size_t pp_named_param_count(macro_define* def) {
+    //a variadic macro has the ... on the end of its arguments
+    return vec_len(def->arguments) - (def->is_variadic ? 1 : 0);
+}
 
-                vec_append(&args, arg_list);
-                break;
-            }
-            if (ctx->tokens[tok_cursor].itype == CTOK_COMMA) {
-                //expect no close paren after this
-                if (tok_cursor + 1 < vec_len(ctx->tokens) && ctx->tokens[tok_cursor + 1].itype == CTOK_CLOSE_PAREN) {
-                    //AUGH!
-                    //normally, this would be an issue, but we'll simply append the args to the arglist, and continue
-                    vec_append(&args, arg_list);
-                    arg_list = vec_new(token, 1);
-
-                    string fake_str = string_alloc(1);
-                    fake_str.len = 0;
-                    token fake_tok = (token){.type = TOK_WHITESPACE,
-                                             .tok = fake_str,
-                                             .line = ctx->tokens[tok_cursor].line};
-                    vec_append(&arg_list, fake_tok);
+i64 pp_param_index(macro_define* def, token tok) {
+    //which parameter tok names, or -1 if it isnt one. __VA_ARGS__ comes after all the named ones
+    if (!def->is_function || tok.type != PPTOK_IDENTIFIER) return -1;
+    size_t named = pp_named_param_count(def);
+    if (def->is_variadic && tok.atom == ATOM_VA_ARGS) return named;
+    for_n(i, 0, named) {
+        if (token_same_ident(def->arguments[i], tok)) return i;
+    }
+    return -1;
+}
+
+Vec(Vec(token)) pp_collect_args(pp_expander* exp, macro_define* def, token name) {
+    //we're sat on the (, and we read up to the matching ). this can run out of the frame the name was in,
+    //which is fine, the arguments are wherever the tokens are.
+    pp_next(exp);
+
+    //empty arguments are just empty vecs. theres no whitespace to trim off the ends anymore
+    Vec(Vec(token)) args = vec_new(Vec(token), 1);
+    Vec(token) arg_list = vec_new(token, 1);
+    size_t named = pp_named_param_count(def);
+    size_t curr_depth = 0;
+    while (true) {
+        if (pp_peek(exp) == NULL) {
+            print_parsing_error(exp->ctx, name, "unterminated argument list invoking macro "str_fmt, str_arg(token_text(name)));
+            return NULL;
+        }
+        token tok = pp_next(exp);
+        if (tok.itype == CTOK_OPEN_PAREN) {
+            curr_depth++;
+        } else if (tok.itype == CTOK_CLOSE_PAREN) {
+            if (curr_depth == 0) {
+                //F() has no args, but F(,) has two (empty) ones, so the last arg only counts if theres something
+                //to count. the exception is a macro taking exactly one parameter, where F() passes it empty.
+                if (vec_len(arg_list) != 0 || vec_len(args) != 0 || (!def->is_variadic && named == 1)) {
                     vec_append(&args, arg_list);
-                    continue;
-                }
-                if (vec_len(arg_list) == 0) {
-                    //we need to create a "nothing" token here, so that we can insert an empty something there
-                    string fake_str = string_alloc(1);
-                    fake_str.len = 0;
-                    token fake_tok = (token){.type = TOK_WHITESPACE,
-                                             .tok = fake_str,
-                                             .line = ctx->tokens[tok_cursor].line};
-                    vec_append(&arg_list, fake_tok);
                 }
-                if (potential_define.is_variadic && vec_len(args) == vec_len(potential_define.arguments) - 1) {
-                    //we safely ignore this comma.
-                    vec_append(&arg_list, ctx->tokens[tok_cursor]);
-                    continue;
-                }
-
+                break;
+            }
+            curr_depth--;
+        } else if (tok.itype == CTOK_COMMA && curr_depth == 0) {
+            //once we're into the variadic part, commas are just part of the argument
+            if (!def->is_variadic || vec_len(args) != named) {
                 vec_append(&args, arg_list);
                 arg_list = vec_new(token, 1);
-                if (ctx->tokens[tok_cursor].type == TOK_WHITESPACE) tok_cursor++;
                 continue;
             }
-            vec_append(&arg_list, ctx->tokens[tok_cursor]);
-        }
-        //now that we've gotten the argument list, we can start matching 1:1
-        //only problem: we have to replace in place, so when we insert a token, we need to recursively call pp_replace_ident
-        //first, verify the expansion is actually valid
-        if (potential_define.is_variadic == false && vec_len(args) != vec_len(potential_define.arguments)) {
-            print_parsing_error(ctx, replaced_tok, "macro "str_fmt" takes %d args, given %d", str_arg(replaced_tok.tok), vec_len(potential_define.arguments), vec_len(args));
-            return -1;
         }
+        vec_append(&arg_list, tok);
+    }
 
-        if (potential_define.is_variadic) {
-            //we need to count the number of args, and if they're less than the minimum required, we error
-            //e.g
-            //#define some_var(a, b, ...) a, b, __VA_ARGS__
-            //and we use it like
-            //some_var(1)
-            //thats not enough args
-            size_t non_var_count = 0;
-            for_vec(token* tok, &potential_define.arguments) {
-                if (tok->itype == CTOK_ELLIPSIS) break;
-                non_var_count++;
-            }
-            if (vec_len(args) < non_var_count) {
-                print_parsing_error(ctx, replaced_tok, "variadic macro "str_fmt" takes at least %d args, given %d", str_arg(replaced_tok.tok), non_var_count, vec_len(args));
-                return -1;
-            }
-        }
-        //we now fix up the end of args, where there could be extra useless ws
-        //this should just be one token's worth in each
-        for_vec(Vec(token)* arg_decl, &args) {
-            Vec(token) arg = *arg_decl;
-            if (arg[vec_len(arg) - 1].type == TOK_WHITESPACE) {
-                vec_remove_ordered(&arg, vec_len(arg) - 1);
-            }
-        }
+    //now that we've gotten the argument list, verify the expansion is actually valid
+    if (!def->is_variadic && vec_len(args) != named) {
+        print_parsing_error(exp->ctx, name, "macro "str_fmt" takes %d args, given %d", str_arg(token_text(name)), named, vec_len(args));
+        return NULL;
+    }
+    //e.g
+    //#define some_var(a, b, ...) a, b, __VA_ARGS__
+    //and we use it like
+    //some_var(1)
+    //thats not enough args
+    if (def->is_variadic && vec_len(args) < named) {
+        print_parsing_error(exp->ctx, name, "variadic macro "str_fmt" takes at least %d args, given %d", str_arg(token_text(name)), named, vec_len(args));
+        return NULL;
+    }
+    //no variadic arguments at all is the same as an empty one
+    if (def->is_variadic && vec_len(args) == named) vec_append(&args, vec_new(token, 1));
+    return args;
+}
 
-        //now that we know everything is fine, we can start inserting
-        //we split this into two paths, function and var function
-
-        //index contains the name of the macro we started at, so we can just start replacing here
-        
-        //we now remove tokens until we hit the final close paren
-        curr_depth = 0;
-        //we delete the identifier
-        for (; index < vec_len(ctx->tokens);) {
-            if (ctx->tokens[index].itype == CTOK_OPEN_PAREN) {
-                vec_remove_ordered(&ctx->tokens, index);
-                curr_depth++;
-                continue;
-            }
+int pp_paste(pp_expander* exp, token left, token right, token* out) {
+    //the pasted text goes into scratch, and we lex exactly one token back out of it, so the token we
+    //get already has a real location.
+    string pasted = string_concat(token_text(left), token_text(right));
+    u32 pasted_loc = source_scratch(pasted);
+    cfree(pasted.raw);
+    pasted = token_text((token){.loc = pasted_loc, .len = pasted.len});
+
+    token lexed_tok = {0};
+    if (lex_one_token(exp->ctx->ctx, pasted, pasted_loc, &lexed_tok) != pasted.len) {
+        print_parsing_error(exp->ctx, left, "pasting "str_fmt" and "str_fmt" does not give a valid preprocessing token",
+                            str_arg(token_text(left)), str_arg(token_text(right)));
+        return -1;
+    }
+    lexed_tok.line = left.line;
+    lexed_tok.after_newline = false;
+    lexed_tok.preceded_by_space = left.preceded_by_space;
+    *out = lexed_tok;
+    return 0;
+}
 
-            if (ctx->tokens[index].itype == CTOK_CLOSE_PAREN) {
-                if (curr_depth != 1) {
-                    curr_depth--;
-                    vec_remove_ordered(&ctx->tokens, index);
-                    continue;
-                }
-                vec_remove_ordered(&ctx->tokens, index);
-                break;
-            }
-            vec_remove_ordered(&ctx->tokens, index);
-        }
+token pp_stringize_arg(Vec(token) arg, token hash, token name) {
+    string stringised = pp_stringize_token_stream(arg);
+    token str_tok = (token){.type = PPTOK_STR_LIT,
+                            .itype = TOK_STR_LIT,
+                            .loc = source_scratch(stringised),
+                            .len = stringised.len,
+                            .line = name.line,
+                            .preceded_by_space = hash.preceded_by_space};
+    cfree(stringised.raw);
+    return str_tok;
+}
 
-        //we've deleted the macro, now we need to fill it back out with info
-        //first, we shove the replacement list into a special vec.
-        Vec(token) replacement_list = vec_new(token, 1);
-        for_vec(token* tok, &potential_define.replacement_list) {
-            token new_tok = *tok;
-            new_tok.line = replaced_tok.line;
-            vec_append(&replacement_list, new_tok);
-        }
+void pp_append_tokens(Vec(token)* list, Vec(token) tokens, bool first_space, token name) {
+    //everything in an expansion sits on the line the macro was used on.
+    //the tokens go in as one block, and get fixed up where they land
+    if (vec_len(tokens) == 0) return;
+    size_t start = vec_len(*list);
+    token_splice(list, start, 0, tokens, vec_len(tokens));
+    for_n(i, start, vec_len(*list)) {
+        (*list)[i].line = name.line;
+        (*list)[i].after_newline = false;
+    }
+    (*list)[start].preceded_by_space = first_space;
+}
 
-        //now, scan the replacement list. if we find a #, we need to deal with it
-        for_n(i, 0, vec_len(replacement_list)) {
-            token* tok = &replacement_list[i];
-            
-            if (tok->itype == CTOK_HASH) {
-                //stringise the whole thing that comes next
-                //first, is it an argument?
+Vec(token) pp_substitute(pp_expander* exp, macro_define* def, Vec(Vec(token)) args, token name) {
+    //builds the replacement list for one use of def. # and ## get their operands as they were written, every other
+    //parameter gets its argument fully expanded first, which we only do once per parameter however often its used.
+    //gives back NULL if something went wrong
+    Vec(token) list = def->replacement_list;
+    Vec(token) result = vec_new(token, vec_len(list) + 1);
+    Vec(token)* expanded = NULL;
+    if (args != NULL) {
+        expanded = cmalloc(sizeof(*expanded) * (vec_len(args) + 1));
+        for_n(i, 0, vec_len(args)) expanded[i] = NULL;
+    }
+    //set when the last thing we added was an empty argument next to a ##. pasting onto one of these is just the
+    //right hand side on its own, and if the right is empty too, theres still nothing there (a placemarker, in 6.10.5.3)
+    bool placemarker = false;
+
+    for (size_t i = 0; i < vec_len(list); i++) {
+        token tok = list[i];
+        if (tok.itype == CTOK_HASH_HASH) {
+            //handle_define made sure ## is never at either end
+            token right_op = list[++i];
+            Vec(token) right = vec_new(token, 1);
+            i64 param;
+            if (right_op.itype == CTOK_HASH && i + 1 < vec_len(list) && (param = pp_param_index(def, list[i + 1])) != -1) {
+                vec_append(&right, pp_stringize_arg(args[param], right_op, name));
                 i++;
-                if (i > vec_len(replacement_list)) break;
-                //is arg[i] == next token?
-                for (size_t j = 0; j < vec_len(potential_define.arguments); j++) {
-                    if (string_eq(potential_define.arguments[j].tok, replacement_list[i].tok)) {
-                        //we have an argument. get the index, and then stringize the whole token sequence
-                        Vec(token) arg_tokens = args[j];
-                        string stringised = pp_stringize_token_stream(arg_tokens);
-                        //now we have the stringised stream, we need to create a new token
-                        token str_tok = (token){.type = PPTOK_STR_LIT,
-                                                .tok = stringised,
-                                                .line = replaced_tok.line,
-                                                .from_macro_param = true};
-                        vec_insert(&replacement_list, i - 1, str_tok);
-                        //we delete the two tokens that caused this
-                        vec_remove_ordered(&replacement_list, i);
-                        vec_remove_ordered(&replacement_list, i);
-                        
-                        i--;
-                        break;
-                    }
-                }
-                continue;
+            } else if ((param = pp_param_index(def, right_op)) != -1) {
+                pp_append_tokens(&right, args[param], right_op.preceded_by_space, name);
+            } else {
+                right_op.line = name.line;
+                right_op.after_newline = false;
+                vec_append(&right, right_op);
             }
-        }
 
-        //then, we scan again, looking for identifiers to replace.
-        // TODO: replace _index
-        for_n(_index, 0, vec_len(replacement_list)) {
-            token* tok = &replacement_list[_index];
-            //printf("rl size: %d\n", replacement_list.len);
-            if (tok->type == PPTOK_IDENTIFIER) {
-                //this COULD be an argument. if it is, we replace it. otherwise, we just insert a normal token
-                if (_index > vec_len(replacement_list)) break;
-                //is arg[i] == next token?
-                for (size_t i = 0; i < vec_len(potential_define.arguments); i++) {
-                    if (string_eq(potential_define.arguments[i].tok, tok->tok) && tok->from_macro_param == false) {
-                        //we have an argument. get the index, and then repeatedly insert.
-                        Vec(token) arg_tokens = args[i];
-                        //remove the identifier that caused this
-                        vec_remove_ordered(&replacement_list, _index);
-
-                        for (size_t j = 0; j < vec_len(arg_tokens); j++) {
-                            token inserted_tok = arg_tokens[j];
-                            inserted_tok.from_macro_param = true;
-                            vec_insert(&replacement_list, j + _index, inserted_tok);
-                        }
-                        break;
-                    }
-
-                    else if (string_eq(tok->tok, strlit("__VA_ARGS__"))) {
-                        //we've got __VA_ARGS__
-                        //go to the index given by ... in the args list
-                        //if theres nothing there, we dont insert anything.
-
-                        vec_remove_ordered(&replacement_list, _index);  
-                        if (vec_len(potential_define.arguments) - 1 == vec_len(args)) break;
-
-                        Vec(token) arg_tokens = args[vec_len(args) - 1];
-
-                        for (size_t j = 0; j < vec_len(arg_tokens); j++) {
-                            token inserted_tok = arg_tokens[j];
-                            inserted_tok.from_macro_param = true;
-                            vec_insert(&replacement_list, j + _index, inserted_tok);
-                        }
-                        break;                        
-                    }
-                    else if (string_eq(tok->tok, strlit("__VA_OPT__"))) {
-                        print_parsing_error(ctx, *tok, "__VA_OPT__ not supported");
-                        return -1;
-                    }
-                }
-                continue;
+            if (placemarker || vec_len(result) == 0) {
+                pp_append_tokens(&result, right, vec_len(right) != 0 && right[0].preceded_by_space, name);
+                placemarker = vec_len(right) == 0;
+            } else if (vec_len(right) != 0) {
+                token pasted;
+                if (pp_paste(exp, result[vec_len(result) - 1], right[0], &pasted) != 0) return NULL;
+                result[vec_len(result) - 1] = pasted;
+                for_n(j, 1, vec_len(right)) vec_append(&result, right[j]);
+                placemarker = false;
             }
+            vec_destroy(&right);
+            continue;
         }
-        //now, we process concatenations
-        for_n(_index, 0, vec_len(replacement_list)) {
-            token* tok = &replacement_list[_index];
-            //this works specially, because we need to scan _ahead_ to HASH_HASH
-            //we skip whitespace between
-            if (tok->type == TOK_WHITESPACE) continue;
-            if (tok->itype != CTOK_HASH_HASH) {
-                bool is_concat = false;
-                size_t num_tok = _index + 1; // we need to know how many tokens to destroy from _index
-                for (; num_tok < vec_len(replacement_list); num_tok++) {
-                    token curr_tok = replacement_list[num_tok];
-                    if (curr_tok.itype == CTOK_HASH_HASH) {
-                        is_concat = true;
-                        continue;
-                    }
-                    if (curr_tok.type == TOK_WHITESPACE) continue;
-                    num_tok++;
-                    break;
-                }
-                if (!is_concat) continue;
 
-                token left = *tok;
-                token right = replacement_list[num_tok - 1];
-                //now, we clear the tokens
-                for (size_t i = _index; i < num_tok; i++) {
-                    vec_remove_ordered(&replacement_list, _index);
-                }
+        i64 param;
+        if (tok.itype == CTOK_HASH && i + 1 < vec_len(list) && (param = pp_param_index(def, list[i + 1])) != -1) {
+            vec_append(&result, pp_stringize_arg(args[param], tok, name));
+            placemarker = false;
+            i++;
+            continue;
+        }
 
-                //we can now create and check our concated token
-                //this will be tricky, since we need to detect that this is a valid symbol, and assign it an itype and a type.
-                //for now, we ignore these.
-                //lord, forgive me for what i'm about to do.
-                //since we dont have a consumption parser, we cant throw arbitrary tokens at something to verify their type.
-                //we instead need to fake a lexing step, so we pass a rudimentary context into phase 3, and then steal the
-                //token back at the end.
-                parser_ctx fake_ctx = {.logical_lines = vec_new(string, 1),
-                                       .ctx = ctx->ctx,
-                                       .tokens = vec_new(token, 1)};
-                vec_append(&fake_ctx.logical_lines, string_concat(left.tok, right.tok));
-
-                parser_phase3(&fake_ctx);
-                //steal the token back. we maintain ownership either way
-                token stolen_tok = fake_ctx.tokens[0];
-
-                token new_tok = (token){.tok = stolen_tok.tok,
-                                        .type = stolen_tok.type,
-                                        .itype = stolen_tok.itype,
-                                        .line = replaced_tok.line,
-                                        .from_macro_param = false};
-                vec_insert(&replacement_list, _index, new_tok);
+        if ((param = pp_param_index(def, tok)) != -1) {
+            if (i + 1 < vec_len(list) && list[i + 1].itype == CTOK_HASH_HASH) {
+                //left hand side of a ##, so its left alone
+                pp_append_tokens(&result, args[param], tok.preceded_by_space, name);
+                placemarker = vec_len(args[param]) == 0;
                 continue;
             }
+            if (expanded[param] == NULL) {
+                expanded[param] = pp_expand_list(exp, args[param]);
+                if (expanded[param] == NULL) return NULL;
+            }
+            pp_append_tokens(&result, expanded[param], tok.preceded_by_space, name);
+            placemarker = false;
+            continue;
         }
 
-        //we can now expand tokens that originated from this process, by creating a fake pctx
-        //we scan right to left to do this
-
-        for_n_reverse(i, vec_len(replacement_list), 0) {
-            token* tok = &replacement_list[i];
-            parser_ctx temp_ctx = {.tokens = replacement_list,
-                                   .logical_lines = ctx->logical_lines,
-                                   .ctx = ctx->ctx,
-                                   .defines = ctx->defines,
-                                   .curr_macro_name = *tok};
-            if (tok->type == PPTOK_IDENTIFIER && tok->from_macro_param == true) {
-                if (string_eq(tok->tok, ctx->curr_macro_name.tok)) continue;
-                if (pp_replace_ident(&temp_ctx, i) == -1) return -1;
-                //we need to update the replacement list with the temp_ctx's tokens
-                //replacement_list's old at pointer is completely invalid by this point,
-                //so we just need to update it.
-                replacement_list = temp_ctx.tokens;
-            }
+        tok.line = name.line;
+        tok.after_newline = false;
+        vec_append(&result, tok);
+        placemarker = false;
+    }
+
+    if (expanded != NULL) {
+        for_n(i, 0, vec_len(args)) {
+            if (expanded[i] != NULL) vec_destroy(&expanded[i]);
         }
+        cfree(expanded);
+    }
+    return result;
+}
 
-        //now, we can expand any OTHER tokens.
-        for_n_reverse(i, vec_len(replacement_list), 0) {
-            token* tok = &replacement_list[i];
-            parser_ctx temp_ctx = {.tokens = replacement_list,
-                                   .logical_lines = ctx->logical_lines,
-                                   .ctx = ctx->ctx,
-                                   .defines = ctx->defines,
-                                   .curr_macro_name = *tok};
-            if (tok->type == PPTOK_IDENTIFIER) {
-                if (string_eq(tok->tok, ctx->curr_macro_name.tok)) continue;
-                if (pp_replace_ident(&temp_ctx, i) == -1) return -1;
-            
-                //we need to update the replacement list with the temp_ctx's tokens
-                //replacement_list's old at pointer is completely invalid by this point,
-                //so we just need to update it.
-                replacement_list = temp_ctx.tokens;
-            }                
+bool pp_memo_scan(macro_table* table, u32 user, u32 atom, Vec(u32)* seen) {
+    //can what atom expands to be worked out once, wherever its used. thats true as long as nothing under it can
+    //reach past the end of its own tokens (a function-like macro could take its arguments from whatever comes
+    //next), or depends on where its used (__LINE__, __FILE__). ## is left out too, since it can fail.
+    //every name we read is something the answer depends on, so it gets user as a dependent
+    macro_define* def = macro_lookup(table, atom);
+    if (def == NULL) return true;
+    if (def->is_function) return false;
+    for_vec(token* tok, &def->replacement_list) {
+        if (tok->itype == CTOK_HASH_HASH) return false;
+        if (tok->type != PPTOK_IDENTIFIER) continue;
+        if (tok->atom == ATOM_LINE_MACRO || tok->atom == ATOM_FILE_MACRO) return false;
+        bool was_seen = false;
+        for_vec(u32* other, seen) {
+            if (*other == tok->atom) was_seen = true;
         }
+        if (was_seen) continue;
+        vec_append(seen, tok->atom);
+        macro_memo_depends(table, user, tok->atom);
+        if (!pp_memo_scan(table, user, tok->atom, seen)) return false;
+    }
+    return true;
+}
+
+macro_memo* pp_memo(pp_expander* exp, token tok, macro_define* def) {
+    //the memo for the object-like macro tok names, making it if we have to. NULL if it cant have one.
+    //only good while nothing is hidden, since a hidden name would expand differently in here
+    macro_table* table = exp->ctx->defines;
+    macro_memo* memo = macro_memo_of(table, tok.atom);
+    if (memo->known) return memo->expansion != NULL ? memo : NULL;
+    memo->known = true;
+
+    Vec(u32) seen = vec_new(u32, 16);
+    vec_append(&seen, tok.atom);
+    macro_memo_depends(table, tok.atom, tok.atom);
+    bool memoizable = pp_memo_scan(table, tok.atom, tok.atom, &seen);
+    vec_destroy(&seen);
+    if (!memoizable) return NULL;
+
+    //expand it on its own, the way pp_expand_ident would. whatever the invocation adds (its line, whether it had
+    //a space or a newline before it) gets put on at each use instead, so the first token is marked up to see
+    //where the invocation's newline would end up
+    Vec(token) list = pp_substitute(exp, def, NULL, tok);
+    if (vec_len(list) != 0) {
+        list[0].preceded_by_space = false;
+        list[0].after_newline = true;
+    }
+    pp_expander sub = {.ctx = exp->ctx,
+                       .frames = vec_new(pp_frame, 4),
+                       .out = vec_new(token, vec_len(list) + 1),
+                       .pending_space = false,
+                       .invocation = tok,
+                       .run_directives = false};
+    vec_append(&sub.frames, ((pp_frame){.tokens = list, .pos = 0, .hideset = hideset_add(0, tok.atom), .is_file = false, .header = NULL}));
+    //theres nothing in here that can fail, pp_memo_scan saw to that
+    if (pp_expand(&sub) != 0) crash("memoizing a macro failed to expand!");
+    vec_destroy(&sub.frames[0].tokens);
+    vec_destroy(&sub.frames);
+
+    memo = macro_memo_of(table, tok.atom);
+    memo->first_after_newline = vec_len(sub.out) != 0 && sub.out[0].after_newline;
+    memo->trailing_space = sub.pending_space;
+    if (vec_len(sub.out) != 0) sub.out[0].after_newline = false;
+    memo->expansion = sub.out;
+    return memo;
+}
+
+int pp_expand_ident(pp_expander* exp, token tok) {
+    //tok has already been read. gives back 1 if it was a macro and we've dealt with it, 0 if it should go out as is
+    if (pp_builtin(exp, &tok)) {
+        pp_emit(exp, tok);
+        return 1;
+    }
+
+    macro_define* def = macro_lookup(exp->ctx->defines, tok.atom);
+    if (def == NULL) return 0;
+    //tok was just read, so the frame on top is still the one it came from
+    if (hideset_contains(pp_curr_hideset(exp), tok.atom)) {
+        //we're inside this macros own expansion. the name is painted, so it stays as it is for good
+        tok.no_expand = true;
+        pp_emit(exp, tok);
+        return 1;
+    }
+
+    //the outermost macro is what __LINE__ reports, so remember it before anything nested takes over
+    //and -header-report counts the macros written in each header, not what they expand to, which depends on the memos
+    bool from_file = pp_in_file(exp);
+    if (from_file) exp->invocation = tok;
 
-        //finally, we put our replacement list into the source
-        for_n(i, 0, vec_len(replacement_list)) {
-            token tok = replacement_list[i];
-            vec_insert(&ctx->tokens, index + i, tok);
+    macro_memo* memo;
+    if (!def->is_function && pp_curr_hideset(exp) == 0 && (memo = pp_memo(exp, tok, def)) != NULL) {
+        //already expanded, so it goes straight out in one go
+        if (report_enabled && from_file) report_count_expansion();
+        size_t len = vec_len(memo->expansion);
+        if (len == 0) {
+            if (tok.preceded_by_space || memo->trailing_space) exp->pending_space = true;
+            return 1;
         }
+        pp_note_origin(exp);
+        size_t start = vec_len(exp->out);
+        token_splice(&exp->out, start, 0, memo->expansion, len);
+        for_n(i, start, start + len) exp->out[i].line = tok.line;
+        if (tok.preceded_by_space || exp->pending_space) exp->out[start].preceded_by_space = true;
+        exp->out[start].after_newline = memo->first_after_newline && tok.after_newline;
+        exp->pending_space = memo->trailing_space;
+        return 1;
+    }
 
-        //print_token_stream(ctx);
-        //return -1;
+    Vec(Vec(token)) args = NULL;
+    if (def->is_function) {
+        //a function-like macro name without a ( after it is just an identifier
+        token* next = pp_peek(exp);
+        if (next == NULL || next->itype != CTOK_OPEN_PAREN) return 0;
+        args = pp_collect_args(exp, def, tok);
+        if (args == NULL) return -1;
+    }
+    if (report_enabled && from_file) report_count_expansion();
 
+    Vec(token) expansion = pp_substitute(exp, def, args, tok);
+    if (expansion == NULL) return -1;
+    if (args != NULL) {
+        for_n(i, 0, vec_len(args)) vec_destroy(&args[i]);
+        vec_destroy(&args);
     }
-    //print_token_stream(ctx);
-    return 0;
+
+    if (vec_len(expansion) == 0) {
+        if (tok.preceded_by_space) exp->pending_space = true;
+        vec_destroy(&expansion);
+        return 1;
+    }
+    //the expansion sits where the macro name was, spacing included
+    expansion[0].preceded_by_space = tok.preceded_by_space;
+    expansion[0].after_newline = tok.after_newline;
+    pp_push_frame(exp, expansion, tok.atom);
+    return 1;
 }
 
-//TODO: add undef removal, see why stuff is BREAKING
+int pp_expand(pp_expander* exp) {
+    while (pp_peek(exp) != NULL) {
+        if (exp->errored) return -1;
+        bool in_file = pp_in_file(exp);
+        token tok = pp_next(exp);
+
+        //directives only count if they were written in a file, not if a macro made something that looks like one
+        if (exp->run_directives && in_file && tok.itype == CTOK_HASH && tok.after_newline == true) {
+            if (pp_directive(exp) != 0) return -1;
+            continue;
+        }
+
+        if (tok.type == PPTOK_IDENTIFIER && !tok.no_expand) {
+            int retval = pp_expand_ident(exp, tok);
+            if (retval == -1) return -1;
+            if (retval == 1) continue;
+        }
+        pp_emit(exp, tok);
+    }
+    return exp->errored ? -1 : 0;
+}
 
 #define skip_token(offset) do { \
     ctx->curr_tok_index += offset; \
@@ -443,262 +576,489 @@ int pp_replace_ident(parser_ctx* ctx, size_t index) {
 
 #define curr_token() ((ctx->curr_tok_index < vec_len(ctx->tokens)) ? ctx->tokens[ctx->curr_tok_index] : (token){})
 
-#define skip_whitespace() do { \
-    if (curr_token().type == TOK_WHITESPACE) ctx->curr_tok_index++; \
-} while(0)
-
-int parser_phase4(parser_ctx* ctx) {
-    //phase 4 is macro replacement, and also any relevant cleanup from phase 3, along with any error catching
-    //this means we're now doing errors, like for real this time
+bool pp_is_conditional(token name) {
+    if (name.type != PPTOK_IDENTIFIER) return false;
+    switch (name.atom) {
+        case ATOM_IF:
+        case ATOM_IFDEF:
+        case ATOM_IFNDEF:
+        case ATOM_ELIF:
+        case ATOM_ELIFDEF:
+        case ATOM_ELIFNDEF:
+        case ATOM_ELSE:
+        case ATOM_ENDIF:
+            return true;
+        default:
+            return false;
+    }
+}
 
-    //we dont ever actually use header names, since we never lex them properly
-    //either way, its directin time
+int pp_directive(pp_expander* exp) {
+    //the # has just been read off the file frame on top. for as long as the directive runs, ctx->tokens is that file,
+    //so the directive handlers can walk it with curr_tok_index like they always have.
+    //whatever they do, the whole line is gone from the output afterwards.
+    parser_ctx* ctx = exp->ctx;
+    //an #include pushes a frame, which can move the frames, so we hang onto where ours is rather than a pointer
+    size_t file_frame = vec_len(exp->frames) - 1;
+    Vec(token) file_tokens = exp->frames[file_frame].tokens;
+    Vec(token) saved_tokens = ctx->tokens;
+    ctx->tokens = file_tokens;
+
+    size_t hash_location = exp->frames[file_frame].pos - 1;
+    size_t hash_line = ctx->tokens[hash_location].line;
+    ctx->curr_tok_index = hash_location + 1;
+
+    //the file carries on after this line, unless the directive starts skipping a group, which moves it on further
+    size_t pos = hash_location + 1;
+    while (pos < vec_len(file_tokens) && file_tokens[pos].line == hash_line) pos++;
+    exp->frames[file_frame].pos = pos;
+
+    //same goes for the directive's line, unless its a conditional. those dont look past their name unless they're
+    //evaluated, and pp_eval_condition checks for itself then
+    if (hash_location + 1 < pos && !pp_is_conditional(file_tokens[hash_location + 1])) {
+        for_n(i, hash_location + 1, pos) {
+            if (file_tokens[i].type != PPTOK_BAD) continue;
+            ctx->tokens = saved_tokens;
+            return lex_explain(ctx, file_tokens[i]);
+        }
+    }
 
-    for_n(i, 0, vec_len(ctx->tokens)) {
-        ctx->curr_tok_index = i;
-        token* tok = &ctx->tokens[i];
+    int retval = 0;
+    //a # on its own is the null directive, and does nothing
+    if (ctx->curr_tok_index < vec_len(ctx->tokens) && curr_token().line == hash_line) {
+        retval = pp_run_directive(exp);
+    }
+    ctx->tokens = saved_tokens;
+    return retval;
+}
 
-        if (tok->itype == CTOK_HASH && tok->after_newline == true) {
-            size_t hash_location = ctx->curr_tok_index;
+int pp_run_directive(pp_expander* exp) {
+    parser_ctx* ctx = exp->ctx;
+    //directive names are all predefined atoms, so this is a switch rather than a string compare each
+    u32 directive = curr_token().type == PPTOK_IDENTIFIER ? curr_token().atom : ATOM_NONE;
+    switch (directive) {
+        //if group:
+        case ATOM_IF:
+            return handle_if(ctx, exp);
+        case ATOM_IFDEF:
+            return handle_ifdef(ctx, exp, false);
+        case ATOM_IFNDEF:
+            return handle_ifdef(ctx, exp, true);
+        case ATOM_ELIF:
+        case ATOM_ELIFDEF:
+        case ATOM_ELIFNDEF:
+        case ATOM_ELSE:
+            return handle_else(ctx, exp, directive);
+        case ATOM_ENDIF:
+            return handle_endif(ctx, exp);
+        //control line:
+        case ATOM_INCLUDE:
+            if (handle_include(ctx, exp) == -1) return -1;
+            return 0;
+        case ATOM_EMBED:
+            print_parsing_error(ctx, curr_token(), "TODO: embed");
+            return -1;
+        case ATOM_DEFINE:
+            return handle_define(ctx);
+        case ATOM_UNDEF:
+            //skip current token
             skip_token(1);
-            //we're in business, got a directive
-            //next, scan for the type
-            //first, check for ws
-            if (curr_token().type == TOK_WHITESPACE) skip_token(1);
-            //if group:
-            if (string_eq(curr_token().tok, strlit("if"))) {
-                print_parsing_error(ctx, curr_token(), "TODO: if (once constant expressions are done)");
-                return -1;
-            } else if (string_eq(curr_token().tok, strlit("ifdef")) || string_eq(curr_token().tok, strlit("ifndef"))) {
-                print_parsing_error(ctx, curr_token(), "TODO: ifdef");
-                return -1;
-            } 
-            //this is handled by ifdef parsing, and so these should be erroring
-            else if (string_eq(curr_token().tok, strlit("elif"))) {
-                print_parsing_error(ctx, curr_token(), "unexpected elif");
-                return -1;
-            } else if (string_eq(curr_token().tok, strlit("elifdef"))) {
-                print_parsing_error(ctx, curr_token(), "unexpected elifdef");
-                return -1;
-            } else if (string_eq(curr_token().tok, strlit("elifndef"))) {
-                print_parsing_error(ctx, curr_token(), "unexpected elifndef");
+            //then, if this isnt an identifier, we know we've got a syntax error
+            if (curr_token().type != PPTOK_IDENTIFIER || curr_token().line != ctx->tokens[ctx->curr_tok_index - 1].line) {
+                print_parsing_error(ctx, ctx->tokens[ctx->curr_tok_index - 1], "expected identifier after #undef");
                 return -1;
             }
-            else if (string_eq(curr_token().tok, strlit("else"))) {
-                print_parsing_error(ctx, curr_token(), "unexpected else");
-                return -1;
-            }
-            else if (string_eq(curr_token().tok, strlit("endif"))) {
-                print_parsing_error(ctx, curr_token(), "unexpected endif");
-                return -1;
-            }
-            //control line:
-            else if (string_eq(curr_token().tok, strlit("include"))) {
-                if (handle_include(ctx, hash_location) == -1) return -1;
-                i = ctx->curr_tok_index;
-                continue;
-            } else if (string_eq(curr_token().tok, strlit("embed"))) {
-                print_parsing_error(ctx, curr_token(), "TODO: embed");
-                return -1;
-            } else if (string_eq(curr_token().tok, strlit("define"))) {
-                if (handle_define(ctx) == -1) return -1;
-                i = ctx->curr_tok_index;
-                continue;
-            } else if (string_eq(curr_token().tok, strlit("undef"))) {
-                //skip current token and the following ws
-                skip_token(1);
-                skip_whitespace();
-                //then, if this isnt an identifier, we know we've got a syntax error
-                if (curr_token().type != PPTOK_IDENTIFIER) {
-                    print_parsing_error(ctx, curr_token(), "expected identifier after #undef");
-                    return -1;
-                }
-                //then, we search the defines list, and if we find this define, we remove it.
-                //if we dont find one, thats fine.
-                bool removed_define = false;
-                for_vec(macro_define* def, &ctx->defines) {
-                    if (!removed_define && string_eq(def->name.tok, curr_token().tok)) {
-                        vec_remove_ordered(&ctx->defines, ctx->curr_tok_index);
-                        removed_define = true;
-                    }
-                }
-                continue;
-            } else if (string_eq(curr_token().tok, strlit("line"))) {
-                print_parsing_error(ctx, curr_token(), "TODO: line");
-                return -1;
-            } else if (string_eq(curr_token().tok, strlit("warning"))) {
-                print_parsing_error(ctx, curr_token(), "TODO: warning");
-                return -1;
-            } else if (string_eq(curr_token().tok, strlit("error"))) {
-                print_parsing_error(ctx, curr_token(), "TODO: error");
-                return -1;
-            } else if (string_eq(curr_token().tok, strlit("pragma"))) {
-                skip_token(1); //skip pragma and ws
-                skip_whitespace();
-                if (string_eq(curr_token().tok, strlit("once"))) {
-                    //alright, we need to remove the tokens for #pragma<ws>once, and then also append it to this ctx.
-                    vec_append(&ctx->pragma_files, ctx->ctx->curr_file);
-                    continue;
-                } else {
-                    print_parsing_error(ctx, curr_token(), "unknown pragma");
-                    return -1;
-                }
+            //then, if this define exists, we remove it.
+            //if it doesnt, thats fine.
+            macro_remove(ctx->defines, curr_token().atom);
+            return 0;
+        case ATOM_LINE:
+            print_parsing_error(ctx, curr_token(), "TODO: line");
+            return -1;
+        case ATOM_WARNING:
+            print_parsing_error(ctx, curr_token(), "TODO: warning");
+            return -1;
+        case ATOM_ERROR:
+            print_parsing_error(ctx, curr_token(), "TODO: error");
+            return -1;
+        case ATOM_PRAGMA:
+            skip_token(1); //skip pragma
+            if (token_is_atom(curr_token(), ATOM_ONCE)) {
+                //the line gets dropped for us, so all thats left is to mark the header.
+                //the file being compiled only has one if its being made into a pch (see parser_phase4)
+                header_file* header = exp->frames[vec_len(exp->frames) - 1].header;
+                if (header != NULL) header->once = true;
+                return 0;
             } else {
-                print_parsing_error(ctx, curr_token(), "unknown directive "str_fmt, str_arg(curr_token().tok));
+                print_parsing_error(ctx, curr_token(), "unknown pragma");
                 return -1;
             }
-            
-        }
-        if (tok->type == PPTOK_IDENTIFIER) {
-            ctx->curr_macro_name = *tok;
-            if (pp_replace_ident(ctx, ctx->curr_tok_index) != 0) return -1;
-        }
+        default:
+            print_parsing_error(ctx, curr_token(), "unknown directive "str_fmt, str_arg(token_text(curr_token())));
+            return -1;
     }
+}
 
-    //now that we've processed all of the directives, and executed all macros, we can now delete _all_ directives
-    for_vec(token* tok, &ctx->tokens) {
-        if (tok->itype == CTOK_HASH && tok->after_newline == true) {
-            size_t directive_start = ctx->curr_tok_index;
-            //we now scan until we hit a new line
-            //we've filtered out all non-directives, so we can guarantee all of these lines will be directives.
-            size_t directive_end = ctx->curr_tok_index;
-            for (; directive_end < vec_len(ctx->tokens); directive_end++) {
-                if (tok->line != ctx->tokens[directive_end].line) break;
-            }
-            //we now have the number of tokens to iterate
-            //printf("deleting %d tokens\n", directive_end - directive_start);    
-            for (size_t i = 0; i < (directive_end - directive_start); i++) {
-                vec_remove_ordered(&ctx->tokens, ctx->curr_tok_index);
-            }
-            ctx->curr_tok_index--;
-        }
+int parser_phase4(parser_ctx* ctx) {
+    //phase 4 is macro replacement, and also any relevant cleanup from phase 3, along with any error catching
+    //this means we're now doing errors, like for real this time
+
+    //we dont ever actually use header names, since we never lex them properly
+    //either way, its directin time
+    pp_expander exp = {.ctx = ctx,
+                       .frames = vec_new(pp_frame, 16),
+                       .out = vec_new(token, vec_len(ctx->tokens) + 1),
+                       .pending_space = false,
+                       .run_directives = true,
+                       .conds = vec_new(pp_cond, 8),
+                       .errored = false,
+                       .origins = vec_new(pp_origin, 16),
+                       .visits = 1,
+                       .origin_visit = 0};
+    //a pch's header was, as far as anyone can tell, included before the first line
+    if (ctx->prelude != NULL) {
+        for_vec(pp_origin* origin, &ctx->prelude_origins) vec_append(&exp.origins, *origin);
+        token_splice(&exp.out, 0, 0, ctx->prelude, vec_len(ctx->prelude));
     }
+    //a header made into a pch can be included again by whoever uses the pch, so its #pragma once and guard have to
+    //go in the pch along with every other header's. that needs a record for it like any other header has
+    header_file* self = NULL;
+    if (ctx->ctx->emit_pch && (self = header_lookup(ctx, ctx->src->path)) != NULL) {
+        self->src = ctx->src;
+        self->guard = header_find_guard(ctx->tokens);
+    }
+    vec_append(&exp.frames, ((pp_frame){.tokens = ctx->tokens,
+                                        .pos = 0,
+                                        .hideset = 0,
+                                        .is_file = true,
+                                        .header = self,
+                                        .directives = pp_find_directives(ctx->tokens),
+                                        .cond_base = 0,
+                                        .visit = 1}));
+    //get the pool started on everything we can already tell the file includes
+    prefetch_includes(ctx, ctx->tokens, exp.frames[0].directives, include_dir_of(ctx->src->path));
+    if (pp_expand(&exp) != 0) return -1;
+    //the file we're compiling never gets popped, so its conditionals get checked here
+    if (vec_len(exp.conds) != 0) {
+        print_parsing_error(ctx, exp.conds[0].opener, "unterminated conditional directive");
+        return -1;
+    }
+    vec_destroy(&exp.frames[0].directives);
+    vec_destroy(&exp.frames);
+    vec_destroy(&exp.conds);
+
+    //directives never made it into the output, so whats left is ready for phase 5
+    vec_destroy(&ctx->tokens);
+    ctx->tokens = exp.out;
+    ctx->origins = exp.origins;
+    return 0;
+}
+
+string pp_includer_dir(pp_expander* exp) {
+    //where a "name" is looked for first, which is next to whichever file we're reading
+    header_file* includer = exp->frames[vec_len(exp->frames) - 1].header;
+    return include_dir_of(includer != NULL ? includer->src->path : exp->ctx->src->path);
+}
+
+int pp_header_name(parser_ctx* ctx, Vec(token) line, size_t* pos, string* name, bool* is_system) {
+    //reads a "name" or <name> starting at line[*pos], and moves *pos past it. gives back -1 if there isnt one
+    if (*pos >= vec_len(line)) {
+        print_parsing_error(ctx, vec_len(line) != 0 ? line[vec_len(line) - 1] : curr_token(), "expected \"header_name.h\" or <header_name.h>");
+        return -1;
+    }
+    token first = line[*pos];
+    if (first.type == PPTOK_STR_LIT) {
+        //easy! its a local header
+        //we trim the header to get rid of the "", and continue on
+        *name = string_make(token_text(first).raw + 1, token_text(first).len - 2);
+        *is_system = false;
+        (*pos)++;
+        return 0;
+    }
+    if (first.itype != CTOK_LESS_THAN) {
+        print_parsing_error(ctx, first, "expected \"header_name.h\" or <header_name.h>");
+        return -1;
+    }
+
+    //augh. system header.
+    //we need to start stitching.
+    //this is a quick and dirty custom string builder, and i HATE it.
+    size_t start = *pos + 1;
+    size_t len = 0;
+    size_t end = start;
+    for (; end < vec_len(line); end++) {
+        if (line[end].itype == CTOK_GREATER_THAN) break;
+        if (line[end].preceded_by_space && end != start) len++;
+        len += token_text(line[end]).len;
+    }
+    if (len == 0 || end == vec_len(line)) {
+        print_parsing_error(ctx, first, "expected header name");
+        return -1;
+    }
+    //now we know the length, we can allocate enough space for it.
+    *name = string_alloc(len);
+    //copy in the sections of the header split up
+    size_t cursor = 0;
+    for_n(i, start, end) {
+        //spaces inside <> are part of the name
+        if (line[i].preceded_by_space && i != start) name->raw[cursor++] = ' ';
+        memmove(name->raw + cursor, token_text(line[i]).raw, token_text(line[i]).len);
+        cursor += token_text(line[i]).len;
+    }
+    *is_system = true;
+    *pos = end + 1;
     return 0;
 }
 
-int handle_include(parser_ctx* ctx, size_t hash_location) {
+int handle_include(parser_ctx* ctx, pp_expander* exp) {
     //we've got an include!
-    //now, we need to skip the whitespace, and get onto the include.
+    //anything the prefetch threads have finished since the last one might include more, so get those going first
+    prefetch_harvest(ctx);
+
+    //now, we get onto the include.
+    token include_tok = curr_token();
+    size_t include_line = curr_token().line;
     skip_token(1);
-    skip_whitespace();
+
+    //grab the rest of the line, which is where the header name is
+    Vec(token) line = vec_new(token, 4);
+    for (; ctx->curr_tok_index < vec_len(ctx->tokens); ctx->curr_tok_index++) {
+        if (curr_token().line != include_line) break;
+        vec_append(&line, curr_token());
+    }
+    if (vec_len(line) == 0) {
+        print_parsing_error(ctx, ctx->tokens[ctx->curr_tok_index - 1], "expected \"header_name.h\" or <header_name.h>");
+        return -1;
+    }
 
     //now, we need to get onto the header itself
     //if we find a system header, we WILL need to do some stitching.
-    
     string header_name;
-    if (curr_token().type == PPTOK_IDENTIFIER) {
-        //we need to replace this JUST incase
-        if (pp_replace_ident(ctx, ctx->curr_tok_index) != 0) return -1;
+    bool is_system = false;
+    if (line[0].type == PPTOK_IDENTIFIER) {
+        //the header name comes out of a macro
+        Vec(token) expanded = pp_expand_list(exp, line);
+        if (expanded == NULL) return -1;
+        vec_destroy(&line);
+        line = expanded;
+        if (vec_len(line) == 0) {
+            print_parsing_error(ctx, ctx->tokens[ctx->curr_tok_index - 1], "expected \"header_name.h\" or <header_name.h>");
+            return -1;
+        }
     }
 
-    if (curr_token().type == PPTOK_STR_LIT) {
-        //easy! its a local header
-        //we trim the header to get rid of the "", and continue on
-        header_name = string_make(curr_token().tok.raw + 1, curr_token().tok.len - 2);
-    } else if (curr_token().itype == CTOK_LESS_THAN) {
-        //augh. system header.
-        //we need to start stitching.
-        //this is a quick and dirty custom string builder, and i HATE it.
-        skip_token(1); //skip <
-        size_t old_index = ctx->curr_tok_index; //for restoring later
-        
-        size_t len = 0;
-        for (; ctx->curr_tok_index < vec_len(ctx->tokens); ctx->curr_tok_index++) {
-            if (curr_token().itype == CTOK_GREATER_THAN) break;
-            len += curr_token().tok.len;
-        }
-        ctx->curr_tok_index = old_index;
-        if (len == 0) {
-            print_parsing_error(ctx, curr_token(), "expected header name");
-            return -1;
+    size_t pos = 0;
+    if (pp_header_name(ctx, line, &pos, &header_name, &is_system) != 0) return -1;
+    if (pos != vec_len(line)) {
+        print_parsing_warning(ctx, line[pos], "extra tokens at end of #include");
+    }
+    vec_destroy(&line);
+
+    //a "name" is looked for next to the file its included from first, which is whichever file frame we're in
+    header_file* header = include_resolve(ctx, header_name, is_system, pp_includer_dir(exp));
+    if (header == NULL) {
+        print_parsing_error(ctx, include_tok, "unable to open file "str_fmt, str_arg(header_name));
+        return -1;
+    }
+    if (header->once) return 0;
+    //a guarded header whose guard is still defined would come out empty, so we dont bother reading it
+    if (header->guard != 0 && macro_lookup(ctx->defines, header->guard) != NULL) return 0;
+    if (header_fill(ctx, header) != 0) return -1;
+    if (vec_len(header->tokens) == 0) {
+        //theres nothing to read, but it was still opened
+        if (report_enabled) {
+            report_open(header);
+            report_close();
         }
-        //now we know the length, we can allocate enough space for it.
-        header_name = string_alloc(len);
-        //copy in the sections of the header split up
-        size_t cursor = 0;
-        for (; ctx->curr_tok_index < vec_len(ctx->tokens); ctx->curr_tok_index++) {
-            if (curr_token().itype == CTOK_GREATER_THAN) break;
-            memmove(header_name.raw + cursor, curr_token().tok.raw, curr_token().tok.len);
-            cursor += curr_token().tok.len;
-        }                   
-    } else {
-        print_parsing_error(ctx, curr_token(), "expected \"header_name.h\" or <header_name.h>");
+        return 0;
+    }
+
+    size_t depth = 0;
+    for_vec(pp_frame* frame, &exp->frames) depth += frame->is_file;
+    if (depth > PP_MAX_INCLUDE_DEPTH) {
+        print_parsing_error(ctx, include_tok, "#include nested too deeply");
         return -1;
     }
 
-    //first, check if we've included this before, and if so, check pragma
-    for_vec(string* file, &ctx->pragma_files) {
-        //we've done this file before, we need to toss it.
-        printf("checking if we've done "str_fmt"before\n", str_arg(*file));
-        if (string_eq(*file, header_name)) return 0x1234;
+    //the header gets read next, as if it were written here. nothing is hidden in a file, so its hide set is empty
+    vec_append(&exp->frames, ((pp_frame){.tokens = header->tokens,
+                                         .pos = 0,
+                                         .hideset = 0,
+                                         .is_file = true,
+                                         .header = header,
+                                         .directives = header->directives,
+                                         .cond_base = vec_len(exp->conds),
+                                         .visit = ++exp->visits}));
+    if (report_enabled) report_open(header);
+    return 0;
+}
+
+// conditional inclusion. a group we're not reading is skipped without looking at anything but the directives in it,
+// which pp_find_directives found for us when the file was lexed, so skipping is a hop from one directive to the next
+// rather than a walk over every token. whichever directive ends the skip (an #elif, #else or #endif at the same
+// depth) is then run like any other, and decides if the next group is read.
+
+Vec(u32) pp_find_directives(Vec(token) tokens) {
+    //where every # that starts a line is. only those can start a directive
+    Vec(u32) directives = vec_new(u32, 16);
+    for_n(i, 0, vec_len(tokens)) {
+        if (tokens[i].itype == CTOK_HASH && tokens[i].after_newline) vec_append(&directives, i);
     }
+    return directives;
+}
 
-    //now, we parse this header, and add it to the list of included headers, just incase pragma once happens
-    //first, we create a new cobalt context
-    cobalt_ctx sub_cctx = {.curr_file = header_name,
-                           .no_colour = ctx->ctx->no_colour,
-                           .include_paths = ctx->ctx->include_paths};
-    printf("parsing include: "str_fmt"\n", str_arg(header_name));
-    //we then pass this into parse_file
-    int retval = parse_file(&sub_cctx, true);
-    if (retval != 0 && retval != 0x1234 /*pragma sentinel*/) return -1;
+bool pp_is_defined(parser_ctx* ctx, u32 atom) {
+    //__LINE__ and __FILE__ arent in the table, but theyre always defined. so are the operators only #if knows
+    if (atom == ATOM_LINE_MACRO || atom == ATOM_FILE_MACRO) return true;
+    if (atom == ATOM_HAS_INCLUDE || atom == ATOM_HAS_C_ATTRIBUTE) return true;
+    return macro_lookup(ctx->defines, atom) != NULL;
+}
 
-    //look into the pctx's pragma files, and append them to this one's pragma files
-    for_vec(string* file, &sub_cctx.pctx->pragma_files) {
-        vec_append(&ctx->pragma_files, *file);
+void pp_skip_group(pp_expander* exp) {
+    //moves the file frame on top to the next #elif, #elifdef, #elifndef, #else or #endif that belongs to the
+    //conditional we're in, skipping over any nested in the group. if theres none, it goes to the end of the file,
+    //and pp_pop_frame complains about it
+    pp_frame* frame = &exp->frames[vec_len(exp->frames) - 1];
+    Vec(token) tokens = frame->tokens;
+    Vec(u32) directives = frame->directives;
+
+    //binary search for the first directive past where we are
+    size_t low = 0;
+    size_t high = vec_len(directives);
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (directives[mid] < frame->pos) low = mid + 1;
+        else high = mid;
     }
 
-    size_t curr_line = curr_token().line;
-    //we can then, at THIS position in the file, remove the include and related tokens, and then insert these tokens
-    //we're at the end of the include, so now we just remove from hash_location to _index
-    for (size_t i = 0; i < (ctx->curr_tok_index - hash_location + 1); i++) {
-        vec_remove_ordered(&ctx->tokens, hash_location);
+    size_t depth = 0;
+    for (size_t i = low; i < vec_len(directives); i++) {
+        size_t hash = directives[i];
+        if (hash + 1 >= vec_len(tokens) || tokens[hash + 1].line != tokens[hash].line) continue;
+        token name = tokens[hash + 1];
+        if (name.type != PPTOK_IDENTIFIER) continue;
+        switch (name.atom) {
+            case ATOM_IF:
+            case ATOM_IFDEF:
+            case ATOM_IFNDEF:
+                depth++;
+                break;
+            case ATOM_ENDIF:
+                if (depth == 0) {
+                    frame->pos = hash;
+                    return;
+                }
+                depth--;
+                break;
+            case ATOM_ELIF:
+            case ATOM_ELIFDEF:
+            case ATOM_ELIFNDEF:
+            case ATOM_ELSE:
+                if (depth == 0) {
+                    frame->pos = hash;
+                    return;
+                }
+                break;
+        }
     }
+    frame->pos = vec_len(tokens);
+}
 
-    if (retval == 0x1234) return 0; //skip writing due to pragma
+int handle_if(parser_ctx* ctx, pp_expander* exp) {
+    token directive = curr_token();
+    bool taken;
+    if (pp_eval_condition(exp, &taken) != 0) return -1;
+    vec_append(&exp->conds, ((pp_cond){.opener = directive, .taken = taken, .seen_else = false}));
+    if (!taken) pp_skip_group(exp);
+    return 0;
+}
 
-    if (vec_len(sub_cctx.pctx->tokens) == 1) return 0;
+int handle_ifdef(parser_ctx* ctx, pp_expander* exp, bool negate) {
+    token directive = curr_token();
+    skip_token(1);
+    if (curr_token().type != PPTOK_IDENTIFIER || curr_token().line != directive.line) {
+        print_parsing_error(ctx, directive, "expected identifier after #"str_fmt, str_arg(token_text(directive)));
+        return -1;
+    }
+    if (next_token().line == directive.line && ctx->curr_tok_index + 1 < vec_len(ctx->tokens)) {
+        print_parsing_warning(ctx, next_token(), "extra tokens at end of #"str_fmt, str_arg(token_text(directive)));
+    }
 
-    //printf("\ninserting tokens for "str_fmt"\n", str_arg(header_name));
-    size_t read_line = sub_cctx.pctx->tokens[0].line;
-    for (size_t i = 0; i < vec_len(sub_cctx.pctx->tokens); i++) {
-        //fix up token, since it has broken line numbers
-        token inserted_tok = sub_cctx.pctx->tokens[i];
-        inserted_tok.was_included = true;
-        inserted_tok.included_from = header_name;
+    bool taken = pp_is_defined(ctx, curr_token().atom) != negate;
+    vec_append(&exp->conds, ((pp_cond){.opener = directive, .taken = taken, .seen_else = false}));
+    if (!taken) pp_skip_group(exp);
+    return 0;
+}
 
-        if (read_line != inserted_tok.line) {
-            read_line = inserted_tok.line;
-            curr_line++;
+int handle_else(parser_ctx* ctx, pp_expander* exp, u32 directive) {
+    //any of the ones that come between an #if and its #endif. we get here either at the end of a group we read, or
+    //at the end of a group we skipped
+    token name = curr_token();
+    if (vec_len(exp->conds) <= exp->frames[vec_len(exp->frames) - 1].cond_base) {
+        print_parsing_error(ctx, name, "#"str_fmt" without #if", str_arg(token_text(name)));
+        return -1;
+    }
+    pp_cond* cond = &exp->conds[vec_len(exp->conds) - 1];
+    if (cond->seen_else) {
+        print_parsing_error(ctx, name, "#"str_fmt" after #else", str_arg(token_text(name)));
+        return -1;
+    }
+
+    if (directive == ATOM_ELSE) {
+        cond->seen_else = true;
+        if (next_token().line == name.line && ctx->curr_tok_index + 1 < vec_len(ctx->tokens)) {
+            print_parsing_warning(ctx, next_token(), "extra tokens at end of #else");
         }
+        //the #else group gets read if nothing before it was
+        if (cond->taken) pp_skip_group(exp);
+        cond->taken = true;
+        return 0;
+    }
 
+    //once a group has been read, the condition on any after it doesnt matter, and isnt even looked at
+    if (cond->taken) {
+        pp_skip_group(exp);
+        return 0;
+    }
+    if (directive == ATOM_ELIF) {
+        bool taken;
+        if (pp_eval_condition(exp, &taken) != 0) return -1;
+        cond->taken = taken;
+        if (!taken) pp_skip_group(exp);
+        return 0;
+    }
 
-        //printf("inserting tok %d: "str_fmt"\n", inserted_tok.line, str_arg(inserted_tok.tok));
-        inserted_tok.line = curr_line;
-        vec_insert(&ctx->tokens, hash_location + i, inserted_tok);
+    skip_token(1);
+    if (curr_token().type != PPTOK_IDENTIFIER || curr_token().line != name.line) {
+        print_parsing_error(ctx, name, "expected identifier after #"str_fmt, str_arg(token_text(name)));
+        return -1;
     }
+    bool taken = pp_is_defined(ctx, curr_token().atom) != (directive == ATOM_ELIFNDEF);
+    cond->taken = taken;
+    if (!taken) pp_skip_group(exp);
+    return 0;
+}
 
+int handle_endif(parser_ctx* ctx, pp_expander* exp) {
+    token name = curr_token();
+    if (vec_len(exp->conds) <= exp->frames[vec_len(exp->frames) - 1].cond_base) {
+        print_parsing_error(ctx, name, "#endif without #if");
+        return -1;
+    }
+    if (next_token().line == name.line && ctx->curr_tok_index + 1 < vec_len(ctx->tokens)) {
+        print_parsing_warning(ctx, next_token(), "extra tokens at end of #endif");
+    }
+    vec_len(exp->conds)--;
     return 0;
 }
 
 int handle_define(parser_ctx* ctx) {
-    skip_token(1); //skip define and ws
-    skip_whitespace();
+    skip_token(1); //skip define
 
     if (curr_token().type != PPTOK_IDENTIFIER) {
         print_parsing_error(ctx, next_token(), "expected identifier");
         return -1;
     }
-    //we first need to check that the macro hasnt already been defined
-    //technically, this check violates 6.10.5.2, but it shouldnt come up much.
-    //FIXME?: is this valid?
-    
-    for_vec(macro_define* def, &ctx->defines) {
-        if (string_eq(def->name.tok, curr_token().tok)) {
-            print_parsing_error(ctx, curr_token(), "macro "str_fmt" already defined");
-            return -1;
-        }
-    }
     //start new macro define
     macro_define new_def = (macro_define){.name = curr_token(),
                                           .replacement_list = vec_new(token, 1),
@@ -706,31 +1066,28 @@ int handle_define(parser_ctx* ctx) {
 
     size_t curr_line = curr_token().line;
 
-    if (next_token().type != TOK_WHITESPACE && next_token().itype != CTOK_OPEN_PAREN) {
-        if (next_token().line != curr_token().line) {
-            //empty replacement lists still need defines
-            vec_append(&ctx->defines, new_def);
-            return 0;
-        }
+    if (ctx->curr_tok_index + 1 >= vec_len(ctx->tokens) || next_token().line != curr_token().line) {
+        //empty replacement lists still need defines
+        return pp_add_define(ctx, new_def);
+    }
+    //its only a function-like macro if the ( comes straight after the name
+    bool is_function = next_token().itype == CTOK_OPEN_PAREN && !next_token().preceded_by_space;
+    if (!is_function && !next_token().preceded_by_space) {
         print_parsing_warning(ctx, next_token(), "whitespace is required after a #define directive");
-    } else {
-        skip_token(1);
     }
-    //if (curr_token().type == TOK_WHITESPACE) _index++;
+    skip_token(1);
     
-    if (curr_token().itype == CTOK_OPEN_PAREN) {
+    if (is_function) {
         skip_token(1);
         new_def.is_function = true;
         //get argument list
         //first, we detect
         //"(" "..." ")"
-        skip_whitespace();
         if (curr_token().itype == CTOK_ELLIPSIS) {
             //add ellipsis to define, make define variadic
             new_def.is_variadic = true;
             vec_append(&new_def.arguments, curr_token());
             skip_token(1);
-            skip_whitespace();
             if (curr_token().itype != CTOK_CLOSE_PAREN) {
                 print_parsing_error(ctx, curr_token(), "expected )");
                 return -1;
@@ -749,13 +1106,10 @@ int handle_define(parser_ctx* ctx) {
         }
 
         for (; ctx->curr_tok_index < vec_len(ctx->tokens); ctx->curr_tok_index++) {
-            skip_whitespace();
             //we look ahead for ), ",", identifiers, or ...
             if (curr_token().itype == CTOK_CLOSE_PAREN) break;    
             if (curr_token().itype == CTOK_COMMA) {
                 //scan ahead for identifier, ..., or )
-                if (next_token().type == TOK_WHITESPACE) skip_token(1);
-
                 if (next_token().type == PPTOK_IDENTIFIER) continue;
                 if (next_token().itype == CTOK_CLOSE_PAREN) continue; 
                 if (next_token().itype == CTOK_ELLIPSIS) continue;
@@ -769,7 +1123,6 @@ int handle_define(parser_ctx* ctx) {
             if (curr_token().itype == CTOK_ELLIPSIS) {
                 token new_tok = curr_token();
                 skip_token(1);
-                skip_whitespace();
                 if (curr_token().itype != CTOK_CLOSE_PAREN) {
                     print_parsing_error(ctx, next_token(), "expected ) to end variadic function macro"); 
                     return -1;
@@ -781,30 +1134,40 @@ int handle_define(parser_ctx* ctx) {
             }
         }
         skip_token(1);
-        skip_whitespace();
-        //printf("curr tok after scanning #define: "str_fmt"\n", str_arg(curr_token().tok));
+        //printf("curr tok after scanning #define: "str_fmt"\n", str_arg(token_text(curr_token())));
     }
     //we continue until the line number changes
     for (; ctx->curr_tok_index < vec_len(ctx->tokens); ctx->curr_tok_index++) {
         if (curr_token().line != curr_line) break;
-        if (curr_token().type == TOK_WHITESPACE) {
-            //we're gonna cut down the whitespace to just a single character space.
-            //we need to directly manipulate the token stream here
-            ctx->tokens[ctx->curr_tok_index].tok.len = 1;
-        }
+        //any whitespace inside the list is already just a flag, and the spacing at the front gets replaced by
+        //whatever was in front of the macro name when it's expanded
         vec_append(&new_def.replacement_list, curr_token());
     }
 
-    //before we finish, we need to get rid of any trailing or following ws
-    //this should only be one tokens worth
-    if (vec_len(new_def.replacement_list) != 0 && new_def.replacement_list[vec_len(new_def.replacement_list) - 1].type == TOK_WHITESPACE) {        
-        vec_remove_ordered(&new_def.replacement_list, vec_len(new_def.replacement_list) - 1);
+    ctx->curr_tok_index--; //fix accidental overread
+    return pp_add_define(ctx, new_def);
+}
+
+int pp_add_define(parser_ctx* ctx, macro_define new_def) {
+    //6.10.5.3: ## needs something on both sides of it
+    size_t list_len = vec_len(new_def.replacement_list);
+    if (list_len != 0 && new_def.replacement_list[0].itype == CTOK_HASH_HASH) {
+        print_parsing_error(ctx, new_def.replacement_list[0], "'##' cannot appear at either end of a macro expansion");
+        return -1;
     }
-    if (vec_len(new_def.replacement_list) != 0 && new_def.replacement_list[0].type == TOK_WHITESPACE) {
-        vec_remove_ordered(&new_def.replacement_list, 0);
+    if (list_len != 0 && new_def.replacement_list[list_len - 1].itype == CTOK_HASH_HASH) {
+        print_parsing_error(ctx, new_def.replacement_list[list_len - 1], "'##' cannot appear at either end of a macro expansion");
+        return -1;
     }
 
-    ctx->curr_tok_index--; //fix accidental overread
-    vec_append(&ctx->defines, new_def);
+    //a macro can only be redefined to exactly the same thing it already was, in which case nothing changes
+    macro_define* old_def = macro_lookup(ctx->defines, new_def.name.atom);
+    if (old_def != NULL) {
+        if (macro_same_definition(old_def, &new_def)) return 0;
+        print_parsing_error(ctx, new_def.name, "macro "str_fmt" already defined", str_arg(token_text(new_def.name)));
+        return -1;
+    }
+    macro_add(ctx->defines, new_def);
+    if (report_enabled) report_count_macro();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "alloc.h"
+#include "cobalt.h"
+#include "crash.h"
+#include "parse.h"
+
+#include "common/str.h"
+#include "common/util.h"
+#include "common/vec.h"
+
+// -header-report=file.json. every header handle_include opens gets an entry, open for as long as phase 4 is reading
+// it, with what it cost: how big it was, how many tokens it lexed to, how many macros it defined and expanded, and
+// how long lexing and preprocessing it took. the counts are the header's own, with everything it included (in turn)
+// added up separately. the phases of the whole translation unit, and every header lexed on a prefetch thread, get
+// an event too.
+//
+// it comes out as chrome's trace event json, so it can be opened in chrome://tracing or perfetto. includes nest inside
+// phase 4 the way they did in the source, and prefetch lexing shows up on its own threads.
+
+typedef struct {
+    header_file* header;
+    //index of the entry that included this one, plus one. 0 if it was the file we were asked to compile
+    u32 parent;
+    u64 start;
+    u64 end;
+    u32 macros;
+    u32 expansions;
+    u32 macros_total;
+    u32 expansions_total;
+} report_entry;
+
+typedef struct {
+    char* name;
+    header_file* header;
+    u64 start;
+    u64 end;
+    u32 thread;
+} report_span;
+
+bool report_enabled = false;
+u64 report_epoch = 0;
+Vec(report_entry) report_entries = NULL;
+//the entries phase 4 is inside of right now, innermost last
+Vec(u32) report_stack = NULL;
+Vec(report_span) report_spans = NULL;
+string report_main_file = {0};
+
+u64 report_now() {
+    //in nanoseconds. fine to call from any thread
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void report_start(cobalt_ctx* ctx) {
+    report_enabled = true;
+    report_epoch = report_now();
+    report_entries = vec_new(report_entry, 64);
+    report_stack = vec_new(u32, 16);
+    report_spans = vec_new(report_span, 64);
+    report_main_file = ctx->curr_file;
+}
+
+int report_phase(parser_ctx* ctx, char* name, int (*phase)(parser_ctx*)) {
+    //runs phase, and times it if anyone asked
+    if (!report_enabled) return phase(ctx);
+    u64 start = report_now();
+    int retval = phase(ctx);
+    vec_append(&report_spans, ((report_span){.name = name, .header = NULL, .start = start, .end = report_now(), .thread = 1}));
+    return retval;
+}
+
+void report_lexed(header_file* header, u64 start, u64 end, u32 thread) {
+    header->lex_ns = end - start;
+    vec_append(&report_spans, ((report_span){.name = "lex", .header = header, .start = start, .end = end, .thread = thread}));
+}
+
+void report_open(header_file* header) {
+    //phase 4 has started reading header
+    u32 parent = vec_len(report_stack) != 0 ? report_stack[vec_len(report_stack) - 1] + 1 : 0;
+    vec_append(&report_entries, ((report_entry){.header = header, .parent = parent, .start = report_now()}));
+    vec_append(&report_stack, vec_len(report_entries) - 1);
+}
+
+void report_close() {
+    //and now its done with the innermost header. what it cost gets added to whoever included it
+    report_entry* entry = &report_entries[report_stack[--vec_len(report_stack)]];
+    entry->end = report_now();
+    entry->macros_total += entry->macros;
+    entry->expansions_total += entry->expansions;
+    if (entry->parent != 0) {
+        report_entries[entry->parent - 1].macros_total += entry->macros_total;
+        report_entries[entry->parent - 1].expansions_total += entry->expansions_total;
+    }
+}
+
+void report_count_macro() {
+    if (vec_len(report_stack) != 0) report_entries[report_stack[vec_len(report_stack) - 1]].macros++;
+}
+
+void report_count_expansion() {
+    if (vec_len(report_stack) != 0) report_entries[report_stack[vec_len(report_stack) - 1]].expansions++;
+}
+
+void report_json_string(FILE* out, string str) {
+    fputc('"', out);
+    for_n(i, 0, str.len) {
+        u8 c = str.raw[i];
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+void report_event(FILE* out, bool* first, string name, char* category, u64 start, u64 end, u32 thread) {
+    //the start of a complete event. chrome wants microseconds, relative to whenever it likes
+    fprintf(out, "%s\n{\"name\":", *first ? "" : ",");
+    *first = false;
+    report_json_string(out, name);
+    fprintf(out, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u",
+            category, (start - report_epoch) / 1000.0, (end - start) / 1000.0, thread);
+}
+
+int report_write(string path) {
+    if (!report_enabled) return 0;
+    //writes out everything we've seen. anything phase 4 was still in the middle of (it errored) ends now
+    while (vec_len(report_stack) != 0) report_close();
+    FILE* out = fopen(clone_to_cstring(path), "w");
+    if (out == NULL) {
+        printf("unable to open "str_fmt" for writing\n", str_arg(path));
+        return -1;
+    }
+
+    bool first = true;
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    u32 threads = 1;
+    for_vec(report_span* span, &report_spans) {
+        if (span->thread > threads) threads = span->thread;
+    }
+    for_n(thread, 1, threads + 1) {
+        fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", first ? "" : ",", thread);
+        first = false;
+        report_json_string(out, thread == 1 ? strlit("main") : strprintf("prefetch %u", thread - 1));
+        fprintf(out, "}}");
+    }
+
+    for_vec(report_span* span, &report_spans) {
+        if (span->header == NULL) {
+            report_event(out, &first, string_make(span->name, strlen(span->name)), "phase", span->start, span->end, span->thread);
+        } else {
+            report_event(out, &first, strprintf("lex "str_fmt, str_arg(span->header->path)), "lex", span->start, span->end, span->thread);
+            fprintf(out, ",\"args\":{\"bytes\":%zu}", span->header->src->buf.len);
+        }
+        fprintf(out, "}");
+    }
+
+    for_vec(report_entry* entry, &report_entries) {
+        header_file* header = entry->header;
+        report_event(out, &first, header->path, "include", entry->start, entry->end, 1);
+        //the chain goes from the file we were asked to compile down to this header
+        fprintf(out, ",\"args\":{\"chain\":[");
+        report_json_string(out, report_main_file);
+        Vec(header_file*) chain = vec_new(header_file*, 8);
+        for (u32 at = entry - report_entries + 1; at != 0; at = report_entries[at - 1].parent) {
+            vec_append(&chain, report_entries[at - 1].header);
+        }
+        for (size_t i = vec_len(chain); i > 0; i--) {
+            fprintf(out, ",");
+            report_json_string(out, chain[i - 1]->path);
+        }
+        vec_destroy(&chain);
+        fprintf(out, "],\"bytes\":%zu,\"tokens\":%zu,\"macros_defined\":%u,\"macros_defined_total\":%u,"
+                     "\"expansions\":%u,\"expansions_total\":%u,\"lex_us\":%.3f,\"preprocess_us\":%.3f}}",
+                header->src->buf.len, vec_len(header->tokens), entry->macros, entry->macros_total,
+                entry->expansions, entry->expansions_total, header->lex_ns / 1000.0, (entry->end - entry->start) / 1000.0);
+    }
+    fprintf(out, "\n]}\n");
+
+    bool failed = ferror(out);
+    if (fclose(out) != 0) failed = true;
+    if (failed) printf("unable to write "str_fmt"\n", str_arg(path));
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,174 @@
+#if defined(__x86_64__) || defined(__i386__)
+#    define SCAN_X86
+#    include <immintrin.h>
+#endif
+
+#include "scan.h"
+
+#define IDENT_CHARS(x) \
+    x('a') x('b') x('c') x('d') x('e') x('f') x('g') x('h') x('i') x('j') x('k') x('l') x('m') \
+    x('n') x('o') x('p') x('q') x('r') x('s') x('t') x('u') x('v') x('w') x('x') x('y') x('z') \
+    x('A') x('B') x('C') x('D') x('E') x('F') x('G') x('H') x('I') x('J') x('K') x('L') x('M') \
+    x('N') x('O') x('P') x('Q') x('R') x('S') x('T') x('U') x('V') x('W') x('X') x('Y') x('Z') \
+    x('_')
+
+#define DIGIT_CHARS(x) x('0') x('1') x('2') x('3') x('4') x('5') x('6') x('7') x('8') x('9')
+
+const u8 lex_char_class[256] = {
+#define CLASS(c) [c] = CHAR_IDENT_START | CHAR_IDENT,
+    IDENT_CHARS(CLASS)
+#undef CLASS
+#define CLASS(c) [c] = CHAR_IDENT | CHAR_DIGIT,
+    DIGIT_CHARS(CLASS)
+#undef CLASS
+    [' '] = CHAR_SPACE,
+    ['\t'] = CHAR_SPACE,
+    ['\r'] = CHAR_SPACE,
+    ['\f'] = CHAR_SPACE,
+};
+
+/* scalar versions. these are the fallback, and also handle the tails of the vector versions. */
+
+size_t scan_whitespace_scalar(const char* buf, size_t len) {
+    size_t i = 0;
+    while (i < len && lex_is_space(buf[i])) i++;
+    return i;
+}
+
+size_t scan_ident_scalar(const char* buf, size_t len) {
+    size_t i = 0;
+    while (i < len && lex_is_ident(buf[i])) i++;
+    return i;
+}
+
+size_t scan_block_comment_scalar(const char* buf, size_t len) {
+    size_t i = 0;
+    while (i < len && buf[i] != '*' && buf[i] != '\n' && buf[i] != '\\') i++;
+    return i;
+}
+
+size_t scan_line_comment_scalar(const char* buf, size_t len) {
+    size_t i = 0;
+    while (i < len && buf[i] != '\n' && buf[i] != '\\') i++;
+    return i;
+}
+
+#ifdef SCAN_X86
+
+/* sse2 is part of the x86_64 baseline, so these dont need a target attribute there.
+   each one builds a mask of the bytes that are IN the run, and stops at the first zero bit. */
+
+// unsigned lo <= c <= hi, done with signed compares since thats all sse2 has
+#define sse_in_range(v, lo, hi) \
+    _mm_cmplt_epi8(_mm_add_epi8((v), _mm_set1_epi8((char)(0x80 - (lo)))), _mm_set1_epi8((char)(-128 + ((hi) - (lo) + 1))))
+
+#define sse_scan(buf, len, tail, mask_expr) \
+    size_t i = 0; \
+    for (; i + 16 <= (len); i += 16) { \
+        __m128i v = _mm_loadu_si128((const __m128i*)((buf) + i)); \
+        u32 in_run = (u32)_mm_movemask_epi8(mask_expr); \
+        if (in_run != 0xFFFF) return i + __builtin_ctz(~in_run); \
+    } \
+    return i + tail((buf) + i, (len) - i);
+
+__attribute__((target("sse2")))
+size_t scan_whitespace_sse2(const char* buf, size_t len) {
+    sse_scan(buf, len, scan_whitespace_scalar,
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+                     _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\f')))));
+}
+
+__attribute__((target("sse2")))
+size_t scan_ident_sse2(const char* buf, size_t len) {
+    //folding case with | 0x20 only ever lands A-Z and a-z in a-z, so one range check covers both
+    sse_scan(buf, len, scan_ident_scalar,
+        _mm_or_si128(_mm_or_si128(sse_in_range(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z'), sse_in_range(v, '0', '9')),
+                     _mm_cmpeq_epi8(v, _mm_set1_epi8('_'))));
+}
+
+__attribute__((target("sse2")))
+size_t scan_block_comment_sse2(const char* buf, size_t len) {
+    sse_scan(buf, len, scan_block_comment_scalar,
+        _mm_andnot_si128(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('*')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))),
+                                      _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+                         _mm_set1_epi8((char)0xFF)));
+}
+
+__attribute__((target("sse2")))
+size_t scan_line_comment_sse2(const char* buf, size_t len) {
+    sse_scan(buf, len, scan_line_comment_scalar,
+        _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))),
+                         _mm_set1_epi8((char)0xFF)));
+}
+
+/* avx2 versions, same deal but 32 bytes at a time. the tails fall back to sse2. */
+
+#define avx_in_range(v, lo, hi) \
+    _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(-128 + ((hi) - (lo) + 1))), _mm256_add_epi8((v), _mm256_set1_epi8((char)(0x80 - (lo)))))
+
+#define avx_scan(buf, len, tail, mask_expr) \
+    size_t i = 0; \
+    for (; i + 32 <= (len); i += 32) { \
+        __m256i v = _mm256_loadu_si256((const __m256i*)((buf) + i)); \
+        u32 in_run = (u32)_mm256_movemask_epi8(mask_expr); \
+        if (in_run != 0xFFFFFFFF) return i + __builtin_ctz(~in_run); \
+    } \
+    return i + tail((buf) + i, (len) - i);
+
+__attribute__((target("avx2")))
+size_t scan_whitespace_avx2(const char* buf, size_t len) {
+    avx_scan(buf, len, scan_whitespace_sse2,
+        _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+                        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\f')))));
+}
+
+__attribute__((target("avx2")))
+size_t scan_ident_avx2(const char* buf, size_t len) {
+    avx_scan(buf, len, scan_ident_sse2,
+        _mm256_or_si256(_mm256_or_si256(avx_in_range(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 'z'), avx_in_range(v, '0', '9')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'))));
+}
+
+__attribute__((target("avx2")))
+size_t scan_block_comment_avx2(const char* buf, size_t len) {
+    avx_scan(buf, len, scan_block_comment_sse2,
+        _mm256_andnot_si256(_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('*')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))),
+                                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+                            _mm256_set1_epi8((char)0xFF)));
+}
+
+__attribute__((target("avx2")))
+size_t scan_line_comment_avx2(const char* buf, size_t len) {
+    avx_scan(buf, len, scan_line_comment_sse2,
+        _mm256_andnot_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+                            _mm256_set1_epi8((char)0xFF)));
+}
+
+#endif
+
+//left empty until lex_scan_init, so the lexer can tell if its been called yet
+lex_scanners lex_scan = {0};
+
+void lex_scan_init() {
+    lex_scan = (lex_scanners){.whitespace = scan_whitespace_scalar,
+                              .ident = scan_ident_scalar,
+                              .block_comment = scan_block_comment_scalar,
+                              .line_comment = scan_line_comment_scalar,
+                              .name = "scalar"};
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        lex_scan = (lex_scanners){.whitespace = scan_whitespace_avx2,
+                                  .ident = scan_ident_avx2,
+                                  .block_comment = scan_block_comment_avx2,
+                                  .line_comment = scan_line_comment_avx2,
+                                  .name = "avx2"};
+    } else if (__builtin_cpu_supports("sse2")) {
+        lex_scan = (lex_scanners){.whitespace = scan_whitespace_sse2,
+                                  .ident = scan_ident_sse2,
+                                  .block_comment = scan_block_comment_sse2,
+                                  .line_comment = scan_line_comment_sse2,
+                                  .name = "sse2"};
+    }
+#endif
+}
@@ -0,0 +1,42 @@
+#pragma once
+#define SCAN_H
+
+#include <stddef.h>
+
+#include "common/type.h"
+
+// bulk scanners for the hot loops in phase 3.
+// each one returns how many bytes from the start of buf belong to the run its looking for,
+// and never reads past len. the lexer handles whatever byte made it stop.
+
+typedef struct {
+    // ' ' '\t' '\r' '\f'
+    size_t (*whitespace)(const char* buf, size_t len);
+    // [a-zA-Z0-9_]
+    size_t (*ident)(const char* buf, size_t len);
+    // anything but '*' '\n' '\\', which is everything we can step over inside a /* */
+    size_t (*block_comment)(const char* buf, size_t len);
+    // anything but '\n' '\\', for // comments
+    size_t (*line_comment)(const char* buf, size_t len);
+    char* name;
+} lex_scanners;
+
+extern lex_scanners lex_scan;
+
+// picks the widest implementation the cpu we're running on supports
+void lex_scan_init();
+
+// locale independent replacements for the ctype classifiers
+enum {
+    CHAR_IDENT_START = 1 << 0,
+    CHAR_IDENT = 1 << 1,
+    CHAR_DIGIT = 1 << 2,
+    CHAR_SPACE = 1 << 3,
+};
+
+extern const u8 lex_char_class[256];
+
+#define lex_is_ident_start(c) (lex_char_class[(u8)(c)] & CHAR_IDENT_START)
+#define lex_is_ident(c) (lex_char_class[(u8)(c)] & CHAR_IDENT)
+#define lex_is_digit(c) (lex_char_class[(u8)(c)] & CHAR_DIGIT)
+#define lex_is_space(c) (lex_char_class[(u8)(c)] & CHAR_SPACE)
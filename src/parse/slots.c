@@ -0,0 +1,51 @@
+#include "alloc.h"
+#include "cobalt.h"
+#include "crash.h"
+#include "parse.h"
+
+#include "common/str.h"
+#include "common/util.h"
+#include "common/vec.h"
+
+// the hash table every one of our lookup tables (atoms, hide sets, macros, headers, include names) sits on.
+// its open addressing with linear probing, and all it holds is a u32 id per slot, along with the hash it went in
+// under. what an id means, and whether it's the one being looked for, is up to whoever owns the table. keeping the
+// hash means growing never has to ask, and most slots that arent the one get turned away without asking either.
+// the load stays under a half, so probes stay short.
+
+#define SLOT_TABLE_MIN_SIZE 256
+
+void slot_grow(slot_table* table) {
+    size_t new_count = table->count == 0 ? SLOT_TABLE_MIN_SIZE : table->count * 2;
+    slot* new_slots = ccharalloc(new_count * sizeof(slot), 0);
+    for_n(i, 0, table->count) {
+        slot old = table->slots[i];
+        if (old.id == 0) continue;
+        size_t index = old.hash & (new_count - 1);
+        while (new_slots[index].id != 0) index = (index + 1) & (new_count - 1);
+        new_slots[index] = old;
+    }
+    if (table->slots != NULL) cfree(table->slots);
+    table->slots = new_slots;
+    table->count = new_count;
+}
+
+slot* slot_find(slot_table* table, u32 hash, slot_match match, void* key) {
+    //gives back the slot of the entry that matches key, or the empty slot it would go in if theres no such entry.
+    //match can be NULL if no two entries ever have the same hash, and then the hash is all we look at
+    if (table->count == 0) slot_grow(table);
+    size_t index = hash & (table->count - 1);
+    for (; table->slots[index].id != 0; index = (index + 1) & (table->count - 1)) {
+        slot* at = &table->slots[index];
+        if (at->hash == hash && (match == NULL || match(key, at->id))) return at;
+    }
+    return &table->slots[index];
+}
+
+void slot_add(slot_table* table, slot* at, u32 hash, u32 id) {
+    //fills in the empty slot slot_find gave back. at is no good afterwards, since the table might have grown
+    if (id == 0) crash("tried to put id 0 in a slot table!");
+    *at = (slot){.hash = hash, .id = id};
+    table->used++;
+    if (table->used * 2 > table->count) slot_grow(table);
+}
@@ -0,0 +1,195 @@
+#ifndef __WIN32__
+#    include <sys/mman.h>
+#endif
+
+#include "alloc.h"
+#include "cobalt.h"
+#include "crash.h"
+#include "parse.h"
+
+#include "common/fs.h"
+#include "common/str.h"
+#include "common/util.h"
+#include "common/vec.h"
+
+// source files own the raw bytes of whatever we're lexing.
+// every line, and by extension every token, is a view into this buffer, so we never hand it back.
+// its mapped MAP_PRIVATE and read-only, so if anyone tries to mutate a token in place, we'll know about it.
+
+// every source we open also gets a slice of one big 32 bit location space, starting at its base.
+// tokens only carry a location and a length, and this table is how we get back to the text.
+// text that doesnt exist in any file (pastes, stringised args, merged strings) goes into scratch chunks,
+// which are just sources with no file behind them.
+
+Vec(source_file*) source_files = NULL;
+//the last file we looked a location up in. tokens tend to come in long runs from the same file
+source_file* source_last_hit = NULL;
+//next free location. 0 is never handed out, so a zeroed token doesnt point at anything
+u32 source_next_base = 1;
+
+#define SCRATCH_CHUNK_SIZE (64 * 1024)
+source_file* scratch_chunk = NULL;
+size_t scratch_used = 0;
+
+void source_register(source_file* src) {
+    if (source_files == NULL) source_files = vec_new(source_file*, 16);
+    if ((u64)source_next_base + src->buf.len + 1 > UINT32_MAX) crash("ran out of source locations! how big is this translation unit?");
+    src->base = source_next_base;
+    //the +1 keeps a location for the end of each file, so an empty file still gets its own
+    source_next_base += src->buf.len + 1;
+    vec_append(&source_files, src);
+}
+
+source_file* source_for_loc(u32 loc) {
+    if (source_last_hit != NULL && loc >= source_last_hit->base && loc <= source_last_hit->base + source_last_hit->buf.len) {
+        return source_last_hit;
+    }
+    //files are registered in order, so their bases are sorted
+    size_t lo = 0;
+    size_t hi = vec_len(source_files);
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (source_files[mid]->base <= loc) lo = mid;
+        else hi = mid;
+    }
+    if (vec_len(source_files) == 0 || loc < source_files[lo]->base) crash("location %u doesnt belong to any source file!", loc);
+    source_last_hit = source_files[lo];
+    return source_last_hit;
+}
+
+u32 source_scratch(string text) {
+    if (scratch_chunk == NULL || scratch_used + text.len > scratch_chunk->buf.len) {
+        //anything bigger than a chunk gets a chunk all to itself
+        size_t size = text.len > SCRATCH_CHUNK_SIZE ? text.len : SCRATCH_CHUNK_SIZE;
+        scratch_chunk = cmalloc(sizeof(*scratch_chunk));
+        *scratch_chunk = (source_file){.path = strlit("<scratch>"),
+                                       .buf = string_alloc(size),
+                                       .is_mapped = false,
+                                       .is_scratch = true};
+        source_register(scratch_chunk);
+        scratch_used = 0;
+    }
+    memcpy(scratch_chunk->buf.raw + scratch_used, text.raw, text.len);
+    u32 loc = scratch_chunk->base + scratch_used;
+    scratch_used += text.len;
+    return loc;
+}
+
+string token_text(token tok) {
+    if (tok.type == PPTOK_IDENTIFIER) return atom_str(tok.atom);
+    if (tok.len == 0) return strlit("");
+    source_file* src = source_for_loc(tok.loc);
+    return string_make(src->buf.raw + (tok.loc - src->base), tok.len);
+}
+
+string token_source_text(token tok) {
+    //same text as token_text, but always the copy sitting at the token's location.
+    //an identifier's atom points at wherever it was first seen, which is no good for pointing at this one
+    string text = token_text(tok);
+    if (tok.loc == 0) return text;
+    source_file* src = source_for_loc(tok.loc);
+    return string_make(src->buf.raw + (tok.loc - src->base), text.len);
+}
+
+source_file* source_open(string path) {
+    FsFile* file = fs_open(clone_to_cstring(path), false, false);
+    if (file == NULL) return NULL;
+
+    source_file* src = cmalloc(sizeof(*src));
+    *src = (source_file){.path = path,
+                         .buf = {.raw = NULL, .len = 0},
+                         .is_mapped = false};
+
+    //mmap doesnt like zero length mappings, and theres nothing to read anyway
+    if (file->size == 0) {
+        fs_close(file);
+        source_register(src);
+        return src;
+    }
+
+#ifndef __WIN32__
+    void* mapping = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, file->handle, 0);
+    if (mapping != MAP_FAILED) {
+        src->buf = string_make(mapping, file->size);
+        src->is_mapped = true;
+        //the mapping outlives the handle, so we dont need to keep it around
+        fs_close(file);
+        source_register(src);
+        return src;
+    }
+#endif
+
+    //no mmap (or it failed on something like a pipe), so we just read it in
+    src->buf = string_alloc(file->size);
+    fs_read(file, src->buf.raw, src->buf.len);
+    fs_close(file);
+    source_register(src);
+    return src;
+}
+
+// line numbers are only worked out when something asks for one, which is a diagnostic or __LINE__.
+// the first time that happens for a file, we find every \n in it once, and from then on its a binary search.
+// a file that compiles cleanly never gets a table at all.
+
+void source_build_lines(source_file* src) {
+    src->line_starts = vec_new(u32, 64);
+    vec_append(&src->line_starts, 0);
+    char* cursor = src->buf.raw;
+    char* end = src->buf.raw + src->buf.len;
+    while (cursor < end) {
+        char* newline = memchr(cursor, '\n', end - cursor);
+        if (newline == NULL) break;
+        cursor = newline + 1;
+        vec_append(&src->line_starts, (u32)(cursor - src->buf.raw));
+    }
+}
+
+u32 source_line_of(source_file* src, u32 offset) {
+    //physical line, counting from 0
+    if (src->line_starts == NULL) source_build_lines(src);
+    size_t lo = 0;
+    size_t hi = vec_len(src->line_starts);
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (src->line_starts[mid] <= offset) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+u32 source_physical_line(source_file* src, u32 logical) {
+    //tokens only know their logical line, which is a line with every splice in it joined up. this is the physical
+    //line it starts on. the table is built the first time, from the physical lines: a line that comes right after a
+    //\ and \n is the rest of the one before it, so it doesnt start a logical line of its own
+    if (src->logical_starts == NULL) {
+        if (src->line_starts == NULL) source_build_lines(src);
+        src->logical_starts = vec_new(u32, vec_len(src->line_starts));
+        vec_append(&src->logical_starts, 0);
+        for_n(line, 1, vec_len(src->line_starts)) {
+            u32 start = src->line_starts[line];
+            if (start >= 2 && src->buf.raw[start - 2] == '\\') continue;
+            vec_append(&src->logical_starts, line);
+        }
+    }
+    if (logical >= vec_len(src->logical_starts)) return src->logical_starts[vec_len(src->logical_starts) - 1];
+    return src->logical_starts[logical];
+}
+
+u32 source_column_of(source_file* src, u32 offset) {
+    return offset - src->line_starts[source_line_of(src, offset)];
+}
+
+string source_line_text(source_file* src, u32 line) {
+    //the line without its \n
+    if (src->line_starts == NULL) source_build_lines(src);
+    u32 start = src->line_starts[line];
+    u32 end = line + 1 < vec_len(src->line_starts) ? src->line_starts[line + 1] - 1 : src->buf.len;
+    return string_make(src->buf.raw + start, end - start);
+}
+
+source_file* token_source(token tok) {
+    //the file a token was spelled in, or NULL if it was made up along the way (pastes, stringising, ...)
+    if (tok.loc == 0) return NULL;
+    source_file* src = source_for_loc(tok.loc);
+    return src->is_scratch ? NULL : src;
+}
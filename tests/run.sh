@@ -47,4 +47,54 @@ do
     else
         break
     fi
-done
\ No newline at end of file
+done
+
+# preprocessor tests. anything in test-files with an .expected next to it gets run through -E and compared
+for file in ./test-files/*.c
+do
+    if test -f "$file.expected"
+    then
+        name=$(basename "$file")
+        status=0
+        ./$CC $CFLAGS -E $file -o "output/$name.i" > "output/$name.ccout" 2>&1 || status=$?
+
+        if ! [ -s "output/$name.ccout" ]
+        then
+            rm "output/$name.ccout"
+        fi
+
+        if [ $status -ne 0 ]
+        then
+            echo "Test $name failed: Failed to preprocess $file"
+            continue
+        fi
+
+        if ! diff -u "$file.expected" "output/$name.i"
+        then
+            echo "Test $name failed: Did not match expected value"
+            continue
+        fi
+    fi
+done
+
+# precompiled headers. pch-pre.h is made into a pch, and pch-use.c has to come out the same on top of it as it would
+# have on its own
+status=0
+./$CC $CFLAGS -emit-pch ./test-files/pch-pre.h -o output/pch-pre.h.pch > output/pch.ccout 2>&1 || status=$?
+if [ $status -eq 0 ]
+then
+    ./$CC $CFLAGS -E -include-pch output/pch-pre.h.pch ./test-files/pch-use.c -o output/pch-use.c.i >> output/pch.ccout 2>&1 || status=$?
+fi
+
+if ! [ -s "output/pch.ccout" ]
+then
+    rm "output/pch.ccout"
+fi
+
+if [ $status -ne 0 ]
+then
+    echo "Test pch-use.c failed: Failed to emit or include the pch"
+elif ! diff -u "./test-files/pch-use.c.pch.expected" "output/pch-use.c.i"
+then
+    echo "Test pch-use.c failed: Did not match expected value"
+fi
@@ -0,0 +1,4 @@
+#ifndef PCH_GUARDED_H
+#define PCH_GUARDED_H
+pch_guarded_token
+#endif
@@ -0,0 +1,2 @@
+#pragma once
+pch_once_token
@@ -0,0 +1,11 @@
+// run.sh makes this into a pch, and preprocesses pch-use.c on top of it
+
+#include "pch-guarded.h"
+#include "pch-once.h"
+
+#define PCH_OBJECT pch_object_expanded
+#define PCH_FUNCTION(x) pch_function_expanded(x)
+
+pch_pre_token
+
+#pragma once
@@ -0,0 +1,15 @@
+// preprocessed with -include-pch of pch-pre.h, so everything it did has been done already. it and every header it
+// read are guarded or #pragma once, so including them again adds nothing
+
+#include "pch-pre.h"
+#include "pch-guarded.h"
+#include "pch-once.h"
+
+PCH_OBJECT
+PCH_FUNCTION(1)
+
+#ifdef PCH_GUARDED_H
+pass_guard_defined
+#endif
+
+pass_end
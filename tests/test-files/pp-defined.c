@@ -0,0 +1,50 @@
+// defined, #ifdef and friends
+
+#define A
+#define B 0
+
+#if defined A && defined(B) && !defined C && !defined(C)
+pass_defined
+#endif
+
+// defined doesnt care what a macro expands to, even if its nothing
+#if defined(A) + defined B == 2
+pass_defined_sum
+#endif
+
+// the operand of defined isnt expanded, so this asks about B, not 0
+#if defined B
+pass_not_expanded
+#endif
+
+#ifdef A
+pass_ifdef
+#endif
+
+#ifndef C
+pass_ifndef
+#endif
+
+#ifdef C
+fail_elifdef_1
+#elifdef A
+pass_elifdef
+#endif
+
+#ifdef C
+fail_elifndef_1
+#elifndef D
+pass_elifndef
+#endif
+
+#undef A
+#ifdef A
+fail_undef
+#else
+pass_undef
+#endif
+
+// __LINE__ and __FILE__ arent in the macro table, but theyre defined
+#if defined __LINE__ && defined(__FILE__)
+pass_builtins
+#endif
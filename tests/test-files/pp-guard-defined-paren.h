@@ -0,0 +1,4 @@
+#if !defined(PP_GUARD_DEFINED_PAREN_H)
+#define PP_GUARD_DEFINED_PAREN_H
+guard_defined_paren
+#endif
@@ -0,0 +1,4 @@
+#if !defined PP_GUARD_DEFINED_H
+#define PP_GUARD_DEFINED_H
+guard_defined
+#endif
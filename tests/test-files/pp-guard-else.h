@@ -0,0 +1,6 @@
+#ifndef PP_GUARD_ELSE_H
+#define PP_GUARD_ELSE_H
+guard_else_first
+#else
+guard_else_again
+#endif
@@ -0,0 +1,4 @@
+#ifndef PP_GUARD_IFNDEF_H
+#define PP_GUARD_IFNDEF_H
+guard_ifndef
+#endif
@@ -0,0 +1,5 @@
+#ifndef PP_GUARD_TRAILING_H
+#define PP_GUARD_TRAILING_H
+guard_trailing
+#endif
+guard_trailing_after
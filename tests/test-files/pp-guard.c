@@ -0,0 +1,28 @@
+// include guards. a header thats guarded the usual way is only read the first time, and doesnt show up at all after
+// that. one thats nearly guarded (but not quite) has to be read every time
+
+#include "pp-guard-ifndef.h"
+#include "pp-guard-ifndef.h"
+
+#include "pp-guard-defined.h"
+#include "pp-guard-defined.h"
+
+#include "pp-guard-defined-paren.h"
+#include "pp-guard-defined-paren.h"
+
+// an #else on the outside means theres still something in it once the guard is defined
+#include "pp-guard-else.h"
+#include "pp-guard-else.h"
+
+// and so does anything after the #endif
+#include "pp-guard-trailing.h"
+#include "pp-guard-trailing.h"
+
+// once the guard is gone, the header is read again
+#undef PP_GUARD_IFNDEF_H
+#include "pp-guard-ifndef.h"
+
+#include "pp-guard-once.h"
+#include "pp-guard-once.h"
+
+pass_end
@@ -0,0 +1,33 @@
+// __has_include. a "name" is looked for next to this file first
+
+#ifdef __has_include
+pass_has_include_defined
+#endif
+
+#if __has_include("pp-has-include.h")
+pass_found
+#endif
+
+#if __has_include("pp-no-such-header.h")
+fail_missing
+#else
+pass_missing
+#endif
+
+// the header name can come out of a macro
+#define HEADER "pp-has-include.h"
+#if __has_include(HEADER)
+pass_from_macro
+#endif
+
+// but one thats spelled out isnt expanded. if it were, this would be asking about stdio.h
+#define cobalt_no_such_header stdio
+#if __has_include(<cobalt_no_such_header.h>)
+fail_painted
+#else
+pass_painted
+#endif
+
+#if defined(__has_include) && __has_include("pp-has-include.h") && !__has_include("pp-no-such-header.h")
+pass_combined
+#endif
@@ -0,0 +1 @@
+// found by pp-has-include.c
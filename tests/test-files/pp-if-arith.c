@@ -0,0 +1,92 @@
+// #if and #elif arithmetic. every group that should be read has a pass_ line in it, and every one that shouldnt
+// has a fail_ line, so the expected output is just the passes in order
+
+// precedence and associativity
+#if 1 + 2 * 3 == 7 && (1 + 2) * 3 == 9 && 10 - 4 - 3 == 3 && 100 / 10 / 5 == 2
+pass_precedence
+#else
+fail_precedence
+#endif
+
+#if -3 / 2 == -1 && -3 % 2 == -1 && 7 % -3 == 1
+pass_truncation
+#endif
+
+#if (1 << 4) == 16 && (256 >> 4 >> 2) == 4 && (0xF0 & 0x3C) == 0x30 && (0xF0 | 0x0F) == 0xFF && (0xFF ^ 0x0F) == 0xF0
+pass_bitwise
+#endif
+
+#if !0 && !!5 == 1 && ~0 == -1 && -(-4) == 4 && +7 == 7
+pass_unary
+#endif
+
+#if (2 > 1 ? 10 : 20) == 10 && (0 ? 10 : 1 ? 20 : 30) == 20
+pass_ternary
+#endif
+
+#if (1, 0)
+fail_comma
+#else
+pass_comma
+#endif
+
+// integer constants, in every base, with suffixes and digit separators
+#if 0x1F == 31 && 017 == 15 && 0b101 == 5 && 1'000'000 == 1000000 && 0x10UL == 16 && 10u == 10 && 5ll == 5 && 3wb == 3
+pass_constants
+#endif
+
+// character constants, escapes, and multi-char constants
+#if 'a' == 97 && '\n' == 10 && '\x41' == 65 && '\101' == 65 && '\0' == 0 && '\'' == 39 && 'ab' == 24930
+pass_chars
+#endif
+
+// true and false are keywords, and any other identifier left after expansion is 0
+#if true && !false && undefined_name == 0
+pass_keywords
+#endif
+
+// signed and unsigned. -1 turns into the biggest unsigned value when its compared with one
+#if -1 < 0 && !(-1 < 0u) && -1 > 0u && (0u - 1) == 0xFFFFFFFFFFFFFFFF && -1 / 2u > 0
+pass_conversions
+#endif
+
+#if (1 ? -1 : 0u) > 0
+pass_ternary_conversion
+#endif
+
+// division by zero only matters on the side thats evaluated
+#if 0 && 1 / 0
+fail_and
+#elif 1 || 1 % 0
+pass_short_circuit
+#endif
+
+#if (0 ? 1 / 0 : 2) == 2 && (1 ? 3 : 1 / 0) == 3
+pass_ternary_short_circuit
+#endif
+
+// macros get expanded before the line is evaluated
+#define TWO 2
+#define ADD(a, b) ((a) + (b))
+#define EMPTY
+#if ADD(TWO, 3) == 5 EMPTY && TWO * TWO == 4
+pass_macros
+#endif
+
+// #elif chains stop at the first one thats true
+#if TWO == 1
+fail_elif_1
+#elif TWO == 2
+pass_elif_2
+#elif TWO == 2
+fail_elif_3
+#else
+fail_elif_else
+#endif
+
+// once a group has been read, the rest of the #elifs arent even evaluated
+#if 1
+pass_first
+#elif 1 / 0
+fail_elif_unevaluated
+#endif
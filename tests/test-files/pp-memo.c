@@ -0,0 +1,41 @@
+// object-like macros remember what they expanded to. none of that can outlive a change to anything they used
+
+// a macro used through another one. changing the innermost has to reach the outermost
+#define A B
+#define B C
+#define C 1
+memo_transitive_before A
+#undef C
+#define C 2
+memo_transitive_after A
+
+// a function-like macro counts too
+#define F(x) (x + 1)
+#define G F(10)
+memo_function_before G
+#undef F
+#define F(x) (x * 2)
+memo_function_after G
+
+// a name that wasnt a macro when it was first used, and is now
+#define R S
+memo_undefined_before R
+#define S 3
+memo_undefined_after R
+
+// and ones that are only used after theyre gone
+#undef S
+memo_removed R
+
+// macros that name each other stop when they get back to themselves, however theyre reached
+#define D E
+#define E D
+memo_self_d D
+memo_self_e E
+memo_self_d_again D
+memo_self_e_again E
+
+// redefining one of them has to reach the other
+#undef E
+#define E D 4
+memo_self_changed D E
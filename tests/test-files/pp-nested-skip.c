@@ -0,0 +1,48 @@
+// skipped groups, nested inside each other. nothing in a skipped group is looked at but its directives,
+// so none of this should upset us
+
+#if 0
+    #if 1
+    fail_nested_1
+    #else
+    fail_nested_2
+    #endif
+    #ifdef anything
+    #elif 1 / 0
+    #endif
+    #error not reached
+    #unknown_directive
+    it's fine for this to not lex, since we don't read it: $ @ ` "\q"
+#elif 0
+fail_elif
+#else
+    pass_outer_else
+    #if 0
+        #if 1
+        fail_deep
+        #endif
+    #elif 1
+        pass_inner_elif
+        #if 0
+        #else
+            pass_innermost
+        #endif
+    #endif
+#endif
+
+#ifdef NOT_DEFINED
+    #ifndef NOT_DEFINED
+    fail_ifndef_inside_skip
+    #endif
+    #define SHOULD_NOT_BE_DEFINED
+#endif
+#ifndef SHOULD_NOT_BE_DEFINED
+pass_define_skipped
+#endif
+
+// an #endif at the end of a skipped group ends that group, not an outer one
+#if 1
+    #if 0
+    #endif
+pass_after_inner_endif
+#endif